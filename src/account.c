@@ -0,0 +1,417 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <errno.h>
+
+#include "util.h"
+#include "server.h"
+#include "connection.h"
+#include "socks5.h"
+#include "account.h"
+
+extern int debug;
+
+/* other blocks are read while their owner writes them */
+#define LOAD(x)		__atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define ADD(x, n)	__atomic_store_n(&(x), (x) + (n), __ATOMIC_RELAXED)
+
+struct user {
+	char name[ACCOUNT_NAME_MAX + 1];
+	char password[ACCOUNT_NAME_MAX + 1];
+	uint64_t quota;		/* bytes per period, 0 none */
+	uint64_t step;		/* bytes between quota checks */
+	int max_sessions;	/* 0 none */
+	/* totals from --accounting-file */
+	uint64_t base_up;
+	uint64_t base_down;
+	uint64_t base_sessions;
+	uint64_t base_period;
+	uint64_t base_period_bytes;
+};
+
+/* one user in one block, written by the thread that owns the block only */
+struct slot {
+	uint64_t up;
+	uint64_t down;
+	uint64_t sessions;
+	uint64_t period;	/* quota period the bytes below belong to */
+	uint64_t period_bytes;
+	int64_t active;
+	uint64_t checked;	/* period_bytes at the last quota check */
+} __attribute__((aligned(64)));
+
+static struct {
+	struct user *users;
+	int nusers;
+	int workers;
+	int worker;
+	int threads;		/* --relay-threads, each has a block of its own */
+	int blocks;		/* workers times (threads + 1) */
+	int period;
+	int interval;
+	const char *file;
+	time_t next_flush;
+	struct slot *slots;	/* blocks of nusers */
+	size_t size;
+} acc;
+
+/* the block the calling thread writes, see account_set_thread() */
+static __thread int block;
+
+static struct slot *slot_of(int b, int user)
+{
+	return &acc.slots[b * acc.nusers + user];
+}
+
+static uint64_t period_now(time_t now)
+{
+	return (uint64_t) now / acc.period;
+}
+
+static struct slot *own(int user, time_t now)
+{
+	struct slot *s = slot_of(block, user);
+	uint64_t cur = period_now(now);
+
+	if(s->period != cur) {
+		__atomic_store_n(&s->period_bytes, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&s->period, cur, __ATOMIC_RELEASE);
+		s->checked = 0;
+	}
+	return s;
+}
+
+static uint64_t period_bytes(int user, time_t now)
+{
+	struct user *u = &acc.users[user];
+	uint64_t cur = period_now(now), sum = 0;
+	struct slot *s;
+	int w;
+
+	for(w=0;w < acc.blocks; w++) {
+		s = slot_of(w, user);
+		if(__atomic_load_n(&s->period, __ATOMIC_ACQUIRE) == cur)
+			sum += LOAD(s->period_bytes);
+	}
+	if(u->base_period == cur)
+		sum += u->base_period_bytes;
+	return sum;
+}
+
+static int64_t active(int user)
+{
+	int64_t sum = 0;
+	int w;
+
+	for(w=0;w < acc.blocks; w++)
+		sum += LOAD(slot_of(w, user)->active);
+	return sum;
+}
+
+static uint64_t parse_size(const char *s)
+{
+	char *end;
+	uint64_t n = strtoull(s, &end, 10);
+
+	switch(*end) {
+		case 'g': case 'G': n <<= 10; /* fall through */
+		case 'm': case 'M': n <<= 10; /* fall through */
+		case 'k': case 'K': n <<= 10;
+	}
+	return n;
+}
+
+static struct user *user_add(const char *name, const char *password)
+{
+	struct user *u;
+
+	u = (struct user *) realloc(acc.users, (acc.nusers + 1) * sizeof *u);
+	if(!u)
+		return NULL;
+	acc.users = u;
+	u = &acc.users[acc.nusers++];
+	memset(u, 0, sizeof *u);
+	snprintf(u->name, sizeof u->name, "%s", name);
+	snprintf(u->password, sizeof u->password, "%s", password);
+	return u;
+}
+
+static int load_users(const char *path)
+{
+	char line[1024], name[ACCOUNT_NAME_MAX + 1], pwd[ACCOUNT_NAME_MAX + 1], quota[64];
+	struct user *u;
+	FILE *fp;
+
+	if((fp = fopen(path, "r")) == NULL) {
+		DEBUG("could not open %s", path);
+		return -1;
+	}
+	while(fgets(line, sizeof line, fp)) {
+		quota[0] = 0;
+		if(line[0] == '#' || sscanf(line, "%255s %255s %63s", name, pwd, quota) < 2)
+			continue;
+		if((u = user_add(name, pwd)) == NULL) {
+			fclose(fp);
+			return -1;
+		}
+		u->quota = parse_size(quota);
+		sscanf(line, "%*s %*s %*s %d", &u->max_sessions);
+	}
+	fclose(fp);
+	return 0;
+}
+
+static struct user *user_find(const char *name)
+{
+	int i;
+
+	for(i=0;i < acc.nusers; i++)
+		if(!strcmp(acc.users[i].name, name))
+			return &acc.users[i];
+	return NULL;
+}
+
+/* "name up down sessions period_start period_bytes" lines */
+static void load_totals(const char *path)
+{
+	char line[1024], name[ACCOUNT_NAME_MAX + 1];
+	unsigned long long up, down, sessions, start, bytes;
+	struct user *u;
+	FILE *fp;
+
+	if((fp = fopen(path, "r")) == NULL)
+		return;
+	while(fgets(line, sizeof line, fp)) {
+		if(line[0] == '#' || sscanf(line, "%255s %llu %llu %llu %llu %llu", name,
+			&up, &down, &sessions, &start, &bytes) != 6)
+			continue;
+		if((u = user_find(name)) == NULL)
+			continue;
+		u->base_up = up;
+		u->base_down = down;
+		u->base_sessions = sessions;
+		u->base_period = start / acc.period;
+		u->base_period_bytes = bytes;
+	}
+	fclose(fp);
+}
+
+int account_init(const char *users_file, const char *file, int interval,
+	int period, int workers, int threads)
+{
+	struct user *u;
+	int i;
+
+	memset(&acc, 0, sizeof acc);
+	acc.period = period > 0 ? period : DEFAULT_QUOTA_PERIOD;
+	acc.interval = interval > 0 ? interval : DEFAULT_ACCOUNTING_INTERVAL;
+	acc.workers = workers > 0 ? workers : 1;
+	acc.threads = threads > 0 ? threads : 0;
+	acc.blocks = acc.workers * (acc.threads + 1);
+	acc.file = file;
+
+	if(users_file ? load_users(users_file) < 0 : user_add(SOCKS5_UNAME, SOCKS5_PWD) == NULL)
+		return -1;
+	if(!acc.nusers)
+		return 0;
+	for(i=0;i < acc.nusers; i++) {
+		u = &acc.users[i];
+		u->step = u->quota / 16 < ACCOUNT_CHECK_BYTES ? u->quota / 16 : ACCOUNT_CHECK_BYTES;
+		if(!u->step)
+			u->step = 1;
+	}
+	if(file)
+		load_totals(file);
+
+	acc.size = (size_t) acc.blocks * acc.nusers * sizeof(struct slot);
+	acc.slots = (struct slot *) mmap(NULL, acc.size, PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if(acc.slots == MAP_FAILED) {
+		DEBUG("mmap() failed");
+		acc.slots = NULL;
+		return -1;
+	}
+	acc.next_flush = time(NULL) + acc.interval;
+	return 0;
+}
+
+void account_set_worker(int worker)
+{
+	acc.worker = worker < acc.workers ? worker : 0;
+	block = acc.worker * (acc.threads + 1);
+}
+
+/* on relay thread <thread> of this worker, before it relays */
+void account_set_thread(int thread)
+{
+	block = acc.worker * (acc.threads + 1) + 1 + (thread < acc.threads ? thread : 0);
+}
+
+int account_login(struct connection *conn, const char *name, const char *password)
+{
+	struct user *u = user_find(name);
+
+	if(!u || strcmp(u->password, password))
+		return -1;
+	conn->user = u - acc.users;
+	return 0;
+}
+
+const char *account_name(int user)
+{
+	return acc.users[user].name;
+}
+
+int account_request(struct connection *conn)
+{
+	struct user *u;
+	struct slot *s;
+
+	if(conn->user < 0 || !acc.slots)
+		return REPLY_SUCCESS;
+	u = &acc.users[conn->user];
+	if(u->max_sessions && active(conn->user) >= u->max_sessions) {
+		DEBUG("user %s is at %d sessions", u->name, u->max_sessions);
+		return REPLY_NALLOWD;
+	}
+	if(u->quota && period_bytes(conn->user, conn->srv->now) >= u->quota) {
+		DEBUG("user %s used up the quota", u->name);
+		return REPLY_NALLOWD;
+	}
+	s = own(conn->user, conn->srv->now);
+	ADD(s->active, 1);
+	ADD(s->sessions, 1);
+	conn->metered = 1;
+	return REPLY_SUCCESS;
+}
+
+int account_bytes(struct connection *client, int down, size_t n)
+{
+	struct user *u = &acc.users[client->user];
+	struct slot *s;
+
+	if(!client->metered)
+		return 0;
+	s = own(client->user, client->srv->now);
+	if(down)
+		ADD(s->down, n);
+	else
+		ADD(s->up, n);
+	ADD(s->period_bytes, n);
+	if(!u->quota || s->period_bytes - s->checked < u->step)
+		return 0;
+	s->checked = s->period_bytes;
+	return period_bytes(client->user, client->srv->now) >= u->quota ? -1 : 0;
+}
+
+void account_leave(struct connection *conn)
+{
+	if(!conn->metered)
+		return;
+	ADD(slot_of(block, conn->user)->active, -1);
+	conn->metered = 0;
+}
+
+static void totals(int user, uint64_t *up, uint64_t *down, uint64_t *sessions)
+{
+	struct user *u = &acc.users[user];
+	struct slot *s;
+	int w;
+
+	*up = u->base_up;
+	*down = u->base_down;
+	*sessions = u->base_sessions;
+	for(w=0;w < acc.blocks; w++) {
+		s = slot_of(w, user);
+		*up += LOAD(s->up);
+		*down += LOAD(s->down);
+		*sessions += LOAD(s->sessions);
+	}
+}
+
+void account_flush(void)
+{
+	char tmp[4096];
+	uint64_t up, down, sessions;
+	time_t now = time(NULL);
+	FILE *fp;
+	int i, fd;
+
+	if(!acc.file || !acc.slots || acc.worker)
+		return;
+	snprintf(tmp, sizeof tmp, "%s.tmp", acc.file);
+	if((fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644)) < 0 ||
+		(fp = fdopen(fd, "w")) == NULL) {
+		DEBUG("could not open %s", tmp);
+		if(fd >= 0)
+			close(fd);
+		return;
+	}
+	fprintf(fp, "# valeria accounting, quota period %d\n", acc.period);
+	fprintf(fp, "# user up down sessions period_start period_bytes\n");
+	for(i=0;i < acc.nusers; i++) {
+		totals(i, &up, &down, &sessions);
+		fprintf(fp, "%s %llu %llu %llu %llu %llu\n", acc.users[i].name,
+			(unsigned long long) up, (unsigned long long) down,
+			(unsigned long long) sessions,
+			(unsigned long long) (period_now(now) * acc.period),
+			(unsigned long long) period_bytes(i, now));
+	}
+	if(fflush(fp) != 0 || fsync(fd) < 0) {
+		DEBUG("accounting write failed");
+		fclose(fp);
+		return;
+	}
+	fclose(fp);
+	if(rename(tmp, acc.file) < 0)
+		DEBUG("rename %s failed", tmp);
+}
+
+void account_tick(time_t now)
+{
+	if(now < acc.next_flush)
+		return;
+	acc.next_flush = now + acc.interval;
+	account_flush();
+}
+
+void account_dump(FILE *fp)
+{
+	uint64_t up, down, sessions;
+	time_t now = time(NULL);
+	int i;
+
+	if(!acc.slots)
+		return;
+	for(i=0;i < acc.nusers; i++) {
+		totals(i, &up, &down, &sessions);
+		fprintf(fp, "user %s %llu %llu %llu %lld %llu %llu\n", acc.users[i].name,
+			(unsigned long long) up, (unsigned long long) down,
+			(unsigned long long) sessions, (long long) active(i),
+			(unsigned long long) period_bytes(i, now),
+			(unsigned long long) acc.users[i].quota);
+	}
+}
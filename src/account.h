@@ -0,0 +1,65 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef ACCOUNT_H
+#define ACCOUNT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include "connection.h"
+
+/**
+ * Per-user accounting and quotas. Users come from --users, one per
+ * line: "name password [bytes per period [concurrent sessions]]", with
+ * K/M/G suffixes and 0 for no limit; without it the built-in
+ * SOCKS5_UNAME/SOCKS5_PWD is the only user.
+ *
+ * Counters live in a MAP_SHARED mapping made before the -j fork, one
+ * block per worker and one more per relay thread of each worker. A
+ * thread only writes its own block, so the relay path takes no lock
+ * and shares no cache line; quota checks and the totals add up all
+ * the blocks. A quota period starts every
+ * --quota-period seconds; byte quotas are checked every
+ * ACCOUNT_CHECK_BYTES per worker, which bounds the overshoot.
+ *
+ * Worker 0 rewrites --accounting-file (write, fsync, rename) every
+ * --accounting-interval seconds, and the totals in it are loaded again
+ * at start.
+ */
+
+#define DEFAULT_QUOTA_PERIOD		(86400)
+#define DEFAULT_ACCOUNTING_INTERVAL	(60)
+#define ACCOUNT_CHECK_BYTES		(1 << 20)
+#define ACCOUNT_NAME_MAX		(255)
+
+int account_init(const char *users_file, const char *file, int interval,
+	int period, int workers, int threads);
+void account_set_worker(int worker);
+void account_set_thread(int thread);
+int account_login(struct connection *, const char *name, const char *password);
+int account_request(struct connection *);
+const char *account_name(int user);
+int account_bytes(struct connection *client, int down, size_t n);
+void account_leave(struct connection *);
+void account_tick(time_t now);
+void account_dump(FILE *);
+void account_flush(void);
+
+#endif
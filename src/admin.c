@@ -0,0 +1,448 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+#include <errno.h>
+
+#include "util.h"
+#include "server.h"
+#include "connection.h"
+#include "socks5.h"
+#include "admission.h"
+#include "offload.h"
+#include "account.h"
+#include "rthread.h"
+#include "flight.h"
+#include "stats.h"
+#include "admin.h"
+
+extern int debug;
+extern in_addr_t trace_addr;
+extern char *flight_file;
+extern int handshake_timeout;
+extern int connect_timeout;
+extern int idle_up_timeout;
+extern int idle_down_timeout;
+extern int half_close_timeout;
+extern int zerocopy_min;
+extern int relay_quantum;
+extern int relay_auth_weight;
+
+struct admin_client {
+	int fd;			/* -1 for a free slot */
+	int eof;		/* close once the output is sent */
+	unsigned int events;
+	size_t inlen;
+	char in[ADMIN_LINE_MAX];
+	char *out;		/* answers not yet taken by the socket */
+	size_t outlen;
+	size_t outoff;
+};
+
+static struct {
+	char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+	struct admin_client clients[ADMIN_CLIENTS_MAX];
+} ctl;
+
+/* process globals that can be changed with "set" */
+static const struct {
+	const char *name;
+	int *value;
+	int min;
+} settings[] = {
+	{ "handshake-timeout", &handshake_timeout, 1 },
+	{ "connect-timeout", &connect_timeout, 1 },
+	{ "idle-up-timeout", &idle_up_timeout, 1 },
+	{ "idle-down-timeout", &idle_down_timeout, 1 },
+	{ "half-close-timeout", &half_close_timeout, 1 },
+	{ "zerocopy-min", &zerocopy_min, 0 },
+	{ "relay-quantum", &relay_quantum, 1 },
+	{ "relay-auth-weight", &relay_auth_weight, 1 },
+};
+
+int admin_open(struct server *srv, const char *path)
+{
+	struct sockaddr_un addr;
+	struct epoll_event ev;
+	struct stat st;
+	int i;
+
+	for(i=0;i < ADMIN_CLIENTS_MAX; i++)
+		ctl.clients[i].fd = -1;
+	if(strlen(path) >= sizeof ctl.path) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(ctl.path, path);
+
+	srv->afd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if(srv->afd < 0)
+		return -1;
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	/* left behind by a previous run that did not exit cleanly */
+	if(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+	if(bind(srv->afd, (struct sockaddr *) &addr, sizeof addr) < 0)
+		return -1;
+	if(chmod(path, 0600) < 0 || listen(srv->afd, ADMIN_CLIENTS_MAX) < 0)
+		return -1;
+
+	ev.events = EPOLLIN;
+	ev.data.fd = srv->afd;
+	if(epoll_ctl(srv->epollfd, EPOLL_CTL_ADD, srv->afd, &ev) < 0)
+		return -1;
+	DEBUG("admin socket %s", path);
+	return 0;
+}
+
+static struct admin_client *client_of(int fd)
+{
+	int i;
+
+	for(i=0;i < ADMIN_CLIENTS_MAX; i++)
+		if(ctl.clients[i].fd == fd)
+			return &ctl.clients[i];
+	return NULL;
+}
+
+static void client_close(struct server *srv, struct admin_client *c)
+{
+	srv->connections[c->fd].type = -1;
+	close(c->fd);
+	free(c->out);
+	c->out = NULL;
+	c->outlen = c->outoff = c->inlen = 0;
+	c->fd = -1;
+}
+
+static void client_watch(struct server *srv, struct admin_client *c, unsigned int events)
+{
+	struct epoll_event ev;
+
+	if(c->events == events)
+		return;
+	ev.events = events;
+	ev.data.fd = c->fd;
+	if(epoll_ctl(srv->epollfd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+		DEBUG("epoll_ctl failed");
+	c->events = events;
+}
+
+static void admin_accept(struct server *srv)
+{
+	struct admin_client *c;
+	struct epoll_event ev;
+	int fd;
+
+	fd = accept4(srv->afd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+	if(fd < 0) {
+		errno = 0;
+		return;
+	}
+	/* admin clients are marked in the connection table, so no fd beyond it */
+	if(fd >= srv->open_max || (c = client_of(-1)) == NULL) {
+		DEBUG("admin client refused");
+		close(fd);
+		return;
+	}
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if(epoll_ctl(srv->epollfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		close(fd);
+		return;
+	}
+	c->fd = fd;
+	c->eof = 0;
+	c->events = EPOLLIN;
+	srv->connections[fd].type = ADMIN;
+}
+
+static struct connection *find_session(struct server *srv, unsigned long id)
+{
+	struct connection *conn;
+	int i;
+
+	for(i=0;i < srv->open_max; i++) {
+		conn = &srv->connections[i];
+		if(conn->open && conn->type == CLIENT && conn->id == id)
+			return conn;
+	}
+	return NULL;
+}
+
+static void list_sessions(struct server *srv, FILE *fp)
+{
+	struct connection *conn, *target;
+	char dest[INET6_ADDRSTRLEN + 8];
+	int i;
+
+	for(i=0;i < srv->open_max; i++) {
+		conn = &srv->connections[i];
+		if(!conn->open || conn->type != CLIENT)
+			continue;
+		target = connection_peer(conn);
+		fprintf(fp, "session %lu %s:%d %s %s %s %ld%s%s%s%s\n", conn->id,
+			inet_ntoa(conn->addr.sin_addr), ntohs(conn->addr.sin_port),
+			socks5_state_name(conn->state),
+			target ? dest_key_str(&target->dest, dest, sizeof dest) : "-",
+			conn->user >= 0 ? account_name(conn->user) : "-",
+			(long) (srv->now - conn->recv_time),
+			conn->http ? " http" : "", conn->transparent ? " transparent" : "",
+			conn->offload >= OFFLOAD_ON ? " offload" : "",
+			conn->srv != srv ? " relay-thread" : "");
+	}
+}
+
+static void print_settings(FILE *fp)
+{
+	int high, low, ip_max;
+	size_t i;
+
+	for(i=0;i < sizeof settings / sizeof settings[0]; i++)
+		fprintf(fp, "%s %d\n", settings[i].name, *settings[i].value);
+	admission_get_limits(&high, &low, &ip_max);
+	fprintf(fp, "admit-high %d\nadmit-low %d\nip-max %d\n", high, low, ip_max);
+	fprintf(fp, "trace %s\n", trace_addr ? inet_ntoa(*(struct in_addr *) &trace_addr) :
+		debug ? "all" : "off");
+}
+
+static int set_value(struct server *srv, const char *name, const char *arg)
+{
+	int high, low, ip_max, value;
+	char *end;
+	size_t i;
+
+	value = strtol(arg, &end, 10);
+	if(end == arg || *end)
+		return -1;
+	if(!strcmp(name, "idle-timeout")) {
+		if(value < 1)
+			return -1;
+		idle_up_timeout = idle_down_timeout = value;
+		return 0;
+	}
+	for(i=0;i < sizeof settings / sizeof settings[0]; i++) {
+		if(strcmp(name, settings[i].name))
+			continue;
+		if(value < settings[i].min)
+			return -1;
+		*settings[i].value = value;
+		return 0;
+	}
+	admission_get_limits(&high, &low, &ip_max);
+	if(!strcmp(name, "admit-high"))
+		high = value;
+	else if(!strcmp(name, "admit-low"))
+		low = value;
+	else if(!strcmp(name, "ip-max"))
+		ip_max = value;
+	else
+		return -1;
+	if(high < 1 || high > 100 || low < 1 || low > high || ip_max < 0)
+		return -1;
+	return admission_set(srv, high, low, ip_max);
+}
+
+/* one command, its output and the closing "ok" or "error" line go to fp */
+static void admin_command(struct server *srv, char *line, FILE *fp)
+{
+	struct connection *conn;
+	const char *err = NULL;
+	char *save, *cmd, *arg, *arg2;
+	in_addr_t addr;
+
+	if((cmd = strtok_r(line, " \t\r", &save)) == NULL)
+		return;
+	arg = strtok_r(NULL, " \t\r", &save);
+	arg2 = strtok_r(NULL, " \t\r", &save);
+
+	if(!strcmp(cmd, "help")) {
+		fprintf(fp, "stats | sessions | kill <id> | offload-pause <id> | drain\n"
+			"get | set <name> <value> | trace <addr>|all|off | flight-dump\n");
+	} else if(!strcmp(cmd, "stats")) {
+		stats_dump(srv, fp);
+	} else if(!strcmp(cmd, "sessions")) {
+		list_sessions(srv, fp);
+	} else if(!strcmp(cmd, "kill") || !strcmp(cmd, "offload-pause")) {
+		if(!arg || (conn = find_session(srv, strtoul(arg, NULL, 10))) == NULL)
+			err = "no such session";
+		else if(cmd[0] == 'o') {
+			if(offload_pause(conn) < 0)
+				err = "not offloaded";
+		} else if(conn->srv != srv)
+			rthread_kill(conn);
+		else {
+			if(connection_peer(conn) && connection_peer(conn)->open)
+				connection_close(connection_peer(conn));
+			connection_close(conn);
+		}
+	} else if(!strcmp(cmd, "drain")) {
+		server_drain(srv);
+		fprintf(fp, "draining %d connections\n", srv->open_count - 5);
+	} else if(!strcmp(cmd, "get")) {
+		print_settings(fp);
+	} else if(!strcmp(cmd, "set")) {
+		if(!arg || !arg2 || set_value(srv, arg, arg2) < 0)
+			err = "bad setting or value";
+	} else if(!strcmp(cmd, "trace")) {
+		if(!arg)
+			err = "trace <addr>|all|off";
+		else if(!strcmp(arg, "off") || !strcmp(arg, "all")) {
+			__atomic_store_n(&debug, arg[0] == 'a', __ATOMIC_RELAXED);
+			__atomic_store_n(&trace_addr, 0, __ATOMIC_RELAXED);
+		} else if(inet_pton(AF_INET, arg, &addr) == 1)
+			__atomic_store_n(&trace_addr, addr, __ATOMIC_RELAXED);
+		else
+			err = "bad address";
+	} else if(!strcmp(cmd, "flight-dump")) {
+		if(!flight_enabled())
+			err = "flight recorder is off";
+		else if(flight_dump(flight_file) < 0)
+			err = "could not write the flight dump";
+	} else
+		err = "unknown command, try help";
+
+	if(err)
+		fprintf(fp, "error %s\n", err);
+	else
+		fprintf(fp, "ok\n");
+}
+
+static void admin_flush(struct server *srv, struct admin_client *c)
+{
+	ssize_t n;
+
+	while(c->outoff < c->outlen) {
+		n = send(c->fd, c->out + c->outoff, c->outlen - c->outoff, MSG_DONTWAIT|MSG_NOSIGNAL);
+		if(n < 0) {
+			if(errno != EAGAIN) {
+				client_close(srv, c);
+				return;
+			}
+			errno = 0;
+			client_watch(srv, c, EPOLLOUT);
+			return;
+		}
+		c->outoff += n;
+	}
+	free(c->out);
+	c->out = NULL;
+	c->outlen = c->outoff = 0;
+	if(c->eof)
+		client_close(srv, c);
+	else
+		client_watch(srv, c, EPOLLIN);
+}
+
+static void admin_read(struct server *srv, struct admin_client *c)
+{
+	char *nl, *buf, *out;
+	size_t len, used;
+	ssize_t n;
+	FILE *fp;
+
+	n = recv(c->fd, c->in + c->inlen, sizeof c->in - c->inlen, MSG_DONTWAIT);
+	if(n < 0 && errno == EAGAIN) {
+		errno = 0;
+		return;
+	}
+	if(n <= 0)
+		c->eof = 1;
+	else
+		c->inlen += n;
+
+	if((fp = open_memstream(&buf, &len)) == NULL) {
+		client_close(srv, c);
+		return;
+	}
+	while((nl = memchr(c->in, '\n', c->inlen)) != NULL) {
+		*nl = 0;
+		used = nl + 1 - c->in;
+		admin_command(srv, c->in, fp);
+		memmove(c->in, c->in + used, c->inlen - used);
+		c->inlen -= used;
+	}
+	if(c->inlen == sizeof c->in) {
+		fprintf(fp, "error line too long\n");
+		c->eof = 1;
+	}
+	fclose(fp);
+
+	/* answers still queued from before go out first */
+	if(!c->out) {
+		c->out = buf;
+		c->outlen = len;
+	} else if((out = (char *) realloc(c->out, c->outlen + len)) != NULL) {
+		memcpy(out + c->outlen, buf, len);
+		c->out = out;
+		c->outlen += len;
+		free(buf);
+	} else {
+		free(buf);
+		client_close(srv, c);
+		return;
+	}
+	admin_flush(srv, c);
+}
+
+void admin_event(struct server *srv, int fd, unsigned int events)
+{
+	struct admin_client *c;
+
+	if(fd == srv->afd) {
+		admin_accept(srv);
+		return;
+	}
+	if((c = client_of(fd)) == NULL)
+		return;
+	if(events & EPOLLOUT)
+		admin_flush(srv, c);
+	else
+		admin_read(srv, c);
+}
+
+void admin_close(struct server *srv)
+{
+	int i;
+
+	if(srv->afd < 0)
+		return;
+	for(i=0;i < ADMIN_CLIENTS_MAX; i++)
+		if(ctl.clients[i].fd >= 0)
+			client_close(srv, &ctl.clients[i]);
+	close(srv->afd);
+	srv->afd = -1;
+	unlink(ctl.path);
+}
@@ -0,0 +1,46 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#include "server.h"
+
+/**
+ * Admin socket. A Unix stream socket served by the event loop like any
+ * other descriptor: one command per line, each answer ends with "ok" or
+ * "error <why>". It reads stats, lists and kills sessions, drains the
+ * worker, changes timeouts and limits and turns on debug output for one
+ * client address. Commands are short scans at most, the relay does not
+ * wait on them, and output that does not fit the socket is kept and
+ * sent on EPOLLOUT.
+ *
+ *	echo sessions | socat - UNIX-CONNECT:/tmp/valeria.sock
+ */
+
+#define ADMIN_CLIENTS_MAX	(8)
+#define ADMIN_LINE_MAX		(512)
+
+int admin_open(struct server *, const char *path);
+void admin_event(struct server *, int fd, unsigned int events);
+void admin_close(struct server *);
+
+#endif
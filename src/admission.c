@@ -0,0 +1,232 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <errno.h>
+
+#include "util.h"
+#include "server.h"
+#include "connection.h"
+#include "socks5.h"
+#include "admission.h"
+
+extern int debug;
+
+/* sessions per client address, open addressing with linear probing */
+struct ip_slot {
+	in_addr_t ip;
+	unsigned int count;	/* 0 marks an empty slot */
+};
+
+static struct {
+	int high;
+	int low;
+	int high_pct;
+	int low_pct;
+	int ip_max;
+	struct ip_slot *ips;
+	unsigned int mask;
+	struct admission_stats stats;
+} adm;
+
+static unsigned int ip_hash(in_addr_t ip)
+{
+	return (ip * 2654435761U) & adm.mask;
+}
+
+static struct ip_slot *ip_find(in_addr_t ip)
+{
+	unsigned int i = ip_hash(ip);
+
+	while(adm.ips[i].count && adm.ips[i].ip != ip)
+		i = (i + 1) & adm.mask;
+	return &adm.ips[i];
+}
+
+/* backward shift deletion keeps probe chains intact without tombstones */
+static void ip_remove(struct ip_slot *slot)
+{
+	unsigned int i = slot - adm.ips, j = i, k;
+
+	for(;;) {
+		adm.ips[i].count = 0;
+		do {
+			j = (j + 1) & adm.mask;
+			if(!adm.ips[j].count)
+				return;
+			k = ip_hash(adm.ips[j].ip);
+		} while(i <= j ? (i < k && k <= j) : (i < k || k <= j));
+		adm.ips[i] = adm.ips[j];
+		i = j;
+	}
+}
+
+int admission_init(struct server *srv, int high, int low, int ip_max)
+{
+	memset(&adm, 0, sizeof adm);
+	if(high <= 0 || high > 100)
+		high = DEFAULT_ADMIT_HIGH;
+	if(low <= 0 || low > high)
+		low = high * DEFAULT_ADMIT_LOW / DEFAULT_ADMIT_HIGH;
+	return admission_set(srv, high, low, ip_max);
+}
+
+/**
+ * Also used to change the limits of a running server. A per-address
+ * table made then starts with no counts, sessions that are already open
+ * are not held against their address.
+ */
+int admission_set(struct server *srv, int high, int low, int ip_max)
+{
+	unsigned int size = 2;
+
+	adm.high_pct = high;
+	adm.low_pct = low;
+	adm.high = srv->open_max * high / 100;
+	adm.low = srv->open_max * low / 100;
+	adm.ip_max = ip_max;
+
+	if(ip_max > 0 && !adm.ips) {
+		while(size < (unsigned int) srv->open_max * 2)
+			size <<= 1;
+		adm.ips = (struct ip_slot *) calloc(size, sizeof(struct ip_slot));
+		if(!adm.ips)
+			return -1;
+		adm.mask = size - 1;
+	}
+	return 0;
+}
+
+void admission_get_limits(int *high, int *low, int *ip_max)
+{
+	*high = adm.high_pct;
+	*low = adm.low_pct;
+	*ip_max = adm.ip_max;
+}
+
+int admission_accept(struct server *srv, in_addr_t ip)
+{
+	struct ip_slot *slot;
+
+	(void) srv;
+	if(!adm.ips)
+		return 0;
+	slot = ip_find(ip);
+	if(adm.ip_max > 0 && slot->count >= (unsigned int) adm.ip_max) {
+		adm.stats.ip_rejects++;
+		return -1;
+	}
+	slot->ip = ip;
+	slot->count++;
+	return 0;
+}
+
+void admission_leave(struct connection *conn)
+{
+	struct ip_slot *slot;
+
+	if(!adm.ips)
+		return;
+	slot = ip_find(conn->addr.sin_addr.s_addr);
+	if(slot->count && --slot->count == 0)
+		ip_remove(slot);
+}
+
+int admission_near(struct server *srv)
+{
+	return srv->open_count >= adm.low;
+}
+
+int admission_request(struct connection *conn)
+{
+	struct server *srv = conn->srv;
+
+	/* a session needs one more descriptor for the target */
+	if(srv->open_count >= srv->open_max - 1 ||
+		(admission_near(srv) && !conn->authed)) {
+		adm.stats.request_rejects++;
+		return REPLY_FAILURE;
+	}
+	return REPLY_SUCCESS;
+}
+
+void admission_reject_greeting(void)
+{
+	adm.stats.greeting_rejects++;
+}
+
+void admission_pause(struct server *srv)
+{
+	if(adm.stats.paused)
+		return;
+	if(epoll_ctl(srv->epollfd, EPOLL_CTL_DEL, srv->fd, NULL) < 0) {
+		DEBUG("epoll_ctl failed");
+		return;
+	}
+	if(srv->tfd >= 0 && epoll_ctl(srv->epollfd, EPOLL_CTL_DEL, srv->tfd, NULL) < 0)
+		DEBUG("epoll_ctl failed");
+	if(srv->sfd >= 0 && epoll_ctl(srv->epollfd, EPOLL_CTL_DEL, srv->sfd, NULL) < 0)
+		DEBUG("epoll_ctl failed");
+	adm.stats.paused = 1;
+	adm.stats.pauses++;
+	DEBUG("accept paused at %d open connections", srv->open_count);
+}
+
+void admission_update(struct server *srv)
+{
+	struct epoll_event ev;
+
+	if(srv->draining)
+		return;
+	if(!adm.stats.paused) {
+		if(srv->open_count >= adm.high)
+			admission_pause(srv);
+		return;
+	}
+	if(srv->open_count > adm.low)
+		return;
+	ev.events = EPOLLIN;
+	ev.data.fd = srv->fd;
+	if(epoll_ctl(srv->epollfd, EPOLL_CTL_ADD, srv->fd, &ev) < 0) {
+		DEBUG("epoll_ctl failed");
+		return;
+	}
+	ev.data.fd = srv->tfd;
+	if(srv->tfd >= 0 && epoll_ctl(srv->epollfd, EPOLL_CTL_ADD, srv->tfd, &ev) < 0)
+		DEBUG("epoll_ctl failed");
+	ev.data.fd = srv->sfd;
+	if(srv->sfd >= 0 && epoll_ctl(srv->epollfd, EPOLL_CTL_ADD, srv->sfd, &ev) < 0)
+		DEBUG("epoll_ctl failed");
+	adm.stats.paused = 0;
+	DEBUG("accept resumed at %d open connections", srv->open_count);
+}
+
+void admission_get_stats(struct admission_stats *stats)
+{
+	*stats = adm.stats;
+}
+
+void admission_destroy(void)
+{
+	free(adm.ips);
+	adm.ips = NULL;
+}
@@ -0,0 +1,62 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <netinet/in.h>
+#include "server.h"
+#include "connection.h"
+
+/**
+ * Admission control. The listener leaves epoll when open connections
+ * reach the high watermark and comes back at the low one. Between the
+ * low watermark and the limit only clients that authenticated get a
+ * session; the others are turned away at the greeting or the request,
+ * before any DNS or connect work. Each client address may also hold at
+ * most --ip-max sessions.
+ */
+
+#define DEFAULT_ADMIT_HIGH	(90)	/* percent of open_max */
+#define DEFAULT_ADMIT_LOW	(75)
+
+struct admission_stats {
+	int paused;
+	unsigned long pauses;
+	unsigned long ip_rejects;
+	unsigned long greeting_rejects;
+	unsigned long request_rejects;
+};
+
+int admission_init(struct server *, int high, int low, int ip_max);
+int admission_set(struct server *, int high, int low, int ip_max);
+void admission_get_limits(int *high, int *low, int *ip_max);
+int admission_accept(struct server *, in_addr_t);
+void admission_leave(struct connection *);
+int admission_near(struct server *);
+int admission_request(struct connection *);
+void admission_reject_greeting(void);
+void admission_pause(struct server *);
+void admission_update(struct server *);
+void admission_get_stats(struct admission_stats *);
+void admission_destroy(void);
+
+#endif
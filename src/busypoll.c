@@ -0,0 +1,174 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <linux/types.h>
+
+#include "util.h"
+#include "busypoll.h"
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL		(46)
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL	(69)
+#endif
+
+/* linux/eventpoll.h from 6.9 */
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+	__u32 busy_poll_usecs;
+	__u16 busy_poll_budget;
+	__u8 prefer_busy_poll;
+	__u8 __pad;
+};
+#define EPIOCSPARAMS		_IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+/* packets per poll of the device queue, the kernel's own default */
+#define BUSYPOLL_BUDGET		(8)
+
+extern int debug;
+
+static struct {
+	int usecs;
+	struct busypoll_stats stats;
+	unsigned long hist[BUSYPOLL_BUCKETS];
+} bp;
+
+/* keep a worker that was not pinned by -j on the CPU it runs on now */
+static void pin_cpu(void)
+{
+	cpu_set_t set;
+	int cpu;
+
+	if(sched_getaffinity(0, sizeof set, &set) < 0 || CPU_COUNT(&set) == 1)
+		return;
+	if((cpu = sched_getcpu()) < 0)
+		return;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if(sched_setaffinity(0, sizeof set, &set) < 0)
+		DEBUG("could not pin to cpu %d", cpu);
+}
+
+int busypoll_init(int epollfd, int usecs, int spin_us)
+{
+	struct epoll_params params;
+
+	memset(&bp, 0, sizeof bp);
+	if(usecs <= 0)
+		return 0;
+	bp.usecs = usecs;
+
+	memset(&params, 0, sizeof params);
+	params.busy_poll_usecs = usecs;
+	params.busy_poll_budget = BUSYPOLL_BUDGET;
+	params.prefer_busy_poll = 1;
+	if(ioctl(epollfd, EPIOCSPARAMS, &params) == 0)
+		bp.stats.epoll = 1;
+	else
+		DEBUG("no epoll busy poll, spinning in user space");
+	errno = 0;
+
+	/* -1: spin only when the kernel does not poll for us */
+	bp.stats.spin_us = spin_us >= 0 ? spin_us : (bp.stats.epoll ? 0 : usecs);
+	pin_cpu();
+	return 0;
+}
+
+/**
+ * Raising SO_BUSY_POLL above net.core.busy_read needs CAP_NET_ADMIN;
+ * without it the socket still prefers busy polling from epoll.
+ */
+void busypoll_socket(int fd)
+{
+	int val = 1;
+
+	if(!bp.usecs)
+		return;
+	if(setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &bp.usecs, sizeof bp.usecs) < 0 ||
+		setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &val, sizeof val) < 0) {
+		bp.stats.socket_failures++;
+		errno = 0;
+	}
+}
+
+static void hist_add(uint64_t us)
+{
+	int b = 0;
+
+	while(us && b < BUSYPOLL_BUCKETS - 1) {
+		us >>= 1;
+		b++;
+	}
+	bp.hist[b]++;
+}
+
+int busypoll_wait(int epollfd, struct epoll_event *events, int max, int timeout)
+{
+	uint64_t start, elapsed;
+	int n;
+
+	if(!bp.stats.spin_us || !timeout)
+		return epoll_wait(epollfd, events, max, timeout);
+
+	start = monotonic_ns();
+	for(;;) {
+		n = epoll_wait(epollfd, events, max, 0);
+		elapsed = (monotonic_ns() - start) / 1000;
+		if(n < 0)
+			return n;
+		if(n > 0) {
+			bp.stats.hits++;
+			bp.stats.spin_us_total += elapsed;
+			hist_add(elapsed);
+			return n;
+		}
+		if(elapsed >= (uint64_t) bp.stats.spin_us)
+			break;
+	}
+	bp.stats.misses++;
+	bp.stats.spin_us_total += elapsed;
+	bp.stats.wasted_us += elapsed;
+	return epoll_wait(epollfd, events, max, timeout);
+}
+
+void busypoll_get_stats(struct busypoll_stats *st)
+{
+	*st = bp.stats;
+}
+
+void busypoll_dump(FILE *fp)
+{
+	int b;
+
+	if(!bp.usecs)
+		return;
+	for(b=0;b < BUSYPOLL_BUCKETS; b++)
+		if(bp.hist[b])
+			fprintf(fp, "busypoll_hit_us %lu %lu\n", b ? 1UL << (b - 1) : 0UL, bp.hist[b]);
+}
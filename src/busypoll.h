@@ -0,0 +1,57 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef BUSYPOLL_H
+#define BUSYPOLL_H
+
+#include <stdio.h>
+#include <sys/epoll.h>
+
+/**
+ * --busy-poll trades CPU for wakeup latency. Sockets get SO_BUSY_POLL
+ * and SO_PREFER_BUSY_POLL, and the epoll set is given the same budget
+ * with EPIOCSPARAMS, so the kernel polls the device queue instead of
+ * waiting for an interrupt. Where the kernel lacks EPIOCSPARAMS the
+ * loop spins on a zero timeout epoll_wait() itself for --busy-poll-spin
+ * microseconds before blocking. The worker stays on one CPU.
+ *
+ * Spins that found an event are counted in a log2 histogram of how long
+ * they spun; spins that ran out are the CPU paid for nothing.
+ */
+
+#define BUSYPOLL_BUCKETS	(24)
+
+struct busypoll_stats {
+	int epoll;		/* the kernel busy-polls the epoll set */
+	int spin_us;
+	unsigned long socket_failures;
+	unsigned long hits;	/* spins that ended with an event */
+	unsigned long misses;	/* spins that ran out and blocked */
+	unsigned long spin_us_total;
+	unsigned long wasted_us;	/* spent in spins that missed */
+};
+
+int busypoll_init(int epollfd, int usecs, int spin_us);
+void busypoll_socket(int fd);
+int busypoll_wait(int epollfd, struct epoll_event *, int max, int timeout);
+void busypoll_get_stats(struct busypoll_stats *);
+void busypoll_dump(FILE *);
+
+#endif
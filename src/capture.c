@@ -0,0 +1,225 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "util.h"
+#include "connection.h"
+#include "capture.h"
+
+#define CAPTURE_BUF_SIZE	(65536)
+
+extern int debug;
+
+struct capture {
+	struct capture_record rec;
+	uint64_t accept_us;
+	uint64_t request_at;
+	uint64_t relay_at;
+	uint64_t last_start;	/* start of the current burst */
+	uint64_t last_read;
+	int last_dir;
+	uint32_t size;
+	struct capture_burst *bursts;
+};
+
+/**
+ * Records are batched and written with O_APPEND, so the processes of
+ * -j can share one file without tearing each other's records.
+ */
+static struct {
+	int fd;
+	uint64_t t0;
+	size_t used;
+	char buf[CAPTURE_BUF_SIZE];
+} cap = { .fd = -1 };
+
+static uint64_t now_us(void)
+{
+	return monotonic_ns() / 1000;
+}
+
+int capture_open(const char *path)
+{
+	struct stat st;
+
+	cap.fd = open(path, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+	if(cap.fd < 0)
+		return -1;
+	if(fstat(cap.fd, &st) < 0)
+		return -1;
+	if(st.st_size == 0 && write(cap.fd, CAPTURE_MAGIC, 8) != 8)
+		return -1;
+	cap.t0 = now_us();
+	return 0;
+}
+
+static void capture_flush(void)
+{
+	if(cap.used && write(cap.fd, cap.buf, cap.used) < 0)
+		DEBUG("capture write failed");
+	cap.used = 0;
+}
+
+void capture_start(struct connection *conn)
+{
+	struct capture *c;
+
+	conn->cap = NULL;
+	if(cap.fd < 0)
+		return;
+	if((c = (struct capture *) calloc(1, sizeof(struct capture))) == NULL)
+		return;
+	c->accept_us = now_us();
+	c->rec.start_us = c->accept_us - cap.t0;
+	c->rec.reply = CAPTURE_NO_REPLY;
+	c->last_dir = -1;
+	conn->cap = c;
+}
+
+void capture_auth(struct connection *conn, int method)
+{
+	if(conn->cap)
+		conn->cap->rec.auth = method;
+}
+
+void capture_request(struct connection *conn, int atyp)
+{
+	struct capture *c = conn->cap;
+
+	if(!c)
+		return;
+	c->request_at = now_us();
+	c->rec.atyp = atyp;
+	c->rec.request_us = c->request_at - c->accept_us;
+}
+
+void capture_connected(struct connection *conn)
+{
+	struct capture *c = conn->cap;
+
+	if(!c)
+		return;
+	c->relay_at = now_us();
+	if(c->request_at)
+		c->rec.connect_us = c->relay_at - c->request_at;
+}
+
+void capture_reply(struct connection *conn, int reply)
+{
+	if(conn->cap && conn->cap->rec.reply == CAPTURE_NO_REPLY)
+		conn->cap->rec.reply = reply;
+}
+
+void capture_burst(struct connection *conn, int down, size_t bytes)
+{
+	struct capture *c = conn->cap;
+	struct capture_burst *b;
+	uint64_t now = now_us();
+	uint32_t n = c->rec.nbursts;
+
+	if(n && down == c->last_dir && now - c->last_read < CAPTURE_GAP_US &&
+		(c->bursts[n-1].bytes & ~CAPTURE_DOWN) + bytes < CAPTURE_DOWN) {
+		c->bursts[n-1].bytes += bytes;
+		c->last_read = now;
+		return;
+	}
+	if(n == CAPTURE_MAX_BURSTS) {
+		c->rec.flags |= CAPTURE_TRUNCATED;
+		return;
+	}
+	if(n == c->size) {
+		c->size = c->size ? c->size * 2 : 16;
+		b = (struct capture_burst *) realloc(c->bursts, c->size * sizeof *b);
+		if(!b) {
+			c->rec.flags |= CAPTURE_TRUNCATED;
+			c->size = n;
+			return;
+		}
+		c->bursts = b;
+	}
+	b = &c->bursts[n];
+	b->delta_us = now - (n ? c->last_start : c->relay_at);
+	b->bytes = bytes | (down ? CAPTURE_DOWN : 0);
+	c->rec.nbursts++;
+	c->last_dir = down;
+	c->last_start = c->last_read = now;
+}
+
+void capture_tcp(struct connection *conn, int leg, const struct tcp_sample *s)
+{
+	struct capture_tcp *t;
+
+	if(!conn->cap)
+		return;
+	t = &conn->cap->rec.tcp[leg];
+	t->rtt_us = s->rtt_us;
+	t->rtt_max_us = s->rtt_max_us;
+	t->retrans = s->retrans;
+	t->sndq_max = s->sndq_max;
+	t->rate = s->rate;
+	t->mptcp = s->mptcp;
+	t->subflows = s->subflows;
+}
+
+void capture_end(struct connection *conn)
+{
+	struct capture *c = conn->cap;
+	size_t bsize, len;
+
+	if(!c)
+		return;
+	conn->cap = NULL;
+
+	bsize = c->rec.nbursts * sizeof(struct capture_burst);
+	c->rec.len = sizeof c->rec + bsize;
+	c->rec.duration_us = now_us() - c->accept_us;
+
+	/* CAPTURE_MAX_BURSTS keeps every record well below the batch size */
+	if(cap.used + c->rec.len > sizeof cap.buf)
+		capture_flush();
+	len = sizeof c->rec;
+	memcpy(cap.buf + cap.used, &c->rec, len);
+	if(bsize)
+		memcpy(cap.buf + cap.used + len, c->bursts, bsize);
+	cap.used += c->rec.len;
+	free(c->bursts);
+	free(c);
+}
+
+void capture_tick(void)
+{
+	if(cap.fd >= 0)
+		capture_flush();
+}
+
+void capture_close(void)
+{
+	if(cap.fd < 0)
+		return;
+	capture_flush();
+	close(cap.fd);
+	cap.fd = -1;
+}
@@ -0,0 +1,94 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include "connection.h"
+
+/**
+ * Workload capture (--capture <file>). One record per session, written
+ * when the client connection closes. Only metadata is kept: handshake
+ * and target kind, phase timings and the relay as a list of bursts
+ * (runs of reads in one direction less than CAPTURE_GAP_US apart).
+ * tools/replay plays a capture back against a local valeria.
+ *
+ * File layout, host byte order:
+ *	CAPTURE_MAGIC, then records of
+ *	struct capture_record followed by nbursts struct capture_burst
+ */
+
+#define CAPTURE_MAGIC		"VLRCAP3\n"
+#define CAPTURE_GAP_US		(1000)
+#define CAPTURE_MAX_BURSTS	(4096)
+
+#define CAPTURE_TRUNCATED	(1)	/* more bursts than CAPTURE_MAX_BURSTS */
+#define CAPTURE_DOWN		(0x80000000U)	/* burst flows target -> client */
+#define CAPTURE_NO_REPLY	(0xff)
+
+/* last TCP_INFO sample of a leg, all zero without --tcp-sample */
+struct capture_tcp {
+	uint32_t rtt_us;
+	uint32_t rtt_max_us;
+	uint32_t retrans;
+	uint32_t sndq_max;
+	uint64_t rate;		/* delivery rate, bytes/s */
+	uint8_t mptcp;		/* enum mptcp_leg */
+	uint8_t subflows;	/* most MPTCP subflows seen */
+	uint16_t reserved;
+} __attribute__((__packed__));
+
+struct capture_record {
+	uint32_t len;		/* bytes of the record including its bursts */
+	uint8_t auth;		/* method selected at the greeting */
+	uint8_t atyp;		/* address type of the request, 0 if none */
+	uint8_t reply;		/* reply sent to the client, CAPTURE_NO_REPLY */
+	uint8_t flags;
+	uint64_t start_us;	/* accept, relative to the start of the capture */
+	uint32_t request_us;	/* accept -> request received */
+	uint32_t connect_us;	/* request -> target connected */
+	uint64_t duration_us;	/* accept -> close */
+	uint32_t nbursts;
+	uint32_t reserved;
+	struct capture_tcp tcp[TCPSTAT_LEGS];	/* client leg, target leg */
+} __attribute__((__packed__));
+
+struct capture_burst {
+	uint32_t delta_us;	/* since the previous burst started (or relay start) */
+	uint32_t bytes;		/* with CAPTURE_DOWN for target -> client */
+} __attribute__((__packed__));
+
+struct capture;
+
+int capture_open(const char *);
+void capture_start(struct connection *);
+void capture_auth(struct connection *, int);
+void capture_request(struct connection *, int);
+void capture_connected(struct connection *);
+void capture_reply(struct connection *, int);
+void capture_burst(struct connection *, int, size_t);
+void capture_tcp(struct connection *, int, const struct tcp_sample *);
+void capture_end(struct connection *);
+void capture_tick(void);
+void capture_close(void);
+
+#endif
@@ -18,9 +18,22 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <sys/epoll.h>
 #include "connection.h"
+#include "relay.h"
+#include "admission.h"
+#include "capture.h"
+#include "egress.h"
+#include "offload.h"
+#include "tcpstat.h"
+#include "account.h"
+#include "dest.h"
+#include "tls.h"
+#include "rthread.h"
 #include "util.h"
+#include "probes.h"
 
 
 struct connection *connection_new(int fd)
@@ -36,18 +49,91 @@ int connection_open(struct connection *conn,int type)
 {
 	conn->open = 1;
 	conn->type = type;
+	conn->dst_fd = -1;
+	conn->authed = 0;
+	conn->user = -1;
+	conn->metered = 0;
+	conn->http = 0;
+	conn->http_scan = 0;
+	conn->transparent = 0;
+	conn->capped = 0;
+	conn->tls = NULL;
+	conn->eof = 0;
+	conn->shut = 0;
+	conn->retired = 0;
+	conn->relayed = 0;
+	conn->dest_wait = 0;
 	conn->recv_time= time(NULL);
+	conn->deadline = 0;
+	memset(&conn->tcp, 0, sizeof conn->tcp);
 	conn->srv->open_count++;
 	return 0;
 }
 
 int connection_close(struct connection *conn)
 {
+	/* a relay thread hands the session back, the control thread closes it */
+	if(conn->srv->rthread) {
+		rthread_retire(conn);
+		return 0;
+	}
+	PROBE2(close, conn->id, conn->fd);
+	tcpstat_close(conn);
+	relay_release(conn);
+	offload_release(conn);
+	tls_release(conn);
+	if(conn->type == CLIENT) {
+		admission_leave(conn);
+		account_leave(conn);
+		dest_release(conn);
+		capture_end(conn);
+	} else
+		egress_release(conn, 0);
+	/* the slot may be reused before the peer goes, do not leave it pointing here */
+	if(connection_peer(conn) && connection_peer(conn)->dst_fd == conn->fd)
+		connection_peer(conn)->dst_fd = -1;
+	conn->dst_fd = -1;
 	close(conn->fd);
 	conn->open = 0;
+	conn->events = 0;
 	conn->srv->open_count--;
 	return 0;
 }
+void connection_set_state(struct connection *conn, int state)
+{
+	PROBE3(state, conn->id, conn->state, state);
+	conn->state = state;
+}
+
+int connection_watch(struct connection *conn, unsigned int events)
+{
+	struct epoll_event ev;
+	int op = conn->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+	if(conn->events == events)
+		return 0;
+	/* nothing to wait for: out of the set, or hangups would still wake us */
+	if(!events) {
+		if(epoll_ctl(conn->srv->epollfd, EPOLL_CTL_DEL, conn->fd, NULL) < 0)
+			return -1;
+		conn->events = 0;
+		return 0;
+	}
+	ev.events = events;
+	ev.data.fd = conn->fd;
+	if(epoll_ctl(conn->srv->epollfd, op, conn->fd, &ev) < 0)
+		return -1;
+	conn->events = events;
+	return 0;
+}
+
+struct connection *connection_peer(struct connection *conn)
+{
+	if(conn->dst_fd < 0)
+		return NULL;
+	return &conn->srv->connections[conn->dst_fd];
+}
+
 int connection_destroy(struct connection **conn)
 {
 	free(*conn);
@@ -24,26 +24,74 @@
 
 #include <time.h>
 #include "server.h"
+#include "pool.h"
+#include "util.h"
+#include "tcpstat.h"
 
 #define DEFAULT_MAX_OPEN	(8192)
 
 enum connection_type {
 	CLIENT,
-	TARGET };
+	TARGET,
+	ADMIN };	/* admin socket client, the slot is never opened */
 
 struct connection {
 	struct server *srv;
+	unsigned long id;
 	int fd;
 	int dst_fd;
 	unsigned char open;
 	int state;
 	int type;
 	time_t recv_time;
+	time_t deadline;		/* end of the handshake or connect phase */
+	struct sockaddr_in addr;	/* peer address of a client */
+	struct dest_key dest;		/* where a target connects to */
+	unsigned char capped;		/* client holding a --dest-cap slot */
+	unsigned char dest_wait;	/* DEST_WAITING or DEST_GRANTED for a slot */
+	int wait_prev;
+	int wait_next;
+	uint64_t wait_since;		/* queued at, microseconds */
+	int egress;			/* source address in the egress pool, -1 none */
+	unsigned char authed;		/* passed username/password auth */
+	int user;			/* index in the account table, -1 none */
+	unsigned char metered;		/* counted against the user's quotas */
+	unsigned char http;		/* came in with an HTTP CONNECT request */
+	unsigned int http_scan;		/* header bytes already searched for its end */
+	unsigned char transparent;	/* redirected to us, never sent a request */
+	struct capture *cap;		/* --capture record being built */
+	struct tls_session *tls;	/* TLS handshake before the kernel takes over */
+	unsigned int events;		/* epoll interest currently registered */
+	struct buffer *buf;		/* read from fd, not yet written to dst_fd */
+	unsigned char eof;		/* read the FIN of this leg */
+	unsigned char shut;		/* sent our FIN on this leg */
+	unsigned char stalled;		/* waiting for the pool to have room */
+	int stall_prev;
+	int stall_next;
+	unsigned char ready;		/* on srv->ready_head, out of EPOLLIN */
+	int ready_prev;
+	int ready_next;
+	unsigned char retired;		/* closed on a relay thread, waiting for the control thread */
+	int rslot;			/* index in its relay thread's session list */
+	unsigned long relayed;		/* bytes read on a relay thread, for the top-k at close */
+	struct tcp_sample tcp;		/* TCP_INFO samples of this leg */
+	unsigned char offload;		/* enum offload_state, in the kernel sockmap */
+	unsigned char bulk;		/* flow classified as bulk by the relay */
+	unsigned char score;
+	signed char zc;			/* SO_ZEROCOPY: 0 untried, 1 on, -1 off */
+	int zc_error;
+	unsigned int zc_seq;		/* next MSG_ZEROCOPY send id */
+	unsigned int zc_done;		/* sends below this id completed */
+	struct buffer *zc_head;		/* buffers the kernel still references */
+	struct buffer *zc_tail;
 };
 
 struct connection *connection_new(int);
 int connection_open(struct connection *, int type);
 int connection_close(struct connection *);
+void connection_set_state(struct connection *, int);
+int connection_watch(struct connection *, unsigned int);
+struct connection *connection_peer(struct connection *);
 int connection_destroy(struct connection **);
 
 #endif
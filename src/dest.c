@@ -0,0 +1,355 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "socks5.h"
+#include "dest.h"
+
+extern int debug;
+extern int connect_timeout;
+
+enum circuit {
+	CIRCUIT_CLOSED,
+	CIRCUIT_OPEN,
+	CIRCUIT_HALF_OPEN	/* one probe connect in flight */
+};
+
+struct dest_entry {
+	struct dest_key key;
+	unsigned char used;
+	unsigned char state;
+	unsigned char reply;	/* what the last failure answered */
+	unsigned int failures;	/* in a row */
+	time_t until;		/* end of the open period or of the probe */
+	unsigned int active;	/* sessions holding a --dest-cap slot */
+	unsigned int queued;
+	int head;		/* waiting clients, linked through wait_next */
+	int tail;
+};
+
+static struct {
+	int failures;
+	int open_secs;
+	int cap;
+	int queue;
+	struct dest_entry *table;
+	int granted_head;	/* clients given a slot, not connecting yet */
+	int granted_tail;
+	struct dest_stats stats;
+} dest;
+
+#define DEST_MASK	(DEST_TABLE_SIZE - 1)
+
+static struct dest_entry *dest_find(const struct dest_key *key)
+{
+	unsigned int i = dest_key_hash(key) & DEST_MASK;
+
+	while(dest.table[i].used && !dest_key_equal(&dest.table[i].key, key))
+		i = (i + 1) & DEST_MASK;
+	return &dest.table[i];
+}
+
+/* backward shift deletion, as in the admission and topk tables */
+static void dest_remove(struct dest_entry *e)
+{
+	unsigned int i = e - dest.table, j = i, h;
+
+	if(e->state != CIRCUIT_CLOSED)
+		dest.stats.open--;
+	dest.stats.tracked--;
+	for(;;) {
+		dest.table[i].used = 0;
+		do {
+			j = (j + 1) & DEST_MASK;
+			if(!dest.table[j].used)
+				return;
+			h = dest_key_hash(&dest.table[j].key) & DEST_MASK;
+		} while(i <= j ? (i < h && h <= j) : (i < h || h <= j));
+		dest.table[i] = dest.table[j];
+		i = j;
+	}
+}
+
+int dest_init(int failures, int open_secs, int cap, int queue)
+{
+	dest_destroy();
+	dest.failures = failures;
+	dest.open_secs = open_secs > 0 ? open_secs : DEFAULT_BREAKER_OPEN;
+	dest.cap = cap;
+	dest.queue = queue;
+	dest.granted_head = dest.granted_tail = -1;
+	if(failures <= 0 && cap <= 0)
+		return 0;
+	dest.table = (struct dest_entry *) calloc(DEST_TABLE_SIZE, sizeof(struct dest_entry));
+	return dest.table ? 0 : -1;
+}
+
+/* REPLY_SUCCESS to go ahead with the connect, or the reply to fail fast with */
+int dest_admit(const struct dest_key *key, time_t now)
+{
+	struct dest_entry *e;
+
+	if(dest.failures <= 0)
+		return REPLY_SUCCESS;
+	e = dest_find(key);
+	if(!e->used || e->state == CIRCUIT_CLOSED)
+		return REPLY_SUCCESS;
+	if(now < e->until) {
+		dest.stats.fast_fails++;
+		return e->reply;
+	}
+	/* open period over, or the last probe never came back */
+	e->state = CIRCUIT_HALF_OPEN;
+	e->until = now + (connect_timeout > 0 ? connect_timeout : dest.open_secs);
+	dest.stats.probes++;
+	return REPLY_SUCCESS;
+}
+
+/* a closed circuit with no sessions and nobody waiting needs no entry */
+static void dest_tidy(struct dest_entry *e)
+{
+	if(!e->active && !e->queued && e->state == CIRCUIT_CLOSED && !e->failures)
+		dest_remove(e);
+}
+
+void dest_success(const struct dest_key *key)
+{
+	struct dest_entry *e;
+
+	if(dest.failures <= 0)
+		return;
+	e = dest_find(key);
+	if(!e->used)
+		return;
+	if(e->state != CIRCUIT_CLOSED)
+		dest.stats.open--;
+	e->state = CIRCUIT_CLOSED;
+	e->failures = 0;
+	dest_tidy(e);
+}
+
+/**
+ * Make room in a full table: drop an entry without sessions or waiters,
+ * a closed circuit that only counts failures before an open one. 0 when
+ * every entry is held by sessions.
+ */
+static int dest_evict(void)
+{
+	struct dest_entry *e, *open = NULL;
+	int i;
+
+	for(i=0;i < DEST_TABLE_SIZE; i++) {
+		e = &dest.table[i];
+		if(!e->used || e->active || e->queued)
+			continue;
+		if(e->state == CIRCUIT_CLOSED) {
+			dest_remove(e);
+			dest.stats.evictions++;
+			return 1;
+		}
+		if(!open)
+			open = e;
+	}
+	if(!open)
+		return 0;
+	dest_remove(open);
+	dest.stats.evictions++;
+	return 1;
+}
+
+/* NULL when the table is full of destinations with sessions */
+static struct dest_entry *dest_add(const struct dest_key *key)
+{
+	struct dest_entry *e = dest_find(key);
+
+	if(!e->used) {
+		if(dest.stats.tracked >= DEST_TABLE_SIZE * 3 / 4) {
+			if(!dest_evict())
+				return NULL;
+			/* the removal shifted entries, the slot may have moved */
+			e = dest_find(key);
+		}
+		memset(e, 0, sizeof *e);
+		e->key = *key;
+		e->used = 1;
+		e->head = e->tail = -1;
+		dest.stats.tracked++;
+	}
+	return e;
+}
+
+void dest_failure(const struct dest_key *key, int reply, time_t now)
+{
+	struct dest_entry *e;
+	char buf[DEST_STRLEN];
+
+	if(dest.failures <= 0 || (e = dest_add(key)) == NULL)
+		return;
+	e->reply = reply;
+	e->failures++;
+	if(e->state == CIRCUIT_HALF_OPEN || 
+		(e->state == CIRCUIT_CLOSED && e->failures >= (unsigned int) dest.failures)) {
+		if(e->state == CIRCUIT_CLOSED) {
+			dest.stats.open++;
+			dest.stats.trips++;
+			DEBUG("circuit open for %s", dest_key_str(key, buf, sizeof buf));
+		}
+		e->state = CIRCUIT_OPEN;
+		e->until = now + dest.open_secs;
+	}
+}
+
+/**
+ * 0 when the client may connect now, 1 when it was queued, -1 when the
+ * queue is full, or when the table has no room for the destination: an
+ * untracked one could not be held to the cap.
+ */
+int dest_acquire(struct connection *client, const struct dest_key *key)
+{
+	struct connection *tail;
+	struct dest_entry *e;
+
+	if(dest.cap <= 0)
+		return 0;
+	if((e = dest_add(key)) == NULL) {
+		dest.stats.table_full++;
+		return -1;
+	}
+	client->dest = *key;
+	if(e->active < (unsigned int) dest.cap) {
+		e->active++;
+		client->capped = 1;
+		return 0;
+	}
+	if(e->queued >= (unsigned int) dest.queue) {
+		dest.stats.queue_full++;
+		dest_tidy(e);
+		return -1;
+	}
+	client->dest_wait = DEST_WAITING;
+	client->wait_since = monotonic_ns() / 1000;
+	client->wait_next = -1;
+	client->wait_prev = e->tail;
+	if(e->tail >= 0) {
+		tail = &client->srv->connections[e->tail];
+		tail->wait_next = client->fd;
+	} else
+		e->head = client->fd;
+	e->tail = client->fd;
+	e->queued++;
+	dest.stats.waiting++;
+	dest.stats.waits++;
+	return 1;
+}
+
+static void wait_unlink(struct connection *conn, int *head, int *tail)
+{
+	struct connection *c = conn->srv->connections;
+
+	if(conn->wait_prev >= 0)
+		c[conn->wait_prev].wait_next = conn->wait_next;
+	else
+		*head = conn->wait_next;
+	if(conn->wait_next >= 0)
+		c[conn->wait_next].wait_prev = conn->wait_prev;
+	else
+		*tail = conn->wait_prev;
+}
+
+/* the client is closing: leave the queue or pass the slot on to the first waiter */
+void dest_release(struct connection *client)
+{
+	struct connection *next;
+	struct dest_entry *e;
+	uint64_t waited;
+
+	if(client->dest_wait == DEST_GRANTED)
+		wait_unlink(client, &dest.granted_head, &dest.granted_tail);
+	if(client->dest_wait == DEST_WAITING) {
+		client->dest_wait = DEST_RUNNING;
+		e = dest_find(&client->dest);
+		wait_unlink(client, &e->head, &e->tail);
+		e->queued--;
+		dest.stats.waiting--;
+		if(client->srv->now >= client->deadline)
+			dest.stats.expired++;
+		dest_tidy(e);
+		return;
+	}
+	client->dest_wait = DEST_RUNNING;
+	if(!client->capped)
+		return;
+	client->capped = 0;
+	e = dest_find(&client->dest);
+	if(!e->used)
+		return;
+	if(e->head < 0) {
+		e->active--;
+		dest_tidy(e);
+		return;
+	}
+
+	next = &client->srv->connections[e->head];
+	wait_unlink(next, &e->head, &e->tail);
+	e->queued--;
+	dest.stats.waiting--;
+	waited = monotonic_ns() / 1000 - next->wait_since;
+	dest.stats.wait_us += waited;
+	if(waited > dest.stats.wait_max_us)
+		dest.stats.wait_max_us = waited;
+	next->capped = 1;
+	next->dest_wait = DEST_GRANTED;
+	next->wait_next = -1;
+	next->wait_prev = dest.granted_tail;
+	if(dest.granted_tail >= 0)
+		client->srv->connections[dest.granted_tail].wait_next = next->fd;
+	else
+		dest.granted_head = next->fd;
+	dest.granted_tail = next->fd;
+}
+
+/* a client whose slot came free, to be connected from the event loop */
+struct connection *dest_next(struct server *srv)
+{
+	struct connection *conn;
+
+	if(dest.granted_head < 0)
+		return NULL;
+	conn = &srv->connections[dest.granted_head];
+	wait_unlink(conn, &dest.granted_head, &dest.granted_tail);
+	conn->dest_wait = DEST_RUNNING;
+	return conn;
+}
+
+void dest_get_stats(struct dest_stats *stats)
+{
+	*stats = dest.stats;
+}
+
+void dest_destroy(void)
+{
+	free(dest.table);
+	memset(&dest, 0, sizeof dest);
+	dest.granted_head = dest.granted_tail = -1;
+}
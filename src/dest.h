@@ -0,0 +1,87 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+
+#ifndef DEST_H
+#define DEST_H
+
+#include <time.h>
+#include "util.h"
+#include "server.h"
+#include "connection.h"
+
+/**
+ * Per-destination health. A destination whose connects failed
+ * --breaker-failures times in a row is cut off for --breaker-open
+ * seconds: requests for it are answered at once with the reply of the
+ * last failure instead of holding a client and a target slot until the
+ * connect fails or times out. After that one request is let through as
+ * a probe; its success closes the circuit, its failure opens it again.
+ * Only destinations that are failing take an entry, so the table stays
+ * small; when it is full an entry without sessions or waiters makes room.
+ *
+ * With --dest-cap a destination also has at most that many sessions,
+ * connecting or established. Requests over it wait in a FIFO of at most
+ * --dest-queue clients for a session to end, and for --connect-timeout
+ * at most; a full queue fails them at once. Destinations with sessions
+ * keep their entry while they have them, and a request for a new one
+ * fails too when all entries are such.
+ */
+
+#define DEFAULT_BREAKER_FAILURES	(5)
+#define DEFAULT_BREAKER_OPEN		(10)	/* seconds */
+#define DEFAULT_DEST_QUEUE		(64)
+#define DEST_TABLE_SIZE			(4096)
+
+/* connection.dest_wait */
+enum {
+	DEST_RUNNING,
+	DEST_WAITING,		/* in the queue of its destination */
+	DEST_GRANTED		/* given a slot, dest_next() hands it out */
+};
+
+struct dest_stats {
+	unsigned long tracked;		/* destinations with an entry */
+	unsigned long open;		/* circuits open or half-open now */
+	unsigned long trips;
+	unsigned long fast_fails;
+	unsigned long probes;
+	unsigned long waiting;		/* requests queued now */
+	unsigned long waits;		/* requests that had to queue */
+	unsigned long queue_full;	/* failed at once, queue full */
+	unsigned long expired;		/* gave up waiting */
+	unsigned long table_full;	/* failed at once, no entry free */
+	unsigned long evictions;	/* idle entries dropped for room */
+	unsigned long wait_us;		/* total wait of those granted */
+	unsigned long wait_max_us;
+};
+
+int dest_init(int failures, int open_secs, int cap, int queue);
+int dest_admit(const struct dest_key *, time_t now);
+int dest_acquire(struct connection *client, const struct dest_key *);
+void dest_release(struct connection *client);
+struct connection *dest_next(struct server *);
+void dest_success(const struct dest_key *);
+void dest_failure(const struct dest_key *, int reply, time_t now);
+void dest_get_stats(struct dest_stats *);
+void dest_destroy(void);
+
+#endif
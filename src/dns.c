@@ -0,0 +1,234 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <netdb.h>
+#include <resolv.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+
+#include "util.h"
+#include "server.h"
+#include "connection.h"
+#include "socks5.h"
+#include "probes.h"
+#include "dns.h"
+
+extern int debug;
+extern int dns_timeout;
+
+struct dns_query {
+	int fd;
+	unsigned long id;	/* the session, the fd may have moved on */
+	in_port_t port;
+	int ok;
+	int family;
+	in_addr_t addr;
+	struct in6_addr addr6;
+	char name[256];
+};
+
+/* at most DNS_QUEUE lookups are outstanding, so neither ring fills up */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	struct dns_query queue[DNS_QUEUE];	/* waiting for a resolver thread */
+	unsigned int qhead;
+	unsigned int qtail;
+	struct dns_query done[DNS_QUEUE];	/* answered, for the control thread */
+	unsigned int dhead;
+	unsigned int dtail;
+	int outstanding;
+	int efd;		/* srv->dfd */
+	struct dns_stats stats;
+} dns = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+	.efd = -1
+};
+
+static void resolve(struct dns_query *q)
+{
+	struct addrinfo hints, *res;
+
+	/* IPv4 only, as gethostbyname() answered before */
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(q->name, NULL, &hints, &res) != 0) {
+		q->ok = 0;
+		return;
+	}
+	q->ok = 1;
+	q->family = res->ai_family;
+	if(q->family == AF_INET6)
+		q->addr6 = ((struct sockaddr_in6 *) res->ai_addr)->sin6_addr;
+	else
+		q->addr = ((struct sockaddr_in *) res->ai_addr)->sin_addr.s_addr;
+	freeaddrinfo(res);
+}
+
+static void *dns_main(void *arg)
+{
+	struct dns_query q;
+	uint64_t one = 1;
+
+	(void) arg;
+	/* the resolver state is per thread: a dead nameserver holds it this long */
+	if(res_init() == 0) {
+		_res.retrans = dns_timeout > 0 ? dns_timeout : 1;
+		_res.retry = 1;
+	}
+	for(;;) {
+		pthread_mutex_lock(&dns.lock);
+		while(dns.qhead == dns.qtail)
+			pthread_cond_wait(&dns.wake, &dns.lock);
+		q = dns.queue[dns.qhead++ % DNS_QUEUE];
+		pthread_mutex_unlock(&dns.lock);
+
+		resolve(&q);
+
+		pthread_mutex_lock(&dns.lock);
+		dns.done[dns.dtail++ % DNS_QUEUE] = q;
+		pthread_mutex_unlock(&dns.lock);
+		if(write(dns.efd, &one, sizeof one) < 0)
+			errno = 0;
+	}
+	return NULL;
+}
+
+/* after the -j fork, each worker has resolver threads of its own */
+int dns_init(struct server *srv)
+{
+	struct epoll_event ev;
+	sigset_t all, old;
+	pthread_attr_t attr;
+	pthread_t tid;
+	int i, ret = 0;
+
+	if((dns.efd = eventfd(0, EFD_NONBLOCK)) < 0)
+		return -1;
+	ev.events = EPOLLIN;
+	ev.data.fd = dns.efd;
+	if(epoll_ctl(srv->epollfd, EPOLL_CTL_ADD, dns.efd, &ev) < 0)
+		return -1;
+	srv->dfd = dns.efd;
+
+	/* a lookup in flight at exit is simply abandoned */
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for(i=0;i < DNS_THREADS; i++)
+		if(pthread_create(&tid, &attr, dns_main, NULL) != 0) {
+			ret = -1;
+			break;
+		}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_attr_destroy(&attr);
+	return ret;
+}
+
+/**
+ * Queue a lookup for the session, which waits in S5_RESOLVE for the
+ * answer. Returns -1, nothing queued, when DNS_QUEUE are outstanding.
+ */
+int dns_lookup(struct connection *conn, const char *name, in_port_t port)
+{
+	struct dns_query *q;
+
+	if(dns.outstanding >= DNS_QUEUE) {
+		dns.stats.queue_full++;
+		return -1;
+	}
+	pthread_mutex_lock(&dns.lock);
+	q = &dns.queue[dns.qtail % DNS_QUEUE];
+	q->fd = conn->fd;
+	q->id = conn->id;
+	q->port = port;
+	strncpy(q->name, name, sizeof q->name - 1);
+	q->name[sizeof q->name - 1] = 0;
+	dns.qtail++;
+	pthread_cond_signal(&dns.wake);
+	pthread_mutex_unlock(&dns.lock);
+	dns.outstanding++;
+	dns.stats.lookups++;
+
+	PROBE1(dns_start, conn->id);
+	conn->deadline = conn->srv->now + dns_timeout;
+	connection_set_state(conn, S5_RESOLVE);
+	/* nothing to read until the target is up, a hangup still ends it */
+	return connection_watch(conn, EPOLLRDHUP);
+}
+
+void dns_collect(struct server *srv)
+{
+	struct connection *conn;
+	struct dns_query q;
+	uint64_t n;
+
+	if(read(dns.efd, &n, sizeof n) < 0)
+		errno = 0;
+	for(;;) {
+		pthread_mutex_lock(&dns.lock);
+		if(dns.dhead == dns.dtail) {
+			pthread_mutex_unlock(&dns.lock);
+			break;
+		}
+		q = dns.done[dns.dhead++ % DNS_QUEUE];
+		pthread_mutex_unlock(&dns.lock);
+		dns.outstanding--;
+
+		/* the session expired or closed, and the fd may be another one's */
+		conn = &srv->connections[q.fd];
+		if(!conn->open || conn->id != q.id || conn->state != S5_RESOLVE)
+			continue;
+		PROBE2(dns_done, conn->id, q.ok);
+		if(!q.ok) {
+			DEBUG("could not resolve %s", q.name);
+			dns.stats.failures++;
+			send_reply(conn, REPLY_HSTNRCH);
+			connection_close(conn);
+			continue;
+		}
+		DEBUG("resolved %s", q.name);
+		if(connect_target(conn, q.family, q.addr, &q.addr6, q.port) < 0)
+			DEBUG("connect_target failed");
+	}
+}
+
+/* server_timeout(): the session hit its --dns-timeout deadline */
+void dns_expired(struct connection *conn)
+{
+	DEBUG("session %lu: name resolution timed out", conn->id);
+	dns.stats.timeouts++;
+}
+
+void dns_get_stats(struct dns_stats *stats)
+{
+	*stats = dns.stats;
+}
@@ -0,0 +1,56 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifndef DNS_H
+#define DNS_H
+
+#include <netinet/in.h>
+#include "server.h"
+#include "connection.h"
+
+/**
+ * Name resolution off the event loop. dns_lookup() queues the name for
+ * a few resolver threads that run getaddrinfo(); the answers come back
+ * on a list that the control thread drains when the eventfd in its
+ * epoll set (srv->dfd) fires, and the session goes on to
+ * connect_target() from there. Meanwhile it waits in S5_RESOLVE with a
+ * --dns-timeout deadline that server_timeout() answers with
+ * REPLY_HSTNRCH, like the connect deadline. An answer for a session
+ * that expired or closed in the meantime is dropped.
+ */
+
+#define DNS_THREADS	(4)
+#define DNS_QUEUE	(1024)	/* lookups queued or being answered, per worker */
+
+struct dns_stats {
+	unsigned long lookups;
+	unsigned long failures;		/* no address for the name */
+	unsigned long timeouts;		/* the session's deadline came first */
+	unsigned long queue_full;	/* refused, DNS_QUEUE lookups outstanding */
+};
+
+int dns_init(struct server *);
+int dns_lookup(struct connection *, const char *name, in_port_t port);
+void dns_collect(struct server *);
+void dns_expired(struct connection *);
+void dns_get_stats(struct dns_stats *);
+
+#endif
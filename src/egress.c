@@ -0,0 +1,268 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+
+#include "util.h"
+#include "connection.h"
+#include "account.h"
+#include "egress.h"
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT	24
+#endif
+
+extern int debug;
+
+struct egress_addr {
+	struct sockaddr_storage addr;
+	unsigned long active;	/* target connections bound to it */
+	unsigned long total;
+	unsigned long exhausted;	/* connects that got EADDRNOTAVAIL */
+};
+
+struct egress_rule {
+	int auth;		/* matches authenticated sessions */
+	char user[ACCOUNT_NAME_MAX + 1];	/* or those of one user */
+	struct dest_key net;	/* or targets in net/bits */
+	int bits;
+	int to;			/* index in the pool */
+};
+
+static struct {
+	int policy;
+	int n;
+	struct egress_addr addrs[EGRESS_MAX];
+	int nrules;
+	struct egress_rule rules[EGRESS_MAX];
+} egress;
+
+static int parse_addr(const char *s, struct sockaddr_storage *ss)
+{
+	memset(ss, 0, sizeof *ss);
+	if(inet_pton(AF_INET, s, &((struct sockaddr_in *) ss)->sin_addr) == 1)
+		ss->ss_family = AF_INET;
+	else if(inet_pton(AF_INET6, s, &((struct sockaddr_in6 *) ss)->sin6_addr) == 1)
+		ss->ss_family = AF_INET6;
+	else
+		return -1;
+	return 0;
+}
+
+static int egress_find(const struct sockaddr_storage *ss)
+{
+	int i;
+
+	for(i=0;i < egress.n; i++)
+		if(egress.addrs[i].addr.ss_family == ss->ss_family &&
+			!memcmp(&egress.addrs[i].addr, ss, sizeof *ss))
+			return i;
+	return -1;
+}
+
+int egress_add(const char *s)
+{
+	struct sockaddr_storage ss;
+
+	if(parse_addr(s, &ss) < 0 || egress.n == EGRESS_MAX)
+		return -1;
+	if(egress_find(&ss) < 0)
+		egress.addrs[egress.n++].addr = ss;
+	return 0;
+}
+
+int egress_add_rule(const char *rule)
+{
+	struct egress_rule *r;
+	struct sockaddr_storage ss;
+	char match[ACCOUNT_NAME_MAX + 8], *eq, *slash;
+	size_t len;
+
+	/* "user=<name>=<addr>": the address follows the last '=' */
+	eq = strncmp(rule, "user=", 5) ? strchr(rule, '=') : strrchr(rule, '=');
+	if(egress.nrules == EGRESS_MAX || eq == NULL)
+		return -1;
+	len = eq - rule;
+	if(len >= sizeof match)
+		return -1;
+	memcpy(match, rule, len);
+	match[len] = 0;
+
+	/* the target address joins the pool too */
+	if(egress_add(eq + 1) < 0 || parse_addr(eq + 1, &ss) < 0)
+		return -1;
+	r = &egress.rules[egress.nrules];
+	memset(r, 0, sizeof *r);
+	r->to = egress_find(&ss);
+
+	if(!strcmp(match, "auth"))
+		r->auth = 1;
+	else if(!strncmp(match, "user=", 5)) {
+		if(!match[5])
+			return -1;
+		strcpy(r->user, match + 5);
+	} else {
+		if((slash = strchr(match, '/')) != NULL)
+			*slash++ = 0;
+		if(parse_addr(match, &ss) < 0)
+			return -1;
+		dest_key_set(&r->net, (struct sockaddr *) &ss);
+		r->bits = slash ? atoi(slash) : (ss.ss_family == AF_INET ? 32 : 128);
+	}
+	egress.nrules++;
+	return 0;
+}
+
+int egress_set_policy(const char *name)
+{
+	if(!strcmp(name, "hash"))
+		egress.policy = EGRESS_HASH;
+	else if(!strcmp(name, "least"))
+		egress.policy = EGRESS_LEAST;
+	else
+		return -1;
+	return 0;
+}
+
+int egress_count(int family)
+{
+	int i, n = 0;
+
+	for(i=0;i < egress.n; i++)
+		n += egress.addrs[i].addr.ss_family == family;
+	return n;
+}
+
+static int prefix_match(const struct dest_key *net, int bits, const struct dest_key *key)
+{
+	int i;
+
+	if(net->family != key->family)
+		return 0;
+	for(i=0;bits > 0; i++, bits -= 8)
+		if((net->addr[i] ^ key->addr[i]) & (bits >= 8 ? 0xff : 0xff << (8 - bits)))
+			return 0;
+	return 1;
+}
+
+/* index of the k-th pool address of a family */
+static int egress_nth(int family, int k)
+{
+	int i;
+
+	for(i=0;i < egress.n; i++)
+		if(egress.addrs[i].addr.ss_family == family && k-- == 0)
+			return i;
+	return -1;
+}
+
+static int rule_match(const struct egress_rule *r, struct connection *target,
+	struct connection *client)
+{
+	if(r->user[0])
+		return client->user >= 0 && !strcmp(account_name(client->user), r->user);
+	if(r->auth)
+		return client->authed;
+	return prefix_match(&r->net, r->bits, &target->dest);
+}
+
+static int egress_pick(struct connection *target, struct connection *client, int attempt)
+{
+	struct egress_rule *r;
+	int family = target->dest.family;
+	int i, k = 0, n = egress_count(family);
+
+	for(i=0;i < egress.nrules && !attempt; i++) {
+		r = &egress.rules[i];
+		if(egress.addrs[r->to].addr.ss_family != family)
+			continue;
+		if(rule_match(r, target, client))
+			return r->to;
+	}
+	if(n == 0)
+		return -1;
+
+	if(egress.policy == EGRESS_LEAST) {
+		for(i=1;i < n; i++)
+			if(egress.addrs[egress_nth(family, i)].active <
+				egress.addrs[egress_nth(family, k)].active)
+				k = i;
+	} else
+		k = (dest_key_hash(&target->dest) ^
+			(client->addr.sin_addr.s_addr * 2654435761U)) % n;
+	/* after EADDRNOTAVAIL move on to the next address */
+	return egress_nth(family, (k + attempt) % n);
+}
+
+/* bind target->fd to a source from the pool, 0 when there is none to use */
+int egress_bind(struct connection *target, struct connection *client, int attempt)
+{
+	struct egress_addr *e;
+	socklen_t len;
+	int i, one = 1;
+
+	target->egress = -1;
+	if(!egress.n || (i = egress_pick(target, client, attempt)) < 0)
+		return 0;
+	e = &egress.addrs[i];
+	if(setsockopt(target->fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof one) < 0)
+		errno = 0;
+	len = e->addr.ss_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+	if(bind(target->fd, (struct sockaddr *) &e->addr, len) < 0) {
+		DEBUG("bind to egress address failed");
+		return -1;
+	}
+	target->egress = i;
+	e->active++;
+	e->total++;
+	return 0;
+}
+
+void egress_release(struct connection *target, int exhausted)
+{
+	if(target->egress < 0)
+		return;
+	if(exhausted)
+		egress.addrs[target->egress].exhausted++;
+	egress.addrs[target->egress].active--;
+	target->egress = -1;
+}
+
+/* "egress <addr> <active> <total> <exhausted>" */
+void egress_dump(FILE *fp)
+{
+	char buf[INET6_ADDRSTRLEN];
+	struct sockaddr_storage *ss;
+	int i;
+
+	for(i=0;i < egress.n; i++) {
+		ss = &egress.addrs[i].addr;
+		inet_ntop(ss->ss_family, ss->ss_family == AF_INET ?
+			(void *) &((struct sockaddr_in *) ss)->sin_addr :
+			(void *) &((struct sockaddr_in6 *) ss)->sin6_addr, buf, sizeof buf);
+		fprintf(fp, "egress %s %lu %lu %lu\n", buf, egress.addrs[i].active,
+			egress.addrs[i].total, egress.addrs[i].exhausted);
+	}
+}
@@ -0,0 +1,59 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+
+#ifndef EGRESS_H
+#define EGRESS_H
+
+#include <stdio.h>
+#include "util.h"
+#include "connection.h"
+
+/**
+ * Source addresses for target connects. Every --egress address (v4 or
+ * v6) has its own ~28k ephemeral ports per destination, so spreading
+ * sessions over the pool multiplies outbound concurrency. Sockets are
+ * bound with IP_BIND_ADDRESS_NO_PORT, leaving the port to connect() so
+ * the 4-tuple, not the source port alone, has to be unique. A connect
+ * that still gets EADDRNOTAVAIL is retried from the next address.
+ *
+ * --egress-rule picks the address for matching sessions instead:
+ * "<cidr>=<addr>" for targets in a network, "auth=<addr>" for
+ * authenticated sessions, "user=<name>=<addr>" for those of one --users
+ * user. The first matching rule wins.
+ */
+
+#define EGRESS_MAX	(64)
+
+enum egress_policy {
+	EGRESS_HASH,	/* client and destination decide, sticky */
+	EGRESS_LEAST	/* fewest open connects */
+};
+
+int egress_add(const char *addr);
+int egress_add_rule(const char *rule);
+int egress_set_policy(const char *name);
+int egress_count(int family);
+int egress_bind(struct connection *target, struct connection *client, int attempt);
+void egress_release(struct connection *target, int exhausted);
+void egress_dump(FILE *);
+
+#endif
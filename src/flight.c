@@ -0,0 +1,203 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <errno.h>
+
+#include "util.h"
+#include "flight.h"
+#include "rthread.h"
+
+/* the control thread's ring and one per relay thread */
+#define FLIGHT_RINGS	(1 + MAX_RELAY_THREADS)
+
+extern int debug;
+
+__thread struct flight_ring flight;
+
+static struct {
+	size_t size;		/* bytes mapped for each ring */
+	uint64_t tsc0;
+	uint64_t ns0;
+	struct flight_ring *rings[FLIGHT_RINGS];
+	int nrings;
+} rec;
+
+static uint64_t realtime_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* map the calling thread's ring and list it for flight_dump() */
+static int ring_map(void)
+{
+	void *mem;
+	int slot;
+
+	/* populated up front so recording never takes a page fault */
+	mem = mmap(NULL, rec.size, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
+	if(mem == MAP_FAILED) {
+		DEBUG("mmap() failed");
+		return -1;
+	}
+	flight.ev = (struct flight_event *) mem;
+	flight.head = 0;
+	flight.mask = rec.size / sizeof(struct flight_event) - 1;
+	slot = __atomic_fetch_add(&rec.nrings, 1, __ATOMIC_RELAXED);
+	if(slot < FLIGHT_RINGS)
+		__atomic_store_n(&rec.rings[slot], &flight, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int flight_init(unsigned int events)
+{
+	uint64_t n = 1;
+
+	memset(&flight, 0, sizeof flight);
+	if(!events)
+		return 0;
+	while(n < events)
+		n <<= 1;
+	rec.size = n * sizeof(struct flight_event);
+	rec.tsc0 = flight_clock();
+	rec.ns0 = realtime_ns();
+	return ring_map();
+}
+
+/* a relay thread's ring, as large as the one flight_init() made */
+int flight_thread_init(void)
+{
+	memset(&flight, 0, sizeof flight);
+	if(!rec.size)
+		return 0;
+	return ring_map();
+}
+
+int flight_enabled(void)
+{
+	return rec.size != 0;
+}
+
+/**
+ * Copy r, oldest event first, to out and return how many events were
+ * copied; *lost is set to the events recorded before them. Another
+ * thread may be recording to r: slots it reused during the copy are
+ * dropped, as in a seqlock read.
+ */
+static uint64_t ring_copy(struct flight_ring *r, struct flight_event *out, uint64_t *lost)
+{
+	uint64_t n = r->mask + 1, head, first, last, i;
+
+	head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	first = head < n ? 0 : head - n;
+	for(i = first; i < head; i++)
+		out[i - first] = r->ev[i & r->mask];
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	/* event last is being written, over the slot of event last - n */
+	last = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	*lost = first;
+	if(last + 1 > first + n)
+		*lost = last + 1 - n < head ? last + 1 - n : head;
+	if(*lost > first)
+		memmove(out, out + (*lost - first), (head - *lost) * sizeof *out);
+	return head - *lost;
+}
+
+/**
+ * Nothing is written, and 0 returned, while the recorder is off. The
+ * rings follow each other; flightdec sorts them back into one timeline.
+ */
+int flight_dump(const char *path)
+{
+	struct flight_header hdr;
+	struct flight_ring *r;
+	struct flight_event *buf;
+	uint64_t count, lost;
+	char name[4096];
+	int i, fd, ret = 0;
+
+	if(!rec.size)
+		return 0;
+	if((buf = (struct flight_event *) malloc(rec.size)) == NULL) {
+		DEBUG("malloc() failed");
+		return -1;
+	}
+	snprintf(name, sizeof name, "%s.%d", path, (int) getpid());
+	if((fd = open(name, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644)) < 0) {
+		DEBUG("could not open %s", name);
+		free(buf);
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, FLIGHT_MAGIC, sizeof hdr.magic);
+	hdr.pid = getpid();
+	hdr.tsc0 = rec.tsc0;
+	hdr.ns0 = rec.ns0;
+	hdr.tsc1 = flight_clock();
+	hdr.ns1 = realtime_ns();
+
+	/* the header goes in last, once the counts are known */
+	if(lseek(fd, sizeof hdr, SEEK_SET) < 0)
+		ret = -1;
+	for(i=0;i < FLIGHT_RINGS && !ret; i++) {
+		if((r = __atomic_load_n(&rec.rings[i], __ATOMIC_ACQUIRE)) == NULL)
+			continue;
+		count = ring_copy(r, buf, &lost);
+		hdr.count += count;
+		hdr.lost += lost;
+		if(write(fd, buf, count * sizeof *buf) != (ssize_t) (count * sizeof *buf))
+			ret = -1;
+	}
+	if(!ret && pwrite(fd, &hdr, sizeof hdr, 0) != (ssize_t) sizeof hdr)
+		ret = -1;
+	close(fd);
+	free(buf);
+	if(ret < 0) {
+		DEBUG("flight dump to %s failed", name);
+		return -1;
+	}
+	DEBUG("flight recorder: %lu events written to %s", (unsigned long) hdr.count, name);
+	return 0;
+}
+
+/* the calling thread's ring */
+void flight_destroy(void)
+{
+	int i;
+
+	if(!flight.ev)
+		return;
+	for(i=0;i < FLIGHT_RINGS; i++)
+		if(rec.rings[i] == &flight)
+			__atomic_store_n(&rec.rings[i], NULL, __ATOMIC_RELEASE);
+	munmap(flight.ev, rec.size);
+	flight.ev = NULL;
+}
@@ -0,0 +1,125 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/**
+ * Flight recorder: every probe site (see probes.h) also appends a
+ * 32 byte event to a fixed ring, --flight-events entries per worker,
+ * always on. Recording is a counter increment and four stores; the
+ * timestamp is the raw TSC, turned into nanoseconds only when the
+ * ring is dumped. SIGUSR2 writes the ring, oldest event first, to
+ * <--flight-file>.<pid>; tools/flightdec rebuilds session timelines.
+ * Each relay thread (rthread.h) records to a ring of its own, from
+ * flight_thread_init(), and the dump holds every ring.
+ *
+ * Dump layout, host byte order:
+ *	struct flight_header, then count struct flight_event
+ */
+
+#define DEFAULT_FLIGHT_EVENTS	(65536)
+#define DEFAULT_FLIGHT_FILE	"/tmp/valeria.flight"
+#define FLIGHT_MAGIC		"VLRFLT1\n"
+
+/* the probe names, so PROBEn(name, ...) can record FLIGHT_name */
+#define FLIGHT_EVENTS \
+	X(accept) X(state) X(dns_start) X(dns_done) X(connect_start) \
+	X(connect_done) X(relay_read) X(relay_write) X(timeout) X(close)
+
+enum flight_type {
+	FLIGHT_none,
+#define X(name) FLIGHT_##name,
+	FLIGHT_EVENTS
+#undef X
+	FLIGHT_TYPES
+};
+
+struct flight_event {
+	uint64_t tsc;
+	uint64_t id;		/* session id */
+	int32_t a;		/* the probe arguments after the id */
+	int32_t b;
+	uint32_t type;
+	uint32_t reserved;
+};
+
+/* two clock readings at the ends of the trace map tsc to CLOCK_REALTIME */
+struct flight_header {
+	char magic[8];
+	uint32_t pid;
+	uint32_t reserved;
+	uint64_t count;
+	uint64_t lost;		/* events overwritten before the dump */
+	uint64_t tsc0;
+	uint64_t ns0;
+	uint64_t tsc1;
+	uint64_t ns1;
+};
+
+struct flight_ring {
+	struct flight_event *ev;
+	uint64_t head;
+	uint64_t mask;
+};
+
+extern __thread struct flight_ring flight;
+
+static inline uint64_t flight_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static inline void flight_record(int type, unsigned long id, long a, long b)
+{
+	struct flight_event *e;
+
+	if(!flight.ev)
+		return;
+	/* the last head store lands before the slot is reused, see ring_copy() */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	e = &flight.ev[flight.head & flight.mask];
+	e->tsc = flight_clock();
+	e->id = id;
+	e->a = (int32_t) a;
+	e->b = (int32_t) b;
+	e->type = type;
+	__atomic_store_n(&flight.head, flight.head + 1, __ATOMIC_RELEASE);
+}
+
+int flight_init(unsigned int events);
+int flight_thread_init(void);
+int flight_enabled(void);
+int flight_dump(const char *path);
+void flight_destroy(void);
+
+#endif
@@ -0,0 +1,295 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <errno.h>
+
+#include "util.h"
+#include "server.h"
+#include "connection.h"
+#include "socks5.h"
+#include "pool.h"
+#include "relay.h"
+#include "admission.h"
+#include "account.h"
+#include "capture.h"
+#include "http.h"
+#include "dns.h"
+#include "probes.h"
+
+#define HTTP_CLOSE	"Connection: close\r\nContent-Length: 0\r\n"
+
+extern int debug;
+
+static int send_status(struct connection *conn, const char *status, const char *headers)
+{
+	char msg[256];
+	int len;
+
+	len = snprintf(msg, sizeof msg, "HTTP/1.1 %s\r\n%s\r\n", status, headers);
+	if(send(conn->fd, msg, len, MSG_DONTWAIT|MSG_NOSIGNAL) < 0)
+		return -1;
+	return 0;
+}
+
+int http_reply(struct connection *conn, int reply)
+{
+	switch(reply) {
+		case REPLY_SUCCESS:
+			return send_status(conn, "200 Connection established", "");
+		case REPLY_NALLOWD:
+			return send_status(conn, "403 Forbidden", HTTP_CLOSE);
+		case REPLY_CMDNSPR:
+			return send_status(conn, "405 Method Not Allowed", HTTP_CLOSE);
+		case REPLY_ADDRERR:
+			return send_status(conn, "400 Bad Request", HTTP_CLOSE);
+		case REPLY_EXPIRED:
+			return send_status(conn, "408 Request Timeout", HTTP_CLOSE);
+		default:
+			return send_status(conn, "502 Bad Gateway", HTTP_CLOSE);
+	}
+}
+
+static int b64_value(int c)
+{
+	if(c >= 'A' && c <= 'Z')
+		return c - 'A';
+	if(c >= 'a' && c <= 'z')
+		return c - 'a' + 26;
+	if(c >= '0' && c <= '9')
+		return c - '0' + 52;
+	if(c == '+')
+		return 62;
+	if(c == '/')
+		return 63;
+	return -1;
+}
+
+static int base64_decode(const unsigned char *in, size_t len, char *out, size_t max)
+{
+	unsigned int bits = 0, nbits = 0;
+	size_t i, n = 0;
+	int v;
+
+	for(i=0;i < len && in[i] != '='; i++) {
+		if((v = b64_value(in[i])) < 0)
+			return -1;
+		bits = (bits << 6) | v;
+		nbits += 6;
+		if(nbits >= 8) {
+			nbits -= 8;
+			if(n + 1 >= max)
+				return -1;
+			out[n++] = (bits >> nbits) & 0xff;
+		}
+	}
+	out[n] = 0;
+	return n;
+}
+
+/* "Basic <user:password>", 0 if it checks out */
+static int check_auth(struct connection *conn, const unsigned char *v, const unsigned char *end)
+{
+	char cred[2 * ACCOUNT_NAME_MAX + 2], *sep;
+
+	while(v < end && *v == ' ')
+		v++;
+	if(end - v < 6 || strncasecmp((const char *) v, "Basic ", 6))
+		return -1;
+	v += 6;
+	if(base64_decode(v, end - v, cred, sizeof cred) < 0 ||
+		(sep = strchr(cred, ':')) == NULL)
+		return -1;
+	*sep = 0;
+	DEBUG("Client auth: %s", cred);
+	return account_login(conn, cred, sep + 1);
+}
+
+static int auth_required(struct connection *conn)
+{
+	send_status(conn, "407 Proxy Authentication Required",
+		"Proxy-Authenticate: Basic realm=\"valeria\"\r\n" HTTP_CLOSE);
+	connection_close(conn);
+	return 0;
+}
+
+#define REPLY_ERR(code) { \
+		send_reply(conn, code); \
+		connection_close(conn); \
+		return 0; \
+	}
+
+/* the header is complete in buf->data[0..len) */
+static int http_parse(struct connection *conn, unsigned char *p, size_t len)
+{
+	unsigned char *end = p + len, *line, *nl, *sp, *target, *tend, *host, *colon;
+	struct in6_addr addr6 = in6addr_any;
+	in_addr_t addr = INADDR_ANY;
+	char hostname[256];
+	int family = AF_INET, auth = 0, atyp;
+	unsigned long port;
+	size_t hlen;
+	char *e;
+
+	/* request line: CONNECT host:port HTTP/1.1 */
+	nl = memchr(p, '\n', end - p);
+	if((sp = memchr(p, ' ', nl - p)) == NULL)
+		REPLY_ERR(REPLY_ADDRERR);
+	target = sp + 1;
+	if((tend = memchr(target, ' ', nl - target)) == NULL)
+		REPLY_ERR(REPLY_ADDRERR);
+
+	for(line = nl + 1; line < end; line = nl + 1) {
+		nl = memchr(line, '\n', end - line);
+		if(nl - line > 20 && !strncasecmp((const char *) line, "Proxy-Authorization:", 20)) {
+			if(check_auth(conn, line + 20, nl[-1] == '\r' ? nl - 1 : nl) < 0)
+				return auth_required(conn);
+			auth = 1;
+			conn->authed = 1;
+		}
+	}
+	capture_auth(conn, auth ? METHOD_PASSWD : METHOD_NOAUTH);
+	if(!auth && admission_near(conn->srv)) {
+		DEBUG("Rejecting unauthenticated client under load");
+		admission_reject_greeting();
+		return auth_required(conn);
+	}
+
+	if(admission_request(conn) != REPLY_SUCCESS)
+		REPLY_ERR(REPLY_FAILURE);
+
+	if(sp - p != 7 || memcmp(p, "CONNECT", 7))
+		REPLY_ERR(REPLY_CMDNSPR);
+
+	/* host:port or [v6]:port */
+	host = target;
+	if(*target == '[') {
+		host++;
+		if((colon = memchr(host, ']', tend - host)) == NULL || colon[1] != ':')
+			REPLY_ERR(REPLY_ADDRERR);
+		hlen = colon++ - host;
+		family = AF_INET6;
+	} else if((colon = memrchr(target, ':', tend - target)) != NULL)
+		hlen = colon - host;
+	else
+		REPLY_ERR(REPLY_ADDRERR);
+	if(hlen >= sizeof hostname)
+		REPLY_ERR(REPLY_ADDRERR);
+	memcpy(hostname, host, hlen);
+	hostname[hlen] = 0;
+	port = strtoul((const char *) colon + 1, &e, 10);
+	if((unsigned char *) e != tend || port == 0 || port > 65535)
+		REPLY_ERR(REPLY_ADDRERR);
+
+	atyp = family == AF_INET6 ? ATYP_IPV6 :
+		inet_pton(AF_INET, hostname, &addr) == 1 ? ATYP_IPV4 : ATYP_NAME;
+	DEBUG("HTTP %.*s %s port %lu", (int) (sp - p), p, hostname, port);
+	capture_request(conn, atyp);
+
+	if(account_request(conn) != REPLY_SUCCESS)
+		REPLY_ERR(REPLY_NALLOWD);
+
+	if(atyp == ATYP_IPV6 && inet_pton(AF_INET6, hostname, &addr6) != 1)
+		REPLY_ERR(REPLY_ADDRERR);
+	if(atyp == ATYP_NAME) {
+		/* connect_target() follows once the resolver threads answer */
+		if(dns_lookup(conn, hostname, htons(port)) < 0)
+			REPLY_ERR(REPLY_FAILURE);
+		return 0;
+	}
+	return connect_target(conn, family, addr, &addr6, htons(port));
+}
+#undef REPLY_ERR
+
+static int http_scan(struct connection *conn)
+{
+	struct buffer *buf = conn->buf;
+	unsigned char *end;
+	size_t from = conn->http_scan > 3 ? conn->http_scan - 3 : 0;
+
+	end = memmem(buf->data + from, buf->len - from, "\r\n\r\n", 4);
+	if(!end) {
+		conn->http_scan = buf->len;
+		if(buf->len < HTTP_HEADER_MAX)
+			return 0;
+		send_status(conn, "431 Request Header Fields Too Large", HTTP_CLOSE);
+		connection_close(conn);
+		return 0;
+	}
+
+	/* what follows the header is tunnel data, it waits in conn->buf for the target */
+	buf->off = end + 4 - buf->data;
+	if(buf->off == buf->len) {
+		conn->buf = NULL;
+		http_parse(conn, buf->data, buf->off);
+		/* as relay_put(): a connection stalled on the pool may read again */
+		pool_put(buf);
+		relay_unstall(conn->srv);
+		return 0;
+	}
+	/* not another read until the relay has flushed it */
+	if(connection_watch(conn, EPOLLRDHUP) < 0)
+		return -1;
+	return http_parse(conn, buf->data, buf->off);
+}
+
+int http_start(struct connection *conn, const void *data, size_t len)
+{
+	struct buffer *buf;
+
+	if((buf = pool_get()) == NULL) {
+		DEBUG("no buffer for an HTTP header");
+		connection_close(conn);
+		return 0;
+	}
+	memcpy(buf->data, data, len);
+	buf->len = len;
+	conn->buf = buf;
+	conn->http = 1;
+	conn->http_scan = 0;
+	connection_set_state(conn, S5_HTTP);
+	return http_scan(conn);
+}
+
+int http_request(struct connection *conn)
+{
+	struct buffer *buf = conn->buf;
+	int len;
+
+	len = recv(conn->fd, buf->data + buf->len, HTTP_HEADER_MAX - buf->len, MSG_DONTWAIT);
+	if(len < 0)
+		return errno == EAGAIN ? 0 : -1;
+	if(len == 0) {
+		connection_close(conn);
+		return 0;
+	}
+	conn->recv_time = conn->srv->now;
+	buf->len += len;
+	return http_scan(conn);
+}
@@ -0,0 +1,47 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stddef.h>
+#include "connection.h"
+
+/**
+ * HTTP/1.1 CONNECT on the SOCKS listener. A first byte other than
+ * SOCKS5_VERSION turns the client into an HTTP one (state S5_HTTP).
+ * The header is read into a pool buffer held in conn->buf and scanned
+ * for its end as it arrives, only over the new bytes; the request line
+ * and headers are then parsed in place. From there the session takes
+ * the SOCKS path: admission, accounting, connect_target() and the
+ * relay. Replies go through send_reply(), which answers HTTP clients
+ * with the status matching the SOCKS reply code. Bytes the client sent
+ * after the header stay in conn->buf and reach the target first.
+ *
+ * Proxy-Authorization: Basic is checked against the same users as
+ * SOCKS username/password auth.
+ */
+
+#define HTTP_HEADER_MAX		(BUFFER_CAPACITY)
+
+int http_start(struct connection *, const void *data, size_t len);
+int http_request(struct connection *);
+int http_reply(struct connection *, int reply);
+
+#endif
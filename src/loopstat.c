@@ -0,0 +1,135 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#include <string.h>
+
+#include "util.h"
+#include "loopstat.h"
+
+#define LOOPSTAT_CALIBRATE_NS	(1000000)
+
+static const char *kind_names[LOOP_KINDS] = {
+#define X(name, label) #label,
+	SOCKS5_STATES
+#undef X
+	"accept", "admin", "relay_run", "timeout", "handback", "dns" };
+
+static struct {
+	uint64_t mult;		/* ns per clock tick, 32.32 fixed point */
+	unsigned long wakeups;
+	unsigned long full;	/* wakeups that filled the event array */
+	unsigned long iteration[LOOPSTAT_BUCKETS];
+	unsigned long lag[LOOPSTAT_BUCKETS];
+	unsigned long events[LOOPSTAT_BUCKETS];
+	unsigned long handler[LOOP_KINDS][LOOPSTAT_BUCKETS];
+} ls;
+
+/* the TSC rate is not exported, measure it against CLOCK_MONOTONIC */
+int loopstat_init(void)
+{
+	uint64_t t0, n0, n;
+
+	memset(&ls, 0, sizeof ls);
+#if defined(__x86_64__) || defined(__i386__)
+	t0 = flight_clock();
+	n0 = monotonic_ns();
+	while((n = monotonic_ns()) - n0 < LOOPSTAT_CALIBRATE_NS)
+		;
+	ls.mult = ((n - n0) << 32) / (flight_clock() - t0);
+#else
+	(void) t0; (void) n0; (void) n;
+	ls.mult = 1ULL << 32;
+#endif
+	return 0;
+}
+
+static uint64_t ticks_ns(uint64_t ticks)
+{
+	if(ticks < (1ULL << 32))
+		return (ticks * ls.mult) >> 32;
+	return ((ticks >> 16) * ls.mult) >> 16;
+}
+
+/* bucket b > 0 holds [2^(b-1), 2^b) */
+static void hist_add(unsigned long *hist, uint64_t v)
+{
+	int b = 0;
+
+	while(v && b < LOOPSTAT_BUCKETS - 1) {
+		v >>= 1;
+		b++;
+	}
+	hist[b]++;
+}
+
+uint64_t loopstat_wakeup(int nfds, int max)
+{
+	if(nfds <= 0)
+		return flight_clock();
+	ls.wakeups++;
+	if(nfds == max)
+		ls.full++;
+	hist_add(ls.events, nfds);
+	return flight_clock();
+}
+
+void loopstat_lag(uint64_t wake, uint64_t now)
+{
+	hist_add(ls.lag, ticks_ns(now - wake));
+}
+
+/* the end of one handler is the start of the next, one clock read each */
+uint64_t loopstat_handler(int kind, uint64_t start)
+{
+	uint64_t now = flight_clock();
+
+	if(kind >= 0 && kind < LOOP_KINDS)
+		hist_add(ls.handler[kind], ticks_ns(now - start));
+	return now;
+}
+
+void loopstat_iteration(uint64_t wake)
+{
+	hist_add(ls.iteration, ticks_ns(flight_clock() - wake));
+}
+
+static void hist_dump(FILE *fp, const char *name, const char *kind, const unsigned long *hist)
+{
+	int b;
+
+	for(b=0;b < LOOPSTAT_BUCKETS; b++)
+		if(hist[b])
+			fprintf(fp, "%s %s%s%lu %lu\n", name, kind ? kind : "", kind ? " " : "",
+				b ? 1UL << (b - 1) : 0UL, hist[b]);
+}
+
+void loopstat_dump(FILE *fp)
+{
+	int k;
+
+	fprintf(fp, "loop_wakeups %lu\n", ls.wakeups);
+	fprintf(fp, "loop_events_full %lu\n", ls.full);
+	hist_dump(fp, "loop_events", NULL, ls.events);
+	hist_dump(fp, "loop_iteration_ns", NULL, ls.iteration);
+	hist_dump(fp, "loop_lag_ns", NULL, ls.lag);
+	for(k=0;k < LOOP_KINDS; k++)
+		hist_dump(fp, "loop_handler_ns", kind_names[k], ls.handler[k]);
+}
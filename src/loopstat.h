@@ -0,0 +1,62 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef LOOPSTAT_H
+#define LOOPSTAT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "flight.h"
+#include "socks5.h"
+
+/**
+ * Event loop health. server_start() reads the flight recorder's clock
+ * (the TSC) once per event and keeps log2 histograms, in nanoseconds,
+ * of the iteration time from the wakeup to the next epoll_wait(), the
+ * lag between the wakeup and each event's handler starting, the cost
+ * of the handler by session state (and of accept, admin, the relay
+ * turns, the deadline scan and closing what relay threads hand back),
+ * and the events per wakeup. A worker whose lag grows or whose event
+ * array keeps filling is saturated before any client times out.
+ */
+
+#define LOOPSTAT_BUCKETS	(40)
+
+/* handler kinds after the session states, S5_PENDING (-1) first */
+enum loopstat_kind {
+	LOOP_ACCEPT = S5_STATES,
+	LOOP_ADMIN,
+	LOOP_RELAY_RUN,
+	LOOP_TIMEOUT,
+	LOOP_HANDBACK,		/* closing sessions the relay threads returned */
+	LOOP_DNS,		/* answers from the resolver threads */
+	LOOP_KINDS
+};
+
+#define LOOP_STATE(state)	((state) + 1)
+
+int loopstat_init(void);
+uint64_t loopstat_wakeup(int nfds, int max);
+void loopstat_lag(uint64_t wake, uint64_t now);
+uint64_t loopstat_handler(int kind, uint64_t start);
+void loopstat_iteration(uint64_t wake);
+void loopstat_dump(FILE *);
+
+#endif
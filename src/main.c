@@ -41,6 +41,25 @@
 #include "socks5.h"
 #include "server.h"
 #include "connection.h"
+#include "pool.h"
+#include "relay.h"
+#include "admission.h"
+#include "capture.h"
+#include "topk.h"
+#include "dest.h"
+#include "egress.h"
+#include "offload.h"
+#include "tcpstat.h"
+#include "flight.h"
+#include "account.h"
+#include "tproxy.h"
+#include "admin.h"
+#include "tls.h"
+#include "busypoll.h"
+#include "mptcp.h"
+#include "rthread.h"
+#include "dns.h"
+#include "loopstat.h"
 #include "util.h"
 
 #define DIE(msg, func, args, ...) {DEBUG(msg); func(args, ##__VA_ARGS__); exit(EXIT_FAILURE); }
@@ -48,16 +67,79 @@
 extern char *optarg;
 extern int optind, opterr, optopt;
 
+/* long options without a short form */
+enum {
+	OPT_MEM_BUDGET = 256,
+	OPT_HUGEPAGES,
+	OPT_STATS_FILE,
+	OPT_ZEROCOPY_MIN,
+	OPT_ADMIT_HIGH,
+	OPT_ADMIT_LOW,
+	OPT_IP_MAX,
+	OPT_HANDSHAKE_TIMEOUT,
+	OPT_DNS_TIMEOUT,
+	OPT_CONNECT_TIMEOUT,
+	OPT_IDLE_TIMEOUT,
+	OPT_IDLE_UP_TIMEOUT,
+	OPT_IDLE_DOWN_TIMEOUT,
+	OPT_HALF_CLOSE_TIMEOUT,
+	OPT_CAPTURE,
+	OPT_TOPK,
+	OPT_BREAKER_FAILURES,
+	OPT_BREAKER_OPEN,
+	OPT_RELAY_QUANTUM,
+	OPT_RELAY_AUTH_WEIGHT,
+	OPT_EGRESS,
+	OPT_EGRESS_POLICY,
+	OPT_EGRESS_RULE,
+	OPT_OFFLOAD,
+	OPT_TCP_SAMPLE,
+	OPT_FLIGHT_EVENTS,
+	OPT_FLIGHT_FILE,
+	OPT_USERS,
+	OPT_ACCOUNTING_FILE,
+	OPT_ACCOUNTING_INTERVAL,
+	OPT_QUOTA_PERIOD,
+	OPT_TRANSPARENT,
+	OPT_ADMIN_SOCKET,
+	OPT_DEST_CAP,
+	OPT_DEST_QUEUE,
+	OPT_TLS_PORT,
+	OPT_TLS_CERT,
+	OPT_TLS_KEY,
+	OPT_BUSY_POLL,
+	OPT_BUSY_POLL_SPIN,
+	OPT_MPTCP,
+	OPT_RELAY_THREADS
+};
+
 sig_atomic_t interrupt_flag=0;
+sig_atomic_t stats_flag=0;
+sig_atomic_t flight_flag=0;
 int debug=0;
-int timeout = 20;
+in_addr_t trace_addr = 0;
+__thread int tracing = 0;
+int handshake_timeout = 10;
+int dns_timeout = 5;
+int connect_timeout = 10;
+int idle_up_timeout = 300;
+int idle_down_timeout = 300;
+int half_close_timeout = 60;
 time_t uptime;
 int parallel = 0;
+int worker_id = 0;
+char *stats_file = NULL;
+char *flight_file = DEFAULT_FLIGHT_FILE;
+int zerocopy_min = 32768;
+int relay_quantum = DEFAULT_RELAY_QUANTUM;
+int relay_auth_weight = 1;
 
 void usage();
 void version();
 void daemonize();
 void sigint_handle(int);
+void sigusr1_handle(int);
+void sigusr2_handle(int);
 int parallelize();
 
 int main(int argc,char *argv[])
@@ -68,17 +150,77 @@ int main(int argc,char *argv[])
 	{"debug", no_argument, NULL, 'd'},
 	{"port", required_argument, NULL, 'p'},
 	{"address", required_argument, NULL, 'a'},
-	{"parallel", no_argument, NULL, 'j'}};
+	{"parallel", no_argument, NULL, 'j'},
+	{"mem-budget", required_argument, NULL, OPT_MEM_BUDGET},
+	{"hugepages", no_argument, NULL, OPT_HUGEPAGES},
+	{"stats-file", required_argument, NULL, OPT_STATS_FILE},
+	{"zerocopy-min", required_argument, NULL, OPT_ZEROCOPY_MIN},
+	{"admit-high", required_argument, NULL, OPT_ADMIT_HIGH},
+	{"admit-low", required_argument, NULL, OPT_ADMIT_LOW},
+	{"ip-max", required_argument, NULL, OPT_IP_MAX},
+	{"handshake-timeout", required_argument, NULL, OPT_HANDSHAKE_TIMEOUT},
+	{"dns-timeout", required_argument, NULL, OPT_DNS_TIMEOUT},
+	{"connect-timeout", required_argument, NULL, OPT_CONNECT_TIMEOUT},
+	{"idle-timeout", required_argument, NULL, OPT_IDLE_TIMEOUT},
+	{"idle-up-timeout", required_argument, NULL, OPT_IDLE_UP_TIMEOUT},
+	{"idle-down-timeout", required_argument, NULL, OPT_IDLE_DOWN_TIMEOUT},
+	{"half-close-timeout", required_argument, NULL, OPT_HALF_CLOSE_TIMEOUT},
+	{"capture", required_argument, NULL, OPT_CAPTURE},
+	{"topk", required_argument, NULL, OPT_TOPK},
+	{"breaker-failures", required_argument, NULL, OPT_BREAKER_FAILURES},
+	{"breaker-open", required_argument, NULL, OPT_BREAKER_OPEN},
+	{"dest-cap", required_argument, NULL, OPT_DEST_CAP},
+	{"dest-queue", required_argument, NULL, OPT_DEST_QUEUE},
+	{"relay-quantum", required_argument, NULL, OPT_RELAY_QUANTUM},
+	{"relay-auth-weight", required_argument, NULL, OPT_RELAY_AUTH_WEIGHT},
+	{"egress", required_argument, NULL, OPT_EGRESS},
+	{"egress-policy", required_argument, NULL, OPT_EGRESS_POLICY},
+	{"egress-rule", required_argument, NULL, OPT_EGRESS_RULE},
+	{"offload", no_argument, NULL, OPT_OFFLOAD},
+	{"transparent", required_argument, NULL, OPT_TRANSPARENT},
+	{"admin-socket", required_argument, NULL, OPT_ADMIN_SOCKET},
+	{"tls-port", required_argument, NULL, OPT_TLS_PORT},
+	{"tls-cert", required_argument, NULL, OPT_TLS_CERT},
+	{"tls-key", required_argument, NULL, OPT_TLS_KEY},
+	{"busy-poll", required_argument, NULL, OPT_BUSY_POLL},
+	{"busy-poll-spin", required_argument, NULL, OPT_BUSY_POLL_SPIN},
+	{"mptcp", no_argument, NULL, OPT_MPTCP},
+	{"relay-threads", required_argument, NULL, OPT_RELAY_THREADS},
+	{"tcp-sample", required_argument, NULL, OPT_TCP_SAMPLE},
+	{"flight-events", required_argument, NULL, OPT_FLIGHT_EVENTS},
+	{"flight-file", required_argument, NULL, OPT_FLIGHT_FILE},
+	{"users", required_argument, NULL, OPT_USERS},
+	{"accounting-file", required_argument, NULL, OPT_ACCOUNTING_FILE},
+	{"accounting-interval", required_argument, NULL, OPT_ACCOUNTING_INTERVAL},
+	{"quota-period", required_argument, NULL, OPT_QUOTA_PERIOD},
+	{NULL, 0, NULL, 0}};
 	int opt;
 	int daemon = 0;
 	int long_optind=0;
 
 	struct server *srv;
 	char listen_addr[256]="127.0.0.1";
-	unsigned short port=1080;
+	unsigned short port=1080, transparent_port = 0, tls_port = 0;
+	char *tls_cert = NULL, *tls_key = NULL;
 
 	struct rlimit  rlim;
 	int max_open, i;
+	size_t mem_budget = DEFAULT_MEM_BUDGET;
+	int hugepages = 0;
+	int offload = 0;
+	int mptcp = 0;
+	int relay_threads = 0;
+	int tcp_sample = DEFAULT_TCP_SAMPLE;
+	int flight_events = DEFAULT_FLIGHT_EVENTS;
+	int admit_high = DEFAULT_ADMIT_HIGH, admit_low = DEFAULT_ADMIT_LOW, ip_max = 0;
+	char *capture_file = NULL, *admin_socket = NULL;
+	char admin_path[256];
+	char *users_file = NULL, *accounting_file = NULL;
+	int accounting_interval = DEFAULT_ACCOUNTING_INTERVAL, quota_period = DEFAULT_QUOTA_PERIOD;
+	int topk_size = DEFAULT_TOPK;
+	int breaker_failures = DEFAULT_BREAKER_FAILURES, breaker_open = DEFAULT_BREAKER_OPEN;
+	int dest_cap = 0, dest_queue = DEFAULT_DEST_QUEUE;
+	int busy_poll = 0, busy_poll_spin = -1;
 	
 	while((opt=getopt_long(argc,argv, "hvDdp:a:j", long_opts, &long_optind))!=-1) {
 		switch(opt) {
@@ -104,16 +246,178 @@ int main(int argc,char *argv[])
 			case 'j':
 				parallel = 1;
 				break;
+			case OPT_MEM_BUDGET:
+				mem_budget = (size_t)atol(optarg) << 20;
+				break;
+			case OPT_HUGEPAGES:
+				hugepages = 1;
+				break;
+			case OPT_STATS_FILE:
+				stats_file = optarg;
+				break;
+			case OPT_ZEROCOPY_MIN:
+				zerocopy_min = atoi(optarg);
+				break;
+			case OPT_ADMIT_HIGH:
+				admit_high = atoi(optarg);
+				break;
+			case OPT_ADMIT_LOW:
+				admit_low = atoi(optarg);
+				break;
+			case OPT_IP_MAX:
+				ip_max = atoi(optarg);
+				break;
+			case OPT_HANDSHAKE_TIMEOUT:
+				handshake_timeout = atoi(optarg);
+				break;
+			case OPT_DNS_TIMEOUT:
+				dns_timeout = atoi(optarg);
+				break;
+			case OPT_CONNECT_TIMEOUT:
+				connect_timeout = atoi(optarg);
+				break;
+			case OPT_IDLE_TIMEOUT:
+				idle_up_timeout = idle_down_timeout = atoi(optarg);
+				break;
+			case OPT_IDLE_UP_TIMEOUT:
+				idle_up_timeout = atoi(optarg);
+				break;
+			case OPT_IDLE_DOWN_TIMEOUT:
+				idle_down_timeout = atoi(optarg);
+				break;
+			case OPT_HALF_CLOSE_TIMEOUT:
+				half_close_timeout = atoi(optarg);
+				break;
+			case OPT_CAPTURE:
+				capture_file = optarg;
+				break;
+			case OPT_TOPK:
+				topk_size = atoi(optarg);
+				break;
+			case OPT_BREAKER_FAILURES:
+				breaker_failures = atoi(optarg);
+				break;
+			case OPT_BREAKER_OPEN:
+				breaker_open = atoi(optarg);
+				break;
+			case OPT_DEST_CAP:
+				dest_cap = atoi(optarg);
+				break;
+			case OPT_DEST_QUEUE:
+				dest_queue = atoi(optarg);
+				if(dest_queue < 0)
+					dest_queue = 0;
+				break;
+			case OPT_RELAY_QUANTUM:
+				relay_quantum = atoi(optarg);
+				if(relay_quantum <= 0)
+					relay_quantum = DEFAULT_RELAY_QUANTUM;
+				break;
+			case OPT_EGRESS:
+				if(egress_add(optarg) < 0) {
+					fprintf(stderr, "bad --egress address: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case OPT_EGRESS_POLICY:
+				if(egress_set_policy(optarg) < 0) {
+					fprintf(stderr, "--egress-policy is hash or least\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case OPT_EGRESS_RULE:
+				if(egress_add_rule(optarg) < 0) {
+					fprintf(stderr, "bad --egress-rule: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case OPT_USERS:
+				users_file = optarg;
+				break;
+			case OPT_ACCOUNTING_FILE:
+				accounting_file = optarg;
+				break;
+			case OPT_ACCOUNTING_INTERVAL:
+				accounting_interval = atoi(optarg);
+				break;
+			case OPT_QUOTA_PERIOD:
+				quota_period = atoi(optarg);
+				break;
+			case OPT_FLIGHT_EVENTS:
+				flight_events = atoi(optarg);
+				if(flight_events < 0)
+					flight_events = 0;
+				break;
+			case OPT_FLIGHT_FILE:
+				flight_file = optarg;
+				break;
+			case OPT_TCP_SAMPLE:
+				tcp_sample = atoi(optarg);
+				break;
+			case OPT_OFFLOAD:
+				offload = 1;
+				break;
+			case OPT_TRANSPARENT:
+				transparent_port = (unsigned short) atoi(optarg);
+				break;
+			case OPT_ADMIN_SOCKET:
+				admin_socket = optarg;
+				break;
+			case OPT_TLS_PORT:
+				tls_port = (unsigned short) atoi(optarg);
+				break;
+			case OPT_TLS_CERT:
+				tls_cert = optarg;
+				break;
+			case OPT_TLS_KEY:
+				tls_key = optarg;
+				break;
+			case OPT_MPTCP:
+				mptcp = 1;
+				break;
+			case OPT_RELAY_THREADS:
+				relay_threads = atoi(optarg);
+				if(relay_threads < 0 || relay_threads > MAX_RELAY_THREADS) {
+					fprintf(stderr, "--relay-threads takes 0 to %d\n", MAX_RELAY_THREADS);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case OPT_BUSY_POLL:
+				busy_poll = atoi(optarg);
+				break;
+			case OPT_BUSY_POLL_SPIN:
+				busy_poll_spin = atoi(optarg);
+				break;
+			case OPT_RELAY_AUTH_WEIGHT:
+				relay_auth_weight = atoi(optarg);
+				if(relay_auth_weight <= 0)
+					relay_auth_weight = 1;
+				break;
 			default:
 				usage();	
 				exit(EXIT_FAILURE);
 		}
 	}
+	if(tls_port && (!tls_cert || !tls_key)) {
+		fprintf(stderr, "--tls-port needs --tls-cert and --tls-key\n");
+		exit(EXIT_FAILURE);
+	}
+	/* the sockmap relays in the kernel, there is nothing to hand over */
+	if(relay_threads && offload) {
+		fprintf(stderr, "--relay-threads can't be combined with --offload\n");
+		exit(EXIT_FAILURE);
+	}
 	if(daemon) 
 		daemonize();
 
 	signal(SIGCHLD, SIG_IGN);
 
+	/* opened once before -j forks so the header is written a single time */
+	if(capture_file && capture_open(capture_file) < 0) {
+		DEBUG("capture_open failed");
+		return -1;
+	}
+
     if(getrlimit(RLIMIT_NOFILE, &rlim) < 0) {
         DEBUG("getrlimit() failed");
 		return -1;
@@ -124,9 +428,17 @@ int main(int argc,char *argv[])
 		return -1;
 	}
 
+	/* the counters are shared with the -j workers, so map them before the fork */
+	if(account_init(users_file, accounting_file, accounting_interval, quota_period,
+		parallel ? sysconf(_SC_NPROCESSORS_ONLN) : 1, relay_threads) < 0) {
+		DEBUG("account_init failed");
+		return -1;
+	}
+
     if(parallel)
         if(parallelize() < 0)
             DEBUG("parallelize failed");
+	account_set_worker(worker_id);
 	max_open = sysconf(_SC_OPEN_MAX) > 0 ? 
 				(sysconf(_SC_OPEN_MAX) < DEFAULT_MAX_OPEN ? 
 				sysconf(_SC_OPEN_MAX) : DEFAULT_MAX_OPEN) 
@@ -135,15 +447,66 @@ int main(int argc,char *argv[])
 
 	if(signal(SIGINT, sigint_handle)==SIG_ERR) 
 		DEBUG("signal() failed");
+	if(signal(SIGUSR1, sigusr1_handle)==SIG_ERR) 
+		DEBUG("signal() failed");
+	if(signal(SIGUSR2, sigusr2_handle)==SIG_ERR) 
+		DEBUG("signal() failed");
+
+	if(pool_init(mem_budget, hugepages) < 0) {
+		DEBUG("pool_init failed");
+		return -1;
+	}
+
+	if(topk_init(topk_size) < 0) {
+		DEBUG("topk_init failed");
+		return -1;
+	}
+
+	if(dest_init(breaker_failures, breaker_open, dest_cap, dest_queue) < 0) {
+		DEBUG("dest_init failed");
+		return -1;
+	}
+
+	if(tcpstat_init(tcp_sample) < 0) {
+		DEBUG("tcpstat_init failed");
+		return -1;
+	}
+
+	if(loopstat_init() < 0) {
+		DEBUG("loopstat_init failed");
+		return -1;
+	}
+
+	if(mptcp_init(mptcp) < 0) {
+		DEBUG("mptcp_init failed");
+		return -1;
+	}
+
+	/* after the -j fork, every worker records into a ring of its own */
+	if(flight_init(flight_events) < 0) {
+		DEBUG("flight_init failed");
+		return -1;
+	}
 
 	if((srv = server_create(max_open))==NULL) {
 		DEBUG("server_create failed");
 		return -1;
 	}
+
+	/* without BPF support sessions are relayed in user space as before */
+	if(offload && offload_init(max_open) < 0)
+		DEBUG("offload_init failed");
 	
 	if(server_init(srv, listen_addr, port) < 0) 
 		DIE("server_init failed", server_destroy, &srv);
 
+	if(admission_init(srv, admit_high, admit_low, ip_max) < 0)
+		DIE("admission_init failed", server_destroy, &srv);
+
+	/* after the -j fork, which has already pinned the workers */
+	if(busypoll_init(srv->epollfd, busy_poll, busy_poll_spin) < 0)
+		DIE("busypoll_init failed", server_destroy, &srv);
+
 	for(i=0;i < 5; i++)
         	connection_open(&srv->connections[i], -1);
 
@@ -153,11 +516,41 @@ int main(int argc,char *argv[])
 	if(server_listen(srv) < 0)
 		DIE("server_listen failed", server_destroy, &srv);
 
+	if(transparent_port && tproxy_listen(srv, transparent_port) < 0)
+		DIE("tproxy_listen failed", server_destroy, &srv);
+
+	if(tls_port && (tls_init(tls_cert, tls_key) < 0 ||
+		(srv->sfd = server_listen_port(srv, tls_port, 0)) < 0))
+		DIE("TLS listener failed", server_destroy, &srv);
+
+	/* one socket per -j worker, the settings it changes are that worker's */
+	if(admin_socket) {
+		if(parallel)
+			snprintf(admin_path, sizeof admin_path, "%s.%d", admin_socket, worker_id);
+		else
+			snprintf(admin_path, sizeof admin_path, "%s", admin_socket);
+		if(admin_open(srv, admin_path) < 0)
+			DIE("admin_open failed", server_destroy, &srv);
+	}
+
+	/* after the -j fork, each worker has relay threads of its own */
+	if(rthread_init(srv, relay_threads) < 0)
+		DIE("rthread_init failed", server_destroy, &srv);
+	if(dns_init(srv) < 0)
+		DIE("dns_init failed", server_destroy, &srv);
+
 	uptime = time(NULL);
 
 	if(server_start(srv) < 0)
 		DIE("server_start failed", server_destroy, &srv);
 
+	rthread_stop();
+	admin_close(srv);
+	tls_destroy();
+	capture_close();
+	account_flush();
+	offload_destroy();
+	flight_destroy();
 	return 0;
 }
 
@@ -171,6 +564,48 @@ void usage()
 	fprintf(stderr, "\t-p,--port <port>   \tBind port. (default: 1080)\n");
 	fprintf(stderr, "\t-d,--debug  \t\tPrint debug messages (if -D no message is printed)\n");
 	fprintf(stderr, "\t-j,--parallel\t\tRun multiple instances of the server\n");
+	fprintf(stderr, "\t--mem-budget <MB>\tRelay buffer memory per process. (default: 256)\n");
+	fprintf(stderr, "\t--hugepages\t\tBack relay buffers with hugepages when available\n");
+	fprintf(stderr, "\t--zerocopy-min <bytes>\tMSG_ZEROCOPY for bulk writes this large, 0 off. (default: 32768)\n");
+	fprintf(stderr, "\t--relay-quantum <bytes>\tBytes a session may read per turn before others go. (default: 262144)\n");
+	fprintf(stderr, "\t--relay-auth-weight <n>\tTurn size multiplier for authenticated sessions. (default: 1)\n");
+	fprintf(stderr, "\t--admit-high <pct>\tPause accepting at this share of max open. (default: 90)\n");
+	fprintf(stderr, "\t--admit-low <pct>\tResume accepting here; above it only authenticated clients are served. (default: 75)\n");
+	fprintf(stderr, "\t--ip-max <n>\t\tMax sessions per client address, 0 no limit. (default: 0)\n");
+	fprintf(stderr, "\t--handshake-timeout <s>\tGreeting, auth and request must finish in this. (default: 10)\n");
+	fprintf(stderr, "\t--dns-timeout <s>\tName resolution deadline. (default: 5)\n");
+	fprintf(stderr, "\t--connect-timeout <s>\tTarget connect. (default: 10)\n");
+	fprintf(stderr, "\t--idle-timeout <s>\tClose relays idle this long both ways. (default: 300)\n");
+	fprintf(stderr, "\t--idle-up-timeout <s>\tIdle limit for client to target only\n");
+	fprintf(stderr, "\t--idle-down-timeout <s>\tIdle limit for target to client only\n");
+	fprintf(stderr, "\t--half-close-timeout <s>\tClose a half-closed session idle this long. (default: 60)\n");
+	fprintf(stderr, "\t--stats-file <path>\tAppend stats here on SIGUSR1. (default: stderr)\n");
+	fprintf(stderr, "\t--egress <addr>\t\tAdd a source address for target connects, repeatable\n");
+	fprintf(stderr, "\t--egress-policy <p>\thash (sticky per client and target) or least (fewest open). (default: hash)\n");
+	fprintf(stderr, "\t--egress-rule <m>=<addr>\tSource for targets in cidr m, auth=<addr> for authenticated sessions, user=<name>=<addr> for one user\n");
+	fprintf(stderr, "\t--busy-poll <us>\tBusy poll sockets and the event loop for this long before sleeping, 0 off. (default: 0)\n");
+	fprintf(stderr, "\t--busy-poll-spin <us>\tSpin on epoll_wait in user space first. (default: --busy-poll without kernel epoll support, else 0)\n");
+	fprintf(stderr, "\t--relay-threads <n>\tRelay established sessions on n threads, handshakes stay on the main one. (default: 0)\n");
+	fprintf(stderr, "\t--offload\t\tRelay established IPv4 sessions in the kernel with a BPF sockmap\n");
+	fprintf(stderr, "\t--admin-socket <path>\tServe admin commands on this Unix socket, .<worker> appended with -j\n");
+	fprintf(stderr, "\t--tls-port <port>\tAlso listen here for SOCKS5 over TLS 1.3, relayed with kernel TLS (experimental)\n");
+	fprintf(stderr, "\t--tls-cert <path>\tPEM certificate chain for --tls-port\n");
+	fprintf(stderr, "\t--tls-key <path>\tPEM private key for --tls-port\n");
+	fprintf(stderr, "\t--transparent <port>\tAlso listen here for connections redirected by iptables REDIRECT or TPROXY\n");
+	fprintf(stderr, "\t--breaker-failures <n>\tFail fast to a destination after n connect failures in a row, 0 off. (default: 5)\n");
+	fprintf(stderr, "\t--breaker-open <s>\tHow long before a probe connect is let through. (default: 10)\n");
+	fprintf(stderr, "\t--dest-cap <n>\t\tSessions per destination, more wait for one to end, 0 no limit. (default: 0)\n");
+	fprintf(stderr, "\t--dest-queue <n>\tRequests that may wait per destination. (default: 64)\n");
+	fprintf(stderr, "\t--users <file>\t\tUsers, one \"name password [bytes per period [sessions]]\" per line\n");
+	fprintf(stderr, "\t--quota-period <s>\tLength of a byte quota period. (default: 86400)\n");
+	fprintf(stderr, "\t--accounting-file <path>\tKeep per-user totals here across restarts\n");
+	fprintf(stderr, "\t--accounting-interval <s>\tHow often it is rewritten. (default: 60)\n");
+	fprintf(stderr, "\t--flight-events <n>\tEvents kept by the flight recorder, 0 off. (default: 65536)\n");
+	fprintf(stderr, "\t--flight-file <path>\tWhere SIGUSR2 dumps it, .<pid> appended. (default: /tmp/valeria.flight)\n");
+	fprintf(stderr, "\t--mptcp\t\t\tMultipath TCP on the SOCKS port and target connects, TCP peers fall back\n");
+	fprintf(stderr, "\t--tcp-sample <s>\tSample TCP_INFO of both session legs every s seconds, 0 off. (default: 10)\n");
+	fprintf(stderr, "\t--topk <n>\t\tTrack the n heaviest destinations in stats, 0 off. (default: 16)\n");
+	fprintf(stderr, "\t--capture <path>\tRecord session shapes for tools/replay\n");
 	fprintf(stderr, "\t-v,--version\t\tPrint program version then exit.\n");
 	fprintf(stderr, "\t-h,--help   \t\tPrint this help message then exit\n");
 }
@@ -227,6 +662,18 @@ void sigint_handle(int sig)
 	interrupt_flag = 1;
 }
 
+void sigusr1_handle(int sig)
+{
+	(void) sig;
+	stats_flag = 1;
+}
+
+void sigusr2_handle(int sig)
+{
+	(void) sig;
+	flight_flag = 1;
+}
+
 int parallelize()
 {
 	int i;
@@ -241,8 +688,10 @@ int parallelize()
 		pid = fork();
 		if(pid==-1)
 			return -1;
-		if(!pid)
+		if(!pid) {
+			worker_id = i;
 			break;
+		}
 		CPU_SET(i, &set);
 		if (sched_setaffinity(pid, sizeof set, &set) < 0)
 			return -1;
@@ -0,0 +1,107 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/mptcp.h>
+#include <errno.h>
+
+#include "util.h"
+#include "mptcp.h"
+
+#ifndef IPPROTO_MPTCP
+#define IPPROTO_MPTCP		(262)
+#endif
+#ifndef SOL_MPTCP
+#define SOL_MPTCP		(284)
+#endif
+
+extern int debug;
+
+static struct mptcp_stats mp;
+
+int mptcp_init(int enabled)
+{
+	memset(&mp, 0, sizeof mp);
+	mp.enabled = enabled;
+	return 0;
+}
+
+/* a nonblocking stream socket, MPTCP when enabled and available */
+int mptcp_socket(int family)
+{
+	int fd;
+
+	if(mp.enabled) {
+		if((fd = socket(family, SOCK_STREAM|SOCK_NONBLOCK, IPPROTO_MPTCP)) >= 0) {
+			mp.sockets++;
+			return fd;
+		}
+		if(errno == EPROTONOSUPPORT || errno == EINVAL || errno == ENOPROTOOPT) {
+			DEBUG("no MPTCP in this kernel, using TCP");
+			mp.enabled = 0;
+		}
+		errno = 0;
+	}
+	return socket(family, SOCK_STREAM|SOCK_NONBLOCK, 0);
+}
+
+/**
+ * Called after each TCP_INFO sample. MPTCP_INFO fails with EOPNOTSUPP
+ * on a socket that fell back, and on plain TCP, which accepted
+ * connections from a TCP peer are even on an MPTCP listener.
+ */
+void mptcp_sample(int fd, struct tcp_sample *s)
+{
+	struct mptcp_info mi;
+	socklen_t len = sizeof mi;
+	int proto;
+
+	if(!mp.sockets || (s->samples > 1 && s->mptcp != MPTCP_ACTIVE))
+		return;
+	memset(&mi, 0, sizeof mi);
+	if(getsockopt(fd, SOL_MPTCP, MPTCP_INFO, &mi, &len) == 0) {
+		s->mptcp = MPTCP_ACTIVE;
+		if(mi.mptcpi_subflows + 1 > s->subflows)
+			s->subflows = mi.mptcpi_subflows + 1;
+		return;
+	}
+	len = sizeof proto;
+	if(s->mptcp == MPTCP_ACTIVE || (getsockopt(fd, SOL_SOCKET, SO_PROTOCOL, &proto, &len) == 0 &&
+		proto == IPPROTO_MPTCP))
+		s->mptcp = MPTCP_FALLBACK;
+	errno = 0;
+}
+
+void mptcp_close(int leg, const struct tcp_sample *s)
+{
+	if(s->mptcp == MPTCP_ACTIVE) {
+		mp.legs[leg]++;
+		mp.subflows[leg] += s->subflows - 1;
+	} else if(s->mptcp == MPTCP_FALLBACK)
+		mp.fallbacks[leg]++;
+}
+
+void mptcp_get_stats(struct mptcp_stats *st)
+{
+	*st = mp;
+}
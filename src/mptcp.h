@@ -0,0 +1,57 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef MPTCP_H
+#define MPTCP_H
+
+#include "tcpstat.h"
+
+/**
+ * --mptcp opens the SOCKS listener and target sockets as IPPROTO_MPTCP.
+ * A peer without MPTCP gets plain TCP on the same socket (the kernel
+ * falls back during the handshake), and a kernel without it, or with
+ * net.mptcp.enabled=0, makes valeria use TCP sockets throughout.
+ *
+ * With --tcp-sample each leg is classified on its first sample (MPTCP,
+ * fallen back to TCP, plain TCP) and MPTCP legs track the number of
+ * subflows, which goes into the capture record and the stats.
+ */
+
+enum mptcp_leg {
+	MPTCP_NONE,		/* plain TCP socket */
+	MPTCP_ACTIVE,
+	MPTCP_FALLBACK		/* MPTCP socket, the peer spoke TCP */
+};
+
+struct mptcp_stats {
+	int enabled;
+	unsigned long sockets;			/* opened as MPTCP */
+	unsigned long legs[TCPSTAT_LEGS];	/* closed with MPTCP in use */
+	unsigned long fallbacks[TCPSTAT_LEGS];
+	unsigned long subflows[TCPSTAT_LEGS];	/* beyond the first, at close */
+};
+
+int mptcp_init(int enabled);
+int mptcp_socket(int family);
+void mptcp_sample(int fd, struct tcp_sample *);
+void mptcp_close(int leg, const struct tcp_sample *);
+void mptcp_get_stats(struct mptcp_stats *);
+
+#endif
@@ -0,0 +1,416 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include <linux/bpf.h>
+#include <errno.h>
+
+#include "util.h"
+#include "server.h"
+#include "connection.h"
+#include "relay.h"
+#include "offload.h"
+
+extern int debug;
+
+/* built by the verdict program from the __sk_buff fields of the same name */
+struct offload_key {
+	uint32_t remote_ip4;
+	uint32_t local_ip4;
+	uint32_t remote_port;	/* network order, in the upper half on little endian */
+	uint32_t local_port;	/* host order */
+};
+
+static struct {
+	int sockmap;		/* key of a socket -> the socket its segments go to */
+	int passmap;		/* keys whose segments stay with user space */
+	int prog;
+	struct offload_key *keys;	/* by fd, for the sockets in sockmap */
+	struct offload_stats stats;
+} off = { .sockmap = -1, .passmap = -1, .prog = -1 };
+
+#define INSN(c, d, s, o, i) \
+	((struct bpf_insn) { .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+#define LDX_W(d, s, o)		INSN(BPF_LDX|BPF_MEM|BPF_W, d, s, o, 0)
+#define STX_W(d, s, o)		INSN(BPF_STX|BPF_MEM|BPF_W, d, s, o, 0)
+#define MOV_REG(d, s)		INSN(BPF_ALU64|BPF_MOV|BPF_X, d, s, 0, 0)
+#define MOV_IMM(d, i)		INSN(BPF_ALU64|BPF_MOV|BPF_K, d, 0, 0, i)
+#define ADD_IMM(d, i)		INSN(BPF_ALU64|BPF_ADD|BPF_K, d, 0, 0, i)
+#define LD_MAP(d, fd)		INSN(BPF_LD|BPF_DW|BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, fd), INSN(0, 0, 0, 0, 0)
+#define JEQ_IMM(d, i, o)	INSN(BPF_JMP|BPF_JEQ|BPF_K, d, 0, o, i)
+#define CALL(f)			INSN(BPF_JMP|BPF_CALL, 0, 0, 0, f)
+#define EXIT()			INSN(BPF_JMP|BPF_EXIT, 0, 0, 0, 0)
+#define CTX(f)			offsetof(struct __sk_buff, f)
+
+static long sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof *attr);
+}
+
+static int map_create(int type, int max)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof attr);
+	attr.map_type = type;
+	attr.key_size = sizeof(struct offload_key);
+	attr.value_size = sizeof(uint32_t);
+	attr.max_entries = max;
+	return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+static int map_update(int map, struct offload_key *key, uint32_t value)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof attr);
+	attr.map_fd = map;
+	attr.key = (uint64_t) (unsigned long) key;
+	attr.value = (uint64_t) (unsigned long) &value;
+	attr.flags = BPF_ANY;
+	return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static int map_delete(int map, struct offload_key *key)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof attr);
+	attr.map_fd = map;
+	attr.key = (uint64_t) (unsigned long) key;
+	return sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+/**
+ * if(lookup(passmap, key)) return SK_PASS;
+ * return bpf_sk_redirect_hash(skb, sockmap, key, 0);
+ * with the key on the stack at r10 - 16.
+ */
+static int prog_load(void)
+{
+	struct bpf_insn insns[] = {
+		MOV_REG(BPF_REG_6, BPF_REG_1),
+		LDX_W(BPF_REG_2, BPF_REG_6, CTX(remote_ip4)),
+		STX_W(BPF_REG_10, BPF_REG_2, -16),
+		LDX_W(BPF_REG_2, BPF_REG_6, CTX(local_ip4)),
+		STX_W(BPF_REG_10, BPF_REG_2, -12),
+		LDX_W(BPF_REG_2, BPF_REG_6, CTX(remote_port)),
+		STX_W(BPF_REG_10, BPF_REG_2, -8),
+		LDX_W(BPF_REG_2, BPF_REG_6, CTX(local_port)),
+		STX_W(BPF_REG_10, BPF_REG_2, -4),
+		LD_MAP(BPF_REG_1, off.passmap),
+		MOV_REG(BPF_REG_2, BPF_REG_10),
+		ADD_IMM(BPF_REG_2, -16),
+		CALL(BPF_FUNC_map_lookup_elem),
+		JEQ_IMM(BPF_REG_0, 0, 2),
+		MOV_IMM(BPF_REG_0, SK_PASS),
+		EXIT(),
+		MOV_REG(BPF_REG_1, BPF_REG_6),
+		LD_MAP(BPF_REG_2, off.sockmap),
+		MOV_REG(BPF_REG_3, BPF_REG_10),
+		ADD_IMM(BPF_REG_3, -16),
+		MOV_IMM(BPF_REG_4, 0),
+		CALL(BPF_FUNC_sk_redirect_hash),
+		EXIT()
+	};
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof attr);
+	attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+	attr.insns = (uint64_t) (unsigned long) insns;
+	attr.insn_cnt = sizeof insns / sizeof insns[0];
+	attr.license = (uint64_t) (unsigned long) "GPL";
+	return sys_bpf(BPF_PROG_LOAD, &attr);
+}
+
+static int prog_attach(void)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof attr);
+	attr.target_fd = off.sockmap;
+	attr.attach_bpf_fd = off.prog;
+	attr.attach_type = BPF_SK_SKB_VERDICT;
+	return sys_bpf(BPF_PROG_ATTACH, &attr);
+}
+
+int offload_init(int max)
+{
+	memset(&off.stats, 0, sizeof off.stats);
+	off.keys = (struct offload_key *) calloc(max, sizeof(struct offload_key));
+	if(!off.keys)
+		return -1;
+	if((off.sockmap = map_create(BPF_MAP_TYPE_SOCKHASH, max)) < 0 ||
+		(off.passmap = map_create(BPF_MAP_TYPE_HASH, max)) < 0) {
+		DEBUG("bpf map create failed");
+		offload_destroy();
+		return -1;
+	}
+	if((off.prog = prog_load()) < 0 || prog_attach() < 0) {
+		DEBUG("bpf verdict program failed");
+		offload_destroy();
+		return -1;
+	}
+	return 0;
+}
+
+/* the key the verdict program builds for segments arriving on fd */
+static int socket_key(int fd, struct offload_key *key)
+{
+	struct sockaddr_in local, remote;
+	socklen_t len = sizeof local;
+
+	if(getsockname(fd, (struct sockaddr *) &local, &len) < 0 ||
+		local.sin_family != AF_INET)
+		return -1;
+	len = sizeof remote;
+	if(getpeername(fd, (struct sockaddr *) &remote, &len) < 0 ||
+		remote.sin_family != AF_INET)
+		return -1;
+	key->remote_ip4 = remote.sin_addr.s_addr;
+	key->local_ip4 = local.sin_addr.s_addr;
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	key->remote_port = (uint32_t) remote.sin_port << 16;
+#else
+	key->remote_port = remote.sin_port;
+#endif
+	key->local_port = ntohs(local.sin_port);
+	return 0;
+}
+
+static void unwatch(struct connection *conn)
+{
+	if(conn->events && epoll_ctl(conn->srv->epollfd, EPOLL_CTL_DEL, conn->fd, NULL) < 0)
+		DEBUG("epoll_ctl failed");
+	conn->events = 0;
+}
+
+/* data already queued missed the verdict, a new SO_RCVLOWAT runs it again */
+static void kick(struct connection *conn)
+{
+	int one = 1;
+
+	setsockopt(conn->fd, SOL_SOCKET, SO_RCVLOWAT, &one, sizeof one);
+}
+
+int offload_start(struct connection *client)
+{
+	struct connection *target = connection_peer(client);
+
+	if(off.prog < 0 || !target || client->cap || client->metered || client->buf || target->buf)
+		return -1;
+	if(socket_key(client->fd, &off.keys[client->fd]) < 0 ||
+		socket_key(target->fd, &off.keys[target->fd]) < 0)
+		return -1;
+
+	if(map_update(off.sockmap, &off.keys[client->fd], target->fd) < 0 ||
+		map_update(off.sockmap, &off.keys[target->fd], client->fd) < 0) {
+		DEBUG("sockmap update failed");
+		map_delete(off.sockmap, &off.keys[client->fd]);
+		off.stats.failures++;
+		return -1;
+	}
+	client->offload = target->offload = OFFLOAD_ON;
+	if(connection_watch(client, EPOLLRDHUP) < 0 || connection_watch(target, EPOLLRDHUP) < 0)
+		DEBUG("epoll_ctl failed");
+	kick(client);
+	kick(target);
+	off.stats.sessions++;
+	off.stats.active++;
+	return 0;
+}
+
+/* refused once a FIN went through: after its EPIPE, the psock of that leg drops what it passes up */
+int offload_pause(struct connection *client)
+{
+	struct connection *target = connection_peer(client);
+
+	if(client->offload != OFFLOAD_ON || !target || client->eof || target->eof)
+		return -1;
+	if(map_update(off.passmap, &off.keys[client->fd], 1) < 0 ||
+		map_update(off.passmap, &off.keys[target->fd], 1) < 0) {
+		DEBUG("passmap update failed");
+		map_delete(off.passmap, &off.keys[client->fd]);
+		return -1;
+	}
+	client->offload = target->offload = OFFLOAD_PAUSING;
+	return 0;
+}
+
+static int unsent(struct connection *conn)
+{
+	int n = 0;
+
+	if(ioctl(conn->fd, SIOCOUTQ, &n) < 0)
+		return 0;
+	return n;
+}
+
+/* drained: nothing redirected towards to can still be in flight */
+static int pass_fin(struct connection *from, struct connection *to, int drained)
+{
+	if(!from->eof || to->shut || (!drained && unsent(to)))
+		return 0;
+	if(shutdown(to->fd, SHUT_WR) < 0) {
+		DEBUG("shutdown() failed");
+		return -1;
+	}
+	to->shut = 1;
+	return 0;
+}
+
+/**
+ * Redirected segments the peer had no room for sit in the kernel until
+ * it has, so a FIN only marks its direction done and stops watching the
+ * leg; offload_tick() passes it on once those segments went out, and
+ * the other direction keeps flowing. An error, or a hangup before we
+ * sent our FIN, ends both directions: the session is closed once the
+ * send queues are empty. Either way the idle timeouts still apply.
+ */
+void offload_hangup(struct connection *conn, unsigned int events)
+{
+	struct connection *peer = connection_peer(conn);
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	/*
+	 * A FIN that came in a segment of its own is redirected as an empty
+	 * one, which the psock reports as EPIPE on this leg once everything
+	 * before it went out: its peer is done and the FIN can follow right
+	 * away. Reading SO_ERROR clears it.
+	 */
+	if(events & EPOLLERR && peer && conn->offload == OFFLOAD_ON &&
+		getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == EPIPE) {
+		events &= ~EPOLLERR;
+		peer->eof = 1;
+		if(pass_fin(peer, conn, 1) < 0)
+			events |= EPOLLERR;
+	}
+	if(!(events & (EPOLLERR|EPOLLRDHUP|EPOLLHUP)))
+		return;
+	unwatch(conn);
+	/* passed up since the pause, the FIN is the relay's to read after the data */
+	if(conn->offload == OFFLOAD_PAUSING && !(events & EPOLLERR))
+		return;
+	conn->eof = 1;
+	if(!(events & EPOLLERR) && (!(events & EPOLLHUP) || conn->shut))
+		return;
+	conn->offload = OFFLOAD_CLOSING;
+	if(peer) {
+		unwatch(peer);
+		peer->offload = OFFLOAD_CLOSING;
+	}
+}
+
+static void refresh(struct connection *conn)
+{
+	struct tcp_info ti;
+	socklen_t len = sizeof ti;
+	time_t t;
+
+	if(getsockopt(conn->fd, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0)
+		return;
+	t = conn->srv->now - ti.tcpi_last_data_recv / 1000;
+	if(t > conn->recv_time)
+		conn->recv_time = t;
+}
+
+int offload_tick(struct connection *client)
+{
+	struct connection *target = connection_peer(client);
+
+	if(!target || client->offload == OFFLOAD_RELAY)
+		return 0;
+	refresh(client);
+	refresh(target);
+
+	switch(client->offload) {
+		case OFFLOAD_ON:
+			if(pass_fin(client, target, 0) < 0 || pass_fin(target, client, 0) < 0)
+				return -1;
+			break;
+		case OFFLOAD_PAUSING:
+			/* segments redirected before the pass flag have been sent by now */
+			client->offload = target->offload = OFFLOAD_RELAY;
+			relay_watch(client);
+			relay_watch(target);
+			off.stats.active--;
+			off.stats.paused++;
+			break;
+		case OFFLOAD_CLOSING:
+			if(!unsent(client) && !unsent(target))
+				return -1;
+			break;
+	}
+	if(client->shut && target->shut) {
+		DEBUG("session %lu: both directions finished", client->id);
+		return -1;
+	}
+	return 0;
+}
+
+void offload_release(struct connection *conn)
+{
+	struct tcp_info ti;
+	socklen_t len = sizeof ti;
+
+	if(conn->offload == OFFLOAD_NONE)
+		return;
+	if(getsockopt(conn->fd, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0)
+		off.stats.bytes += ti.tcpi_bytes_received;
+	/* the socket leaves sockmap when it is closed, a pass flag would outlive it */
+	if(conn->offload == OFFLOAD_RELAY || conn->offload == OFFLOAD_PAUSING)
+		map_delete(off.passmap, &off.keys[conn->fd]);
+	if(conn->offload != OFFLOAD_RELAY && conn->type == CLIENT)
+		off.stats.active--;
+	conn->offload = OFFLOAD_NONE;
+}
+
+void offload_get_stats(struct offload_stats *stats)
+{
+	*stats = off.stats;
+}
+
+void offload_destroy(void)
+{
+	if(off.prog >= 0)
+		close(off.prog);
+	if(off.passmap >= 0)
+		close(off.passmap);
+	if(off.sockmap >= 0)
+		close(off.sockmap);
+	off.prog = off.passmap = off.sockmap = -1;
+	free(off.keys);
+	off.keys = NULL;
+}
@@ -0,0 +1,65 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef OFFLOAD_H
+#define OFFLOAD_H
+
+#include <stdio.h>
+#include "connection.h"
+
+/**
+ * --offload hands established IPv4 sessions to the kernel: both sockets
+ * go into a BPF sockhash whose sk_skb verdict program redirects every
+ * segment to the other socket, so relayed data never wakes the event
+ * loop. User space keeps EPOLLRDHUP interest only, refreshes the idle
+ * clock from TCP_INFO on the timer tick, passes FINs on and closes the
+ * session.
+ *
+ * A session can be switched back with offload_pause(): a second map
+ * makes the program pass its segments up to the socket again, and the
+ * user-space relay takes over on the next tick, after segments already
+ * queued for redirect have been sent.
+ */
+
+enum offload_state {
+	OFFLOAD_NONE,
+	OFFLOAD_RELAY,		/* switched back, still in the maps */
+	OFFLOAD_ON,
+	OFFLOAD_PAUSING,	/* back to the relay on the next tick */
+	OFFLOAD_CLOSING		/* a leg failed, let the kernel drain */
+};
+
+struct offload_stats {
+	unsigned long sessions;
+	unsigned long active;
+	unsigned long paused;
+	unsigned long failures;
+	unsigned long bytes;	/* received by offloaded sockets, counted at close */
+};
+
+int offload_init(int max);
+int offload_start(struct connection *client);
+int offload_pause(struct connection *client);
+void offload_hangup(struct connection *conn, unsigned int events);
+int offload_tick(struct connection *client);
+void offload_release(struct connection *conn);
+void offload_get_stats(struct offload_stats *);
+void offload_destroy(void);
+
+#endif
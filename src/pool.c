@@ -0,0 +1,237 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <errno.h>
+
+#include "util.h"
+#include "pool.h"
+
+#define BUFS_PER_SLAB	(POOL_SLAB_SIZE / POOL_BUF_SIZE)
+
+/* only with --relay-threads, a worker on its own takes no lock */
+#define POOL_LOCK()	do { if(pool.shared) while(SYNC_LOCK(&pool.lock)) ; } while(0)
+#define POOL_UNLOCK()	do { if(pool.shared) SYNC_UNLOCK(&pool.lock); } while(0)
+
+extern int debug;
+
+struct slab {
+	struct slab *next;	/* slabs that still have free buffers */
+	struct slab *prev;
+	struct buffer *free;
+	unsigned int nfree;
+	int huge;
+	void *mem;
+};
+
+static struct {
+	struct slab *partial;
+	struct slab *spare;	/* one empty slab kept to avoid mmap churn */
+	int hugepages;
+	int shared;		/* used by more than one thread */
+	int lock;
+	struct pool_stats stats;
+} pool;
+
+static void slab_link(struct slab *slab)
+{
+	slab->prev = NULL;
+	slab->next = pool.partial;
+	if(pool.partial)
+		pool.partial->prev = slab;
+	pool.partial = slab;
+}
+
+static void slab_unlink(struct slab *slab)
+{
+	if(slab->prev)
+		slab->prev->next = slab->next;
+	else
+		pool.partial = slab->next;
+	if(slab->next)
+		slab->next->prev = slab->prev;
+	slab->next = slab->prev = NULL;
+}
+
+static struct slab *slab_new(void)
+{
+	struct slab *slab;
+	struct buffer *buf;
+	unsigned int i;
+
+	if(pool.stats.mapped + POOL_SLAB_SIZE > pool.stats.budget)
+		return NULL;
+
+	slab = (struct slab *) calloc(1, sizeof(struct slab));
+	if(!slab)
+		return NULL;
+
+	slab->mem = MAP_FAILED;
+	if(pool.hugepages) {
+		slab->mem = mmap(NULL, POOL_SLAB_SIZE, PROT_READ|PROT_WRITE,
+				MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+		if(slab->mem == MAP_FAILED) {
+			errno = 0;
+			pool.stats.huge_fallbacks++;
+		} else
+			slab->huge = 1;
+	}
+	if(slab->mem == MAP_FAILED)
+		slab->mem = mmap(NULL, POOL_SLAB_SIZE, PROT_READ|PROT_WRITE,
+				MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if(slab->mem == MAP_FAILED) {
+		DEBUG("mmap() failed");
+		free(slab);
+		return NULL;
+	}
+
+	for(i=0;i < BUFS_PER_SLAB; i++) {
+		buf = (struct buffer *) ((char *) slab->mem + i * POOL_BUF_SIZE);
+		buf->slab = slab;
+		buf->next = slab->free;
+		slab->free = buf;
+	}
+	slab->nfree = BUFS_PER_SLAB;
+
+	pool.stats.slabs++;
+	pool.stats.huge_slabs += slab->huge;
+	pool.stats.free += BUFS_PER_SLAB;
+	pool.stats.mapped += POOL_SLAB_SIZE;
+	if(pool.stats.mapped > pool.stats.peak)
+		pool.stats.peak = pool.stats.mapped;
+	return slab;
+}
+
+static void slab_free(struct slab *slab)
+{
+	munmap(slab->mem, POOL_SLAB_SIZE);
+	pool.stats.slabs--;
+	pool.stats.huge_slabs -= slab->huge;
+	pool.stats.free -= BUFS_PER_SLAB;
+	pool.stats.mapped -= POOL_SLAB_SIZE;
+	free(slab);
+}
+
+int pool_init(size_t budget, int hugepages)
+{
+	memset(&pool, 0, sizeof pool);
+	if(budget < POOL_SLAB_SIZE)
+		budget = POOL_SLAB_SIZE;
+	pool.stats.budget = budget;
+	pool.hugepages = hugepages;
+	return 0;
+}
+
+struct buffer *pool_get(void)
+{
+	struct slab *slab;
+	struct buffer *buf;
+
+	POOL_LOCK();
+	if(!(slab = pool.partial)) {
+		if(pool.spare) {
+			slab = pool.spare;
+			pool.spare = NULL;
+		} else if((slab = slab_new()) == NULL) {
+			pool.stats.failures++;
+			POOL_UNLOCK();
+			return NULL;
+		}
+		slab_link(slab);
+	}
+
+	buf = slab->free;
+	slab->free = buf->next;
+	if(--slab->nfree == 0)
+		slab_unlink(slab);
+
+	pool.stats.free--;
+	pool.stats.in_use++;
+	pool.stats.allocs++;
+	POOL_UNLOCK();
+	buf->next = NULL;
+	buf->off = buf->len = 0;
+	buf->zc = 0;
+	return buf;
+}
+
+void pool_put(struct buffer *buf)
+{
+	struct slab *slab = buf->slab;
+
+	POOL_LOCK();
+	buf->next = slab->free;
+	slab->free = buf;
+	pool.stats.free++;
+	pool.stats.in_use--;
+
+	if(++slab->nfree == 1)
+		slab_link(slab);
+	else if(slab->nfree == BUFS_PER_SLAB) {
+		/* give fully drained slabs back, keeping one in reserve */
+		slab_unlink(slab);
+		if(pool.spare)
+			slab_free(slab);
+		else
+			pool.spare = slab;
+	}
+	POOL_UNLOCK();
+}
+
+int pool_available(void)
+{
+	int ret;
+
+	POOL_LOCK();
+	ret = pool.partial || pool.spare ||
+		pool.stats.mapped + POOL_SLAB_SIZE <= pool.stats.budget;
+	POOL_UNLOCK();
+	return ret;
+}
+
+/* before the threads that share it start */
+void pool_share(void)
+{
+	pool.shared = 1;
+}
+
+void pool_get_stats(struct pool_stats *stats)
+{
+	POOL_LOCK();
+	*stats = pool.stats;
+	POOL_UNLOCK();
+}
+
+void pool_destroy(void)
+{
+	struct slab *slab;
+
+	while((slab = pool.partial) != NULL) {
+		slab_unlink(slab);
+		slab_free(slab);
+	}
+	if(pool.spare)
+		slab_free(pool.spare);
+	pool.spare = NULL;
+}
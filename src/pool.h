@@ -0,0 +1,74 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+/**
+ * Relay buffer pool. Buffers are carved out of 2MB slabs (hugepages when
+ * asked for and available) and handed to a session only while it has
+ * data in flight. The total mapped memory never exceeds the budget:
+ * pool_get() returns NULL instead and the relay stops reading.
+ * With relay threads the pool is shared behind a spin lock.
+ */
+
+#define POOL_SLAB_SIZE		(2UL << 20)
+#define POOL_BUF_SIZE		(16384)
+#define DEFAULT_MEM_BUDGET	(256UL << 20)
+
+struct slab;
+
+struct buffer {
+	struct buffer *next;
+	struct slab *slab;
+	unsigned int off;	/* first byte not yet sent */
+	unsigned int len;	/* bytes held */
+	unsigned int zc_id;	/* last MSG_ZEROCOPY send that used it */
+	unsigned int zc;	/* pinned by the kernel until zc_id completes */
+	unsigned char data[];
+};
+
+#define BUFFER_CAPACITY	(POOL_BUF_SIZE - sizeof(struct buffer))
+
+struct pool_stats {
+	size_t budget;
+	size_t mapped;		/* bytes currently mapped in slabs */
+	size_t peak;		/* high water mark of mapped */
+	unsigned long slabs;
+	unsigned long huge_slabs;
+	unsigned long in_use;	/* buffers handed out */
+	unsigned long free;	/* buffers cached in slabs */
+	unsigned long allocs;
+	unsigned long failures;	/* pool_get() refused by the budget */
+	unsigned long huge_fallbacks;
+};
+
+int pool_init(size_t budget, int hugepages);
+struct buffer *pool_get(void);
+void pool_put(struct buffer *);
+int pool_available(void);
+void pool_share(void);
+void pool_get_stats(struct pool_stats *);
+void pool_destroy(void);
+
+#endif
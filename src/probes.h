@@ -0,0 +1,104 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifndef PROBES_H
+#define PROBES_H
+
+/**
+ * USDT (user statically defined tracing) probes, provider "valeria".
+ * A probe site is a single nop plus an ELF note describing where its
+ * arguments live, so it costs nothing until a tracer attaches to it:
+ *
+ *	bpftrace -e 'usdt:./valeria:valeria:accept { printf("%d\n", arg0); }'
+ *
+ * <sys/sdt.h> is used when installed, otherwise the notes are emitted
+ * directly on x86_64. Build with -DNO_PROBES to drop them entirely.
+ * Every probe takes the session id as arg0.
+ *
+ * Each probe site also records into the flight recorder (flight.h),
+ * which -DNO_PROBES leaves in place.
+ */
+
+#include "flight.h"
+
+#if defined(NO_PROBES)
+#define PROBE_ENABLED 0
+#elif defined(__has_include) && __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE_ENABLED 1
+#define _USDT1(name, a) DTRACE_PROBE1(valeria, name, a)
+#define _USDT2(name, a, b) DTRACE_PROBE2(valeria, name, a, b)
+#define _USDT3(name, a, b, c) DTRACE_PROBE3(valeria, name, a, b, c)
+#elif defined(__x86_64__) && defined(__GNUC__)
+#define PROBE_ENABLED 1
+
+/* every argument is widened to a signed 64 bit value ("-8@operand") */
+#define _PROBE_NOTE(name, args)	\
+	"990:	nop\n" \
+	".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+	".balign 4\n" \
+	".4byte 992f-991f, 994f-993f, 3\n" \
+	"991:	.asciz \"stapsdt\"\n" \
+	"992:	.balign 4\n" \
+	"993:	.8byte 990b\n" \
+	".8byte _.stapsdt.base\n" \
+	".8byte 0\n" \
+	".asciz \"valeria\"\n" \
+	".asciz \"" #name "\"\n" \
+	".asciz \"" args "\"\n" \
+	"994:	.balign 4\n" \
+	".popsection\n" \
+	".ifndef _.stapsdt.base\n" \
+	".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+	".weak _.stapsdt.base\n" \
+	".hidden _.stapsdt.base\n" \
+	"_.stapsdt.base: .space 1\n" \
+	".size _.stapsdt.base, 1\n" \
+	".popsection\n" \
+	".endif\n"
+
+#define _USDT1(name, a) \
+	__asm__ __volatile__(_PROBE_NOTE(name, "-8@%0") \
+		:: "nor"((long)(a)))
+#define _USDT2(name, a, b) \
+	__asm__ __volatile__(_PROBE_NOTE(name, "-8@%0 -8@%1") \
+		:: "nor"((long)(a)), "nor"((long)(b)))
+#define _USDT3(name, a, b, c) \
+	__asm__ __volatile__(_PROBE_NOTE(name, "-8@%0 -8@%1 -8@%2") \
+		:: "nor"((long)(a)), "nor"((long)(b)), "nor"((long)(c)))
+#else
+#define PROBE_ENABLED 0
+#endif
+
+#if !PROBE_ENABLED
+#define _USDT1(name, a) do { } while(0)
+#define _USDT2(name, a, b) do { } while(0)
+#define _USDT3(name, a, b, c) do { } while(0)
+#endif
+
+#define PROBE1(name, a) \
+	do { flight_record(FLIGHT_##name, a, 0, 0); _USDT1(name, a); } while(0)
+#define PROBE2(name, a, b) \
+	do { flight_record(FLIGHT_##name, a, b, 0); _USDT2(name, a, b); } while(0)
+#define PROBE3(name, a, b, c) \
+	do { flight_record(FLIGHT_##name, a, b, c); _USDT3(name, a, b, c); } while(0)
+
+#endif
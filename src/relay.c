@@ -0,0 +1,547 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <time.h>
+#include <errno.h>
+
+#include "util.h"
+#include "server.h"
+#include "connection.h"
+#include "socks5.h"
+#include "relay.h"
+#include "pool.h"
+#include "capture.h"
+#include "topk.h"
+#include "offload.h"
+#include "account.h"
+#include "probes.h"
+
+/* flows score up to RELAY_SCORE_MAX, reaching RELAY_BULK_SCORE makes them bulk */
+#define RELAY_SCORE_MAX		(8)
+#define RELAY_BULK_SCORE	(4)
+
+extern int debug;
+extern int zerocopy_min;
+extern int relay_quantum;
+extern int relay_auth_weight;
+
+static void stall_add(struct connection *conn)
+{
+	struct server *srv = conn->srv;
+
+	conn->stalled = 1;
+	conn->stall_next = -1;
+	conn->stall_prev = srv->stall_tail;
+	if(srv->stall_tail >= 0)
+		srv->connections[srv->stall_tail].stall_next = conn->fd;
+	else
+		srv->stall_head = conn->fd;
+	srv->stall_tail = conn->fd;
+	srv->stalls++;
+}
+
+static void stall_del(struct connection *conn)
+{
+	struct server *srv = conn->srv;
+
+	if(conn->stall_prev >= 0)
+		srv->connections[conn->stall_prev].stall_next = conn->stall_next;
+	else
+		srv->stall_head = conn->stall_next;
+	if(conn->stall_next >= 0)
+		srv->connections[conn->stall_next].stall_prev = conn->stall_prev;
+	else
+		srv->stall_tail = conn->stall_prev;
+	conn->stalled = 0;
+}
+
+static void ready_add(struct connection *conn)
+{
+	struct server *srv = conn->srv;
+
+	conn->ready = 1;
+	conn->ready_next = -1;
+	conn->ready_prev = srv->ready_tail;
+	if(srv->ready_tail >= 0)
+		srv->connections[srv->ready_tail].ready_next = conn->fd;
+	else
+		srv->ready_head = conn->fd;
+	srv->ready_tail = conn->fd;
+	srv->relay_yields++;
+}
+
+static void ready_del(struct connection *conn)
+{
+	struct server *srv = conn->srv;
+
+	if(conn->ready_prev >= 0)
+		srv->connections[conn->ready_prev].ready_next = conn->ready_next;
+	else
+		srv->ready_head = conn->ready_next;
+	if(conn->ready_next >= 0)
+		srv->connections[conn->ready_next].ready_prev = conn->ready_prev;
+	else
+		srv->ready_tail = conn->ready_prev;
+	conn->ready = 0;
+}
+
+/* return a buffer and let the oldest stalled connection read again */
+static void relay_put(struct server *srv, struct buffer *buf)
+{
+	struct connection *conn;
+
+	pool_put(buf);
+	if(srv->stall_head < 0)
+		return;
+	conn = &srv->connections[srv->stall_head];
+	stall_del(conn);
+	relay_watch(conn);
+}
+
+static void relay_abort(struct connection *conn)
+{
+	if(connection_peer(conn) && connection_peer(conn)->open)
+		connection_close(connection_peer(conn));
+	connection_close(conn);
+}
+
+/**
+ * Flows are classified from their reads: filling the whole read scores
+ * up, a small read scores down. Bulk flows read and write RELAY_IOV
+ * buffers per syscall, interactive ones a single buffer.
+ */
+static void relay_classify(struct connection *conn, size_t len, size_t cap)
+{
+	if(len == cap) {
+		conn->score += 2;
+		if(conn->score > RELAY_SCORE_MAX)
+			conn->score = RELAY_SCORE_MAX;
+	} else if(len < BUFFER_CAPACITY / 2 && conn->score > 0)
+		conn->score--;
+
+	if(!conn->bulk && conn->score >= RELAY_BULK_SCORE)
+		conn->bulk = 1;
+	else if(conn->bulk && conn->score == 0)
+		conn->bulk = 0;
+}
+
+/* loopback peers get nothing from MSG_ZEROCOPY but the notification cost */
+static int relay_zc_enable(struct connection *conn)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof addr;
+	int val = 1;
+
+	if(conn->zc == 0) {
+		conn->zc = -1;
+		if(getpeername(conn->fd, (struct sockaddr *) &addr, &len) < 0)
+			errno = 0;
+		else if(addr.ss_family == AF_INET &&
+			(ntohl(((struct sockaddr_in *) &addr)->sin_addr.s_addr) >> 24) == 127)
+			;
+		else if(addr.ss_family == AF_INET6 &&
+			IN6_IS_ADDR_LOOPBACK(&((struct sockaddr_in6 *) &addr)->sin6_addr))
+			;
+		else if(setsockopt(conn->fd, SOL_SOCKET, SO_ZEROCOPY, &val, sizeof val) < 0)
+			errno = 0;
+		else
+			conn->zc = 1;
+	}
+	return conn->zc > 0;
+}
+
+/* buffers written with MSG_ZEROCOPY wait on the socket until completed */
+static void relay_zc_hold(struct connection *conn, struct buffer *buf)
+{
+	buf->next = NULL;
+	if(conn->zc_tail)
+		conn->zc_tail->next = buf;
+	else
+		conn->zc_head = buf;
+	conn->zc_tail = buf;
+}
+
+static void relay_zc_release(struct connection *conn, int all)
+{
+	struct buffer *buf;
+
+	while((buf = conn->zc_head) != NULL &&
+		(all || (int)(buf->zc_id - conn->zc_done) < 0)) {
+		conn->zc_head = buf->next;
+		if(!conn->zc_head)
+			conn->zc_tail = NULL;
+		relay_put(conn->srv, buf);
+	}
+}
+
+/* write what conn has buffered to its peer */
+static int relay_flush(struct connection *conn)
+{
+	struct connection *peer = &conn->srv->connections[conn->dst_fd];
+	struct iovec iov[RELAY_IOV];
+	struct msghdr msg;
+	struct buffer *buf;
+	size_t total = 0, sent, chunk;
+	int flags = MSG_DONTWAIT|MSG_NOSIGNAL;
+	int n = 0, len;
+
+	for(buf = conn->buf; buf && n < RELAY_IOV; buf = buf->next, n++) {
+		iov[n].iov_base = buf->data + buf->off;
+		iov[n].iov_len = buf->len - buf->off;
+		total += iov[n].iov_len;
+	}
+	if(zerocopy_min && conn->bulk && total >= (size_t)zerocopy_min &&
+		relay_zc_enable(peer))
+		flags |= MSG_ZEROCOPY;
+
+	if(n == 1 && !(flags & MSG_ZEROCOPY))
+		len = send(conn->dst_fd, iov[0].iov_base, iov[0].iov_len, flags);
+	else {
+		memset(&msg, 0, sizeof msg);
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
+		len = sendmsg(conn->dst_fd, &msg, flags);
+		if(len < 0 && errno == ENOBUFS && flags & MSG_ZEROCOPY) {
+			/* out of optmem for notifications, copy this one */
+			errno = 0;
+			len = sendmsg(conn->dst_fd, &msg, flags & ~MSG_ZEROCOPY);
+			flags &= ~MSG_ZEROCOPY;
+		}
+	}
+	conn->srv->relay_writes++;
+	PROBE3(relay_write, conn->id, conn->dst_fd, len);
+	if(len < 0) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK) {
+			errno = 0;
+			return 0;
+		}
+		return -1;
+	}
+	conn->srv->relay_bytes += len;
+	if(flags & MSG_ZEROCOPY)
+		conn->srv->zc_sends++;
+
+	sent = len;
+	for(buf = conn->buf; buf && sent > 0; buf = buf->next) {
+		chunk = buf->len - buf->off < sent ? buf->len - buf->off : sent;
+		buf->off += chunk;
+		sent -= chunk;
+		if(flags & MSG_ZEROCOPY) {
+			buf->zc = 1;
+			buf->zc_id = peer->zc_seq;
+		}
+	}
+	if(flags & MSG_ZEROCOPY)
+		peer->zc_seq++;
+
+	while((buf = conn->buf) != NULL && buf->off == buf->len) {
+		conn->buf = buf->next;
+		if(buf->zc)
+			relay_zc_hold(peer, buf);
+		else
+			relay_put(conn->srv, buf);
+	}
+	return 0;
+}
+
+void relay_watch(struct connection *conn)
+{
+	struct connection *peer = connection_peer(conn);
+	unsigned int events = 0;
+
+	/* the offload module watches sockets the kernel is relaying */
+	if(conn->offload >= OFFLOAD_ON || conn->retired)
+		return;
+	/* EPOLLRDHUP is level triggered, only ask for it while reading */
+	if(!conn->eof && !conn->buf && !conn->stalled && !conn->ready)
+		events |= EPOLLIN|EPOLLRDHUP;
+	if(peer && peer->open && peer->buf)
+		events |= EPOLLOUT;
+	if(connection_watch(conn, events) < 0)
+		DEBUG("epoll_ctl failed");
+}
+
+void relay_release(struct connection *conn)
+{
+	struct buffer *buf;
+
+	if(conn->stalled)
+		stall_del(conn);
+	if(conn->ready)
+		ready_del(conn);
+	while((buf = conn->buf) != NULL) {
+		conn->buf = buf->next;
+		relay_put(conn->srv, buf);
+	}
+	/* the socket is going away, the kernel gives up the pages with it */
+	relay_zc_release(conn, 1);
+	conn->zc = 0;
+	conn->zc_seq = conn->zc_done = 0;
+	conn->bulk = conn->score = 0;
+}
+
+/* out of its server's lists and epoll set, the buffers stay with it */
+void relay_detach(struct connection *conn)
+{
+	if(conn->stalled)
+		stall_del(conn);
+	if(conn->ready)
+		ready_del(conn);
+	if(connection_watch(conn, 0) < 0)
+		DEBUG("epoll_ctl failed");
+}
+
+/* buffers given back on another thread do not go through relay_put() here */
+void relay_unstall(struct server *srv)
+{
+	struct connection *conn;
+
+	while(srv->stall_head >= 0 && pool_available()) {
+		conn = &srv->connections[srv->stall_head];
+		stall_del(conn);
+		relay_watch(conn);
+	}
+}
+
+int relay_zc_complete(struct connection *conn)
+{
+	char control[128];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *ee;
+	int val = 0;
+	socklen_t len = sizeof val;
+
+	for(;;) {
+		memset(&msg, 0, sizeof msg);
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof control;
+		if(recvmsg(conn->fd, &msg, MSG_ERRQUEUE|MSG_DONTWAIT) < 0) {
+			errno = 0;
+			break;
+		}
+		for(cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if(!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+				(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+				continue;
+			ee = (struct sock_extended_err *) CMSG_DATA(cm);
+			if(ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+				conn->zc_error = ee->ee_errno;
+				continue;
+			}
+			conn->zc_done = ee->ee_data + 1;
+			if(ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+				/* the kernel copied anyway (loopback, no sg): stop paying for it */
+				conn->srv->zc_copied++;
+				conn->zc = -1;
+			}
+		}
+	}
+	relay_zc_release(conn, 0);
+
+	if(getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &val, &len) == 0 && val) {
+		errno = val;
+		return -1;
+	}
+	return conn->zc_error ? -1 : 0;
+}
+
+/**
+ * A leg that read its FIN passes it on with shutdown(SHUT_WR) once the
+ * bytes read before it have been written, and the session ends when
+ * both directions have done so. Returns 1 when it closed the session.
+ */
+static int relay_half_close(struct connection *conn)
+{
+	struct connection *peer = connection_peer(conn);
+	struct connection *from, *to;
+	int i;
+
+	if(!peer || !peer->open)
+		return 0;
+	for(i=0;i < 2; i++) {
+		from = i ? peer : conn;
+		to = i ? conn : peer;
+		if(!from->eof || from->buf || to->shut)
+			continue;
+		if(shutdown(to->fd, SHUT_WR) < 0) {
+			DEBUG("shutdown() failed");
+			relay_abort(conn);
+			return 1;
+		}
+		to->shut = 1;
+	}
+	if(conn->shut && peer->shut) {
+		DEBUG("session %lu: both directions finished", conn->id);
+		relay_abort(conn);
+		return 1;
+	}
+	return 0;
+}
+
+int proxy_data(struct connection *conn)
+{
+	struct connection *peer, *client;
+	struct buffer *bufs[RELAY_IOV], *buf, **tail;
+	struct iovec iov[RELAY_IOV];
+	struct msghdr msg;
+	size_t cap, got, spent = 0, budget;
+	int n, i, len, more = 0;
+
+	if(conn->type != TARGET && conn->state != S5_CONNECT) {
+		DEBUG("Oops! proxy_data got invalid client");
+		connection_close(conn);
+		return 0;
+	}
+	if((peer = connection_peer(conn)) == NULL) {
+		connection_close(conn);
+		return 0;
+	}
+	if(conn->buf || conn->stalled || conn->ready || conn->eof)
+		return 0;
+
+	client = conn->type == CLIENT ? conn : peer;
+	budget = (size_t) relay_quantum * (client->authed ? relay_auth_weight : 1);
+	do {
+		for(n=0;n < (conn->bulk ? RELAY_IOV : 1); n++) {
+			if((bufs[n] = pool_get()) == NULL)
+				break;
+			iov[n].iov_base = bufs[n]->data;
+			iov[n].iov_len = BUFFER_CAPACITY;
+		}
+		if(n == 0) {
+			DEBUG("relay buffer budget exhausted, stalling");
+			stall_add(conn);
+			break;
+		}
+		cap = n * BUFFER_CAPACITY;
+
+		if(n == 1)
+			len = recv(conn->fd, bufs[0]->data, BUFFER_CAPACITY, MSG_DONTWAIT);
+		else {
+			memset(&msg, 0, sizeof msg);
+			msg.msg_iov = iov;
+			msg.msg_iovlen = n;
+			len = recvmsg(conn->fd, &msg, MSG_DONTWAIT);
+		}
+		conn->srv->relay_reads++;
+		if(len <= 0) {
+			for(i=0;i < n; i++)
+				relay_put(conn->srv, bufs[i]);
+			if(len == 0) {
+				conn->eof = 1;
+				break;
+			}
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				errno = 0;
+				break;
+			}
+			DEBUG("proxy_data failed while recv()");
+			relay_abort(conn);
+			return -1;
+		}
+		PROBE3(relay_read, conn->id, conn->fd, len);
+		if(client->cap)
+			capture_burst(client, conn->type == TARGET, len);
+		/* the sketch belongs to the control thread, see rthread_collect() */
+		if(conn->srv->rthread)
+			client->relayed += len;
+		else
+			topk_add(TOPK_BYTES, conn->type == TARGET ? &conn->dest : &peer->dest, len);
+
+		conn->recv_time = conn->srv->now;
+		got = len;
+		relay_classify(conn, got, cap);
+
+		tail = &conn->buf;
+		for(i=0;i < n; i++) {
+			buf = bufs[i];
+			if(len <= 0) {
+				relay_put(conn->srv, buf);
+				continue;
+			}
+			buf->len = (size_t)len < BUFFER_CAPACITY ? (size_t)len : BUFFER_CAPACITY;
+			len -= buf->len;
+			*tail = buf;
+			tail = &buf->next;
+		}
+		if(relay_flush(conn) < 0) {
+			DEBUG("proxy_data failed while send()");
+			relay_abort(conn);
+			return -1;
+		}
+		if(client->metered && account_bytes(client, conn->type == TARGET, got) < 0) {
+			DEBUG("byte quota used up, closing the session");
+			relay_abort(conn);
+			return -1;
+		}
+		spent += got;
+		if(!conn->buf && got == cap && spent >= budget) {
+			/* turn used up with data still waiting: back of the line */
+			ready_add(conn);
+			more = 1;
+		}
+	} while(!more && !conn->buf && got == cap);
+
+	relay_watch(conn);
+	relay_watch(peer);
+	relay_half_close(conn);
+	return 0;
+}
+
+/**
+ * One more turn for each connection that yielded, in order. Those that
+ * yield again go to the back and wait for the next epoll batch.
+ */
+void relay_run(struct server *srv)
+{
+	struct connection *conn;
+	int n = 0, fd;
+
+	/* closing one session can take others off the list, count first */
+	for(fd = srv->ready_head; fd >= 0; fd = srv->connections[fd].ready_next)
+		n++;
+	while(n-- > 0 && (fd = srv->ready_head) >= 0) {
+		conn = &srv->connections[fd];
+		ready_del(conn);
+		if(conn->open && proxy_data(conn) < 0)
+			DEBUG("proxy_data failed");
+	}
+}
+
+int relay_drain(struct connection *conn)
+{
+	struct connection *peer = connection_peer(conn);
+
+	if(peer && peer->open && peer->buf && relay_flush(peer) < 0) {
+		DEBUG("relay_drain failed while send()");
+		relay_abort(conn);
+		return -1;
+	}
+	relay_watch(conn);
+	if(peer && peer->open)
+		relay_watch(peer);
+	relay_half_close(conn);
+	return 0;
+}
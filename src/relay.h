@@ -0,0 +1,65 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifndef RELAY_H
+#define RELAY_H
+
+#include "connection.h"
+
+/**
+ * Data relay between the two legs of a session. Bytes read on a
+ * connection that could not be written to its peer stay in conn->buf,
+ * and the connection is not read again until they drain (EPOLLOUT on
+ * the peer). When the buffer pool is over budget the connection is
+ * stalled: it leaves EPOLLIN and waits on srv->stall_head until a
+ * buffer is given back.
+ *
+ * Flows that keep filling their reads are promoted to bulk: they move
+ * RELAY_IOV buffers per recvmsg()/sendmsg(), and writes of at least
+ * --zerocopy-min bytes use MSG_ZEROCOPY. Those buffers stay pinned on
+ * the writing socket until the completion shows up on its error queue
+ * (relay_zc_complete(), called on EPOLLERR).
+ *
+ * A read turn stops after --relay-quantum bytes (times the weight of
+ * authenticated sessions). A connection that still had data queues on
+ * srv->ready_head instead of going back to epoll, and relay_run() gives
+ * every queued connection one more turn after each epoll batch, so a
+ * bulk flow cannot hold the loop while small flows wait.
+ *
+ * The two directions end separately. A FIN read on one leg is passed
+ * to the other with shutdown(SHUT_WR) after the bytes before it have
+ * drained, and the session closes once both legs have sent theirs, or
+ * when the remaining direction stalls for --half-close-timeout.
+ */
+
+#define RELAY_IOV		(4)
+#define DEFAULT_RELAY_QUANTUM	(262144)
+
+int proxy_data(struct connection *);
+void relay_run(struct server *);
+int relay_drain(struct connection *);
+void relay_watch(struct connection *);
+void relay_release(struct connection *);
+void relay_detach(struct connection *);
+void relay_unstall(struct server *);
+int relay_zc_complete(struct connection *);
+
+#endif
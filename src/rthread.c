@@ -0,0 +1,446 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <errno.h>
+
+#include "util.h"
+#include "server.h"
+#include "connection.h"
+#include "socks5.h"
+#include "relay.h"
+#include "pool.h"
+#include "topk.h"
+#include "account.h"
+#include "flight.h"
+#include "tcpstat.h"
+#include "rthread.h"
+
+#define RTHREAD_EVENTS		(256)
+/* how often a relay thread with stalled sessions looks at the pool */
+#define RTHREAD_STALL_MS	(10)
+
+extern int debug;
+
+/* one writer and one reader each, the indices on lines of their own */
+struct ring {
+	unsigned int head __attribute__((aligned(64)));	/* next to take, the reader's */
+	unsigned int tail __attribute__((aligned(64)));	/* next free, the writer's */
+	unsigned int mask __attribute__((aligned(64)));
+	int *fds;
+};
+
+struct rthread {
+	pthread_t tid;
+	int id;
+	int efd;		/* eventfd, kicked when sessions wait on in */
+	int stop;
+	struct server *srv;
+	struct ring in;		/* control thread to relay thread */
+	struct ring out;	/* relay thread back to the control thread */
+	/* the control thread's */
+	int active;		/* handed over and not back yet */
+	unsigned long handoffs;
+	/* the relay thread's */
+	int *sessions;		/* client fds it relays, see conn->rslot */
+	int nsessions;
+	int *done;		/* retired in this iteration, returned at its end */
+	int ndone;
+};
+
+static struct {
+	struct rthread *threads;
+	int count;
+	int next;		/* where the least loaded search starts */
+	int efd;		/* the control thread's eventfd, srv->rfd */
+} rt = { .efd = -1 };
+
+static int ring_init(struct ring *r, int size)
+{
+	unsigned int n = 1;
+
+	while(n < (unsigned int) size)
+		n <<= 1;
+	r->head = r->tail = 0;
+	r->mask = n - 1;
+	r->fds = (int *) calloc(n, sizeof(int));
+	return r->fds ? 0 : -1;
+}
+
+/* sized for open_max, and a session is on one ring at a time: never full */
+static void ring_push(struct ring *r, int fd)
+{
+	unsigned int tail = r->tail;
+
+	r->fds[tail & r->mask] = fd;
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int ring_pop(struct ring *r)
+{
+	unsigned int head = r->head;
+	int fd;
+
+	if(head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+		return -1;
+	fd = r->fds[head & r->mask];
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	return fd;
+}
+
+static void kick(int efd)
+{
+	uint64_t one = 1;
+
+	if(write(efd, &one, sizeof one) < 0)
+		errno = 0;
+}
+
+static void drain(int efd)
+{
+	uint64_t n;
+
+	if(read(efd, &n, sizeof n) < 0)
+		errno = 0;
+}
+
+static void session_add(struct rthread *t, struct connection *client)
+{
+	client->rslot = t->nsessions;
+	t->sessions[t->nsessions++] = client->fd;
+}
+
+static void session_del(struct rthread *t, struct connection *client)
+{
+	int fd = t->sessions[--t->nsessions];
+
+	t->sessions[client->rslot] = fd;
+	t->srv->connections[fd].rslot = client->rslot;
+}
+
+/* sessions the control thread queued for us start relaying here */
+static void take_handoffs(struct rthread *t)
+{
+	struct connection *client;
+	int fd;
+
+	drain(t->efd);
+	while((fd = ring_pop(&t->in)) >= 0) {
+		client = &t->srv->connections[fd];
+		session_add(t, client);
+		relay_watch(client);
+		relay_watch(connection_peer(client));
+	}
+}
+
+static void return_sessions(struct rthread *t)
+{
+	int i;
+
+	if(!t->ndone)
+		return;
+	for(i=0;i < t->ndone; i++)
+		ring_push(&t->out, t->done[i]);
+	t->ndone = 0;
+	kick(rt.efd);
+}
+
+/* the idle and half-close deadlines of server_timeout(), once a second */
+static void relay_timeout(struct rthread *t)
+{
+	struct server *srv = t->srv;
+	struct connection *client, *target;
+	int i;
+
+	if(srv->now == srv->last_tick)
+		return;
+	srv->last_tick = srv->now;
+	/* closing moves the last session into slot i, which was already seen */
+	for(i = t->nsessions - 1; i >= 0; i--) {
+		client = &srv->connections[t->sessions[i]];
+		tcpstat_tick(client);
+		if(!server_idle(srv, client))
+			continue;
+		DEBUG("CONNECTION TIMEOUT");
+		target = connection_peer(client);
+		if(target && target->open)
+			connection_close(target);
+		connection_close(client);
+	}
+}
+
+static void *rthread_main(void *arg)
+{
+	struct rthread *t = (struct rthread *) arg;
+	struct server *srv = t->srv;
+	struct epoll_event events[RTHREAD_EVENTS];
+	struct connection *conn;
+	int i, fd, nfds, timeout;
+
+	account_set_thread(t->id);
+	if(flight_thread_init() < 0)
+		DEBUG("relay thread %d: no flight recorder", t->id);
+	while(!__atomic_load_n(&t->stop, __ATOMIC_ACQUIRE)) {
+		/* buffers given back by other threads do not wake stalled sessions */
+		timeout = srv->ready_head >= 0 ? 0 :
+			srv->stall_head >= 0 ? RTHREAD_STALL_MS : 1000;
+		nfds = epoll_wait(srv->epollfd, events, RTHREAD_EVENTS, timeout);
+		if(nfds < 0 && errno != EINTR) {
+			DEBUG("relay thread %d: epoll_wait failed", t->id);
+			break;
+		}
+		srv->now = time(NULL);
+
+		for(i=0;i < nfds; i++) {
+			fd = events[i].data.fd;
+			if(fd == t->efd) {
+				take_handoffs(t);
+				continue;
+			}
+			/* sessions retired earlier in this batch are the control thread's */
+			conn = &srv->connections[fd];
+			if(conn->srv == srv && !conn->retired)
+				server_dispatch(conn, events[i].events);
+		}
+		relay_run(srv);
+		relay_unstall(srv);
+		relay_timeout(t);
+		return_sessions(t);
+	}
+	flight_destroy();
+	return NULL;
+}
+
+static int rthread_setup(struct rthread *t, struct server *ctl)
+{
+	struct epoll_event ev;
+	struct server *srv;
+
+	if((srv = server_create(ctl->open_max)) == NULL)
+		return -1;
+	t->srv = srv;
+	srv->rthread = t;
+	srv->fd = srv->tfd = srv->sfd = srv->afd = srv->rfd = srv->dfd = -1;
+	srv->connections = ctl->connections;
+	srv->stall_head = srv->stall_tail = -1;
+	srv->ready_head = srv->ready_tail = -1;
+	srv->now = ctl->now;
+
+	if((srv->epollfd = epoll_create1(0)) < 0)
+		return -1;
+	if((t->efd = eventfd(0, EFD_NONBLOCK)) < 0)
+		return -1;
+	ev.events = EPOLLIN;
+	ev.data.fd = t->efd;
+	if(epoll_ctl(srv->epollfd, EPOLL_CTL_ADD, t->efd, &ev) < 0)
+		return -1;
+
+	t->sessions = (int *) calloc(ctl->open_max, sizeof(int));
+	t->done = (int *) calloc(ctl->open_max, sizeof(int));
+	if(!t->sessions || !t->done)
+		return -1;
+	if(ring_init(&t->in, ctl->open_max) < 0 || ring_init(&t->out, ctl->open_max) < 0)
+		return -1;
+	return 0;
+}
+
+int rthread_init(struct server *srv, int threads)
+{
+	struct epoll_event ev;
+	sigset_t all, old;
+	struct rthread *t;
+	int i;
+
+	if(threads <= 0)
+		return 0;
+	if(threads > MAX_RELAY_THREADS)
+		threads = MAX_RELAY_THREADS;
+	rt.threads = (struct rthread *) calloc(threads, sizeof(struct rthread));
+	if(!rt.threads)
+		return -1;
+	if((rt.efd = eventfd(0, EFD_NONBLOCK)) < 0)
+		return -1;
+	ev.events = EPOLLIN;
+	ev.data.fd = rt.efd;
+	if(epoll_ctl(srv->epollfd, EPOLL_CTL_ADD, rt.efd, &ev) < 0)
+		return -1;
+	srv->rfd = rt.efd;
+	pool_share();
+
+	/* SIGINT and the stats signals stay with the control thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for(i=0;i < threads; i++) {
+		t = &rt.threads[i];
+		t->id = i;
+		if(rthread_setup(t, srv) < 0 || pthread_create(&t->tid, NULL, rthread_main, t) != 0)
+			break;
+		rt.count++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	DEBUG("%d relay threads", rt.count);
+	return rt.count == threads ? 0 : -1;
+}
+
+/**
+ * On the control thread, once the session reached S5_CONNECT: both legs
+ * leave its epoll set and go to the relay thread with the fewest
+ * sessions. Returns -1 when there are no relay threads.
+ */
+int rthread_handoff(struct connection *client)
+{
+	struct connection *target = connection_peer(client);
+	struct rthread *t;
+	int i;
+
+	if(!rt.count || !target)
+		return -1;
+	/* ties go round robin from the thread after the last one chosen */
+	t = &rt.threads[rt.next % rt.count];
+	for(i=1;i < rt.count; i++)
+		if(rt.threads[(rt.next + i) % rt.count].active < t->active)
+			t = &rt.threads[(rt.next + i) % rt.count];
+	rt.next = t->id + 1;
+
+	relay_detach(client);
+	relay_detach(target);
+	client->srv = target->srv = t->srv;
+	t->active++;
+	t->handoffs++;
+	ring_push(&t->in, client->fd);
+	kick(t->efd);
+	return 0;
+}
+
+/**
+ * connection_close() on a relay thread. Both legs leave its epoll set
+ * and lists, keeping their buffers, and go back to the control thread
+ * at the end of this iteration; until then later events and the second
+ * close of the pair find them retired.
+ */
+void rthread_retire(struct connection *conn)
+{
+	struct rthread *t = conn->srv->rthread;
+	struct connection *client, *target;
+
+	client = conn->type == CLIENT ? conn : connection_peer(conn);
+	if(!client || client->retired)
+		return;
+	target = connection_peer(client);
+	client->retired = 1;
+	relay_detach(client);
+	if(target) {
+		target->retired = 1;
+		relay_detach(target);
+	}
+	session_del(t, client);
+	t->done[t->ndone++] = client->fd;
+}
+
+/* on the control thread: close what the relay threads handed back */
+void rthread_collect(struct server *srv)
+{
+	struct connection *client, *target;
+	struct rthread *t;
+	int i, fd;
+
+	drain(rt.efd);
+	for(i=0;i < rt.count; i++) {
+		t = &rt.threads[i];
+		while((fd = ring_pop(&t->out)) >= 0) {
+			t->active--;
+			client = &srv->connections[fd];
+			client->srv = srv;
+			target = connection_peer(client);
+			if(target) {
+				target->srv = srv;
+				/* the relay thread counted, the sketch is only written here */
+				if(client->relayed)
+					topk_add(TOPK_BYTES, &target->dest, client->relayed);
+			}
+			if(target && target->open)
+				connection_close(target);
+			connection_close(client);
+		}
+	}
+}
+
+/* admin kill: the relay thread reads the hangup and hands the session back */
+void rthread_kill(struct connection *client)
+{
+	shutdown(client->fd, SHUT_RDWR);
+	if(client->dst_fd >= 0)
+		shutdown(client->dst_fd, SHUT_RDWR);
+}
+
+/* add the relay threads' counters to sum */
+void rthread_totals(struct server *sum)
+{
+	struct server *s;
+	int i;
+
+	for(i=0;i < rt.count; i++) {
+		s = rt.threads[i].srv;
+		sum->stalls += s->stalls;
+		sum->relay_yields += s->relay_yields;
+		sum->relay_reads += s->relay_reads;
+		sum->relay_writes += s->relay_writes;
+		sum->relay_bytes += s->relay_bytes;
+		sum->zc_sends += s->zc_sends;
+		sum->zc_copied += s->zc_copied;
+	}
+}
+
+void rthread_dump(FILE *fp)
+{
+	int i;
+
+	fprintf(fp, "relay_threads %d\n", rt.count);
+	for(i=0;i < rt.count; i++)
+		fprintf(fp, "relay_thread_sessions %d %d\n", i, rt.threads[i].active);
+	for(i=0;i < rt.count; i++)
+		fprintf(fp, "relay_thread_handoffs %d %lu\n", i, rt.threads[i].handoffs);
+	for(i=0;i < rt.count; i++)
+		fprintf(fp, "relay_thread_bytes %d %lu\n", i, rt.threads[i].srv->relay_bytes);
+}
+
+/* sessions still relaying are left to the exit */
+void rthread_stop(void)
+{
+	struct rthread *t;
+	int i;
+
+	for(i=0;i < rt.count; i++) {
+		t = &rt.threads[i];
+		__atomic_store_n(&t->stop, 1, __ATOMIC_RELEASE);
+		kick(t->efd);
+		pthread_join(t->tid, NULL);
+	}
+	rt.count = 0;
+}
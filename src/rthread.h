@@ -0,0 +1,59 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifndef RTHREAD_H
+#define RTHREAD_H
+
+#include <stdio.h>
+#include "server.h"
+#include "connection.h"
+
+/**
+ * --relay-threads splits a worker into a control plane and a data
+ * plane. The thread in server_start() keeps the listeners and runs
+ * every session up to S5_CONNECT: accept, greeting, auth, the request,
+ * name resolution and the target connect. A session that starts to
+ * relay leaves that epoll set and is handed, as its client fd on a
+ * single producer single consumer ring, to the relay thread with the
+ * fewest sessions. Each relay thread has a struct server of its own
+ * (epoll set, stall and ready lists, relay counters) and runs
+ * proxy_data() and relay_run() for its sessions only, so a burst of
+ * handshakes does not hold up bytes on established tunnels.
+ *
+ * A relay thread never closes a socket. connection_close() there takes
+ * the session out of its epoll set and returns it on a second ring,
+ * and the control thread closes both legs as before, so admission,
+ * accounting sessions, capture, dest and egress are only touched from
+ * one thread. The buffer pool is shared and takes a spin lock.
+ */
+
+#define MAX_RELAY_THREADS	(64)
+
+int rthread_init(struct server *, int threads);
+int rthread_handoff(struct connection *client);
+void rthread_retire(struct connection *);
+void rthread_collect(struct server *);
+void rthread_kill(struct connection *client);
+void rthread_totals(struct server *sum);
+void rthread_dump(FILE *);
+void rthread_stop(void);
+
+#endif
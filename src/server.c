@@ -30,17 +30,48 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <signal.h>
+#include <unistd.h>
 #include <errno.h>
 
+#ifndef IP_TRANSPARENT
+#define IP_TRANSPARENT		(19)
+#endif
+
 #include "util.h"
 #include "server.h"
 #include "connection.h"
 #include "socks5.h"
+#include "stats.h"
+#include "relay.h"
+#include "admission.h"
+#include "capture.h"
+#include "topk.h"
+#include "dest.h"
+#include "offload.h"
+#include "tcpstat.h"
+#include "account.h"
+#include "tproxy.h"
+#include "tls.h"
+#include "admin.h"
+#include "busypoll.h"
+#include "mptcp.h"
+#include "loopstat.h"
+#include "rthread.h"
+#include "dns.h"
+#include "probes.h"
 
 extern sig_atomic_t interrupt_flag;
+extern sig_atomic_t stats_flag;
+extern sig_atomic_t flight_flag;
+extern char *flight_file;
 extern int debug;
-extern int timeout;
-extern int uptime;
+extern in_addr_t trace_addr;
+extern int handshake_timeout;
+extern int connect_timeout;
+extern int idle_up_timeout;
+extern int idle_down_timeout;
+extern int half_close_timeout;
+extern time_t uptime;
 
 struct server* server_create(size_t max_open)
 {
@@ -55,6 +86,7 @@ int server_init(struct server *srv, char *addr,unsigned short port)
 {
 	int i;
 	srv->ip = inet_addr(addr);
+	srv->tfd = srv->sfd = srv->afd = srv->rfd = srv->dfd = -1;
 	srv->port = htons(port);
 	srv->connections = (struct connection *) calloc(srv->open_max, sizeof(struct connection));
 	if(srv->connections == NULL)
@@ -63,6 +95,8 @@ int server_init(struct server *srv, char *addr,unsigned short port)
 		srv->connections[i].fd = i;
 		srv->connections[i].srv = srv;
 	}
+	srv->stall_head = srv->stall_tail = -1;
+	srv->ready_head = srv->ready_tail = -1;
 	return 0;
 }
 
@@ -70,7 +104,7 @@ int server_socket_bind(struct server *srv)
 {
 	struct sockaddr_in addr;
 	int val = 1;
-	srv->fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK, 0);
+	srv->fd = mptcp_socket(AF_INET);
 	if(srv->fd < 0) 
 		return -1;
 	DEBUG("created server socket");
@@ -91,6 +125,39 @@ int server_socket_bind(struct server *srv)
 	return 0;
 }
 
+/* one more listener on the bind address, for the other front ends */
+int server_listen_port(struct server *srv, unsigned short port, int transparent)
+{
+	struct sockaddr_in addr;
+	struct epoll_event ev;
+	int fd, val = 1;
+
+	if((fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK, 0)) < 0)
+		return -1;
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = srv->ip;
+	addr.sin_port = htons(port);
+
+	if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR|SO_REUSEPORT, &val, sizeof val) < 0)
+		goto fail;
+	/* TPROXY needs it to accept for foreign addresses, REDIRECT does not */
+	if(transparent && setsockopt(fd, SOL_IP, IP_TRANSPARENT, &val, sizeof val) < 0)
+		DEBUG("IP_TRANSPARENT failed, only REDIRECT rules will work");
+	if(bind(fd, (struct sockaddr *) &addr, sizeof addr) < 0 || listen(fd, 128) < 0)
+		goto fail;
+
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if(epoll_ctl(srv->epollfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		goto fail;
+	DEBUG("listening on port %d", port);
+	return fd;
+fail:
+	close(fd);
+	return -1;
+}
+
 int server_listen(struct server *srv)
 {
 	struct epoll_event ev;
@@ -105,12 +172,71 @@ int server_listen(struct server *srv)
 	return 0;
 }
 
-int server_start(struct server *srv)
+static int server_accept(struct server *srv, int lfd)
 {
-	struct epoll_event events[1024], event;
 	struct sockaddr_in addr;
-	int fd, i;
+	struct connection *conn;
 	socklen_t len;
+	int fd;
+
+	memset(&addr, 0, sizeof addr);
+	len = sizeof addr;
+	fd = accept(lfd, (struct sockaddr *)&addr, &len);
+	if(fd < 0) {
+		if(errno == EMFILE || errno == ENFILE)
+			admission_pause(srv);
+		errno = 0;
+		return 0;
+	}
+	if(fd >= srv->open_max || admission_accept(srv, addr.sin_addr.s_addr) < 0) {
+		close(fd);
+		return 0;
+	}
+
+	DEBUG("%s:%d connected", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+	busypoll_socket(fd);
+	conn = &srv->connections[fd];
+	connection_open(conn, CLIENT);
+	conn->addr = addr;
+	conn->id = ++srv->session_seq;
+	conn->state = S5_IDENT;
+	conn->deadline = srv->now + handshake_timeout;
+	capture_start(conn);
+	PROBE2(accept, conn->id, fd);
+
+	if(lfd == srv->tfd) {
+		if(tproxy_start(conn) < 0)
+			DEBUG("tproxy_start failed");
+	} else if(lfd == srv->sfd) {
+		if(tls_start(conn) < 0)
+			DEBUG("tls_start failed");
+	} else if(connection_watch(conn, EPOLLIN|EPOLLRDHUP) < 0)
+		return -1;
+	admission_update(srv);
+	return 0;
+}
+
+/* relay threads run their sessions through here as well */
+void server_dispatch(struct connection *conn, unsigned int events)
+{
+	struct connection *client;
+	in_addr_t addr = __atomic_load_n(&trace_addr, __ATOMIC_RELAXED);
+
+	/* admin "trace <addr>": debug output for the sessions of one client */
+	if(addr) {
+		client = conn->type == CLIENT ? conn : connection_peer(conn);
+		tracing = client && client->addr.sin_addr.s_addr == addr;
+	}
+	handle_client(conn, events);
+	tracing = 0;
+}
+
+int server_start(struct server *srv)
+{
+	struct epoll_event events[1024];
+	struct connection *conn, *peer;
+	uint64_t wake, t;
+	int i, fd, kind;
 	
 	for(;;) {
 		if(interrupt_flag) {
@@ -118,72 +244,192 @@ int server_start(struct server *srv)
 			break;
 		}
 		
-		int nfds = epoll_wait(srv->epollfd, events, sizeof events/ sizeof events[0], 1000);
+		/* sessions left on the ready list must not wait for new events */
+		int nfds = busypoll_wait(srv->epollfd, events, sizeof events/ sizeof events[0],
+				srv->ready_head >= 0 ? 0 : 1000);
 
 		if(nfds < 0 && errno!=EINTR)
 			return -1;
+		wake = t = loopstat_wakeup(nfds, sizeof events / sizeof events[0]);
+		srv->now = time(NULL);
 
 		for(i=0;i < nfds; i++) {
-			
-			if(events[i].data.fd==srv->fd) {
-				
-				if(srv->open_count >= srv->open_max)
-					continue;
-				
-				memset(&addr, 0, sizeof addr);
-				fd = accept(srv->fd, (struct sockaddr *)&addr, &len);
-				if(fd < 0)
-					return -1;
-				
-				DEBUG("%s:%d connected", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
-				connection_open(&srv->connections[fd], CLIENT);
-				srv->connections[fd].state = S5_IDENT;
-				
-				event.events = EPOLLIN|EPOLLRDHUP;
-				event.data.fd = fd;
-				
-				if(epoll_ctl(srv->epollfd, EPOLL_CTL_ADD, fd, &event) < 0)
+			fd = events[i].data.fd;
+			loopstat_lag(wake, t);
+			if(fd == srv->fd || fd == srv->tfd || fd == srv->sfd) {
+				kind = LOOP_ACCEPT;
+				if(server_accept(srv, fd) < 0)
 					return -1;
 			}
-			else 
-				handle_client(&srv->connections[events[i].data.fd], events[i].events);
+			else if(fd == srv->afd || srv->connections[fd].type == ADMIN) {
+				kind = LOOP_ADMIN;
+				admin_event(srv, fd, events[i].events);
+			}
+			else if(fd == srv->rfd) {
+				kind = LOOP_HANDBACK;
+				rthread_collect(srv);
+			}
+			else if(fd == srv->dfd) {
+				kind = LOOP_DNS;
+				dns_collect(srv);
+			}
+			else if(srv->connections[fd].srv != srv)
+				/* handed to a relay thread earlier in this batch */
+				continue;
+			else {
+				/* target events are charged to the state of their session */
+				conn = &srv->connections[fd];
+				peer = conn->type == TARGET ? connection_peer(conn) : NULL;
+				kind = LOOP_STATE(peer ? peer->state : conn->state);
+				server_dispatch(conn, events[i].events);
+			}
+			t = loopstat_handler(kind, t);
 		}
+		relay_run(srv);
+		while((conn = dest_next(srv)) != NULL)
+			if(connect_queued(conn) < 0)
+				DEBUG("connect_queued failed");
+		t = loopstat_handler(LOOP_RELAY_RUN, t);
 
-		server_timeout(srv);
+		/* the scan itself runs once a second */
+		if(srv->now != srv->last_tick) {
+			server_timeout(srv);
+			loopstat_handler(LOOP_TIMEOUT, t);
+		}
+		admission_update(srv);
+		if(srv->draining && srv->open_count <= 5) {
+			DEBUG("drained");
+			break;
+		}
+
+		if(stats_flag) {
+			stats_flag = 0;
+			stats_write(srv);
+		}
+
+		if(flight_flag) {
+			flight_flag = 0;
+			flight_dump(flight_file);
+		}
 
 		if(!debug) 
             fprintf(stderr, "UPTIME: %ld secs | OPEN CONNECTIONS: %d\r",
                 time(NULL) - uptime, srv->open_count - 5);
+		loopstat_iteration(wake);
 		
 	}
 	return 0;
 }
 
+/**
+ * Deadline scan, once per second. The handshake (greeting, auth and
+ * request) has one budget from accept, however the bytes trickle in;
+ * name resolution and the target connect have their own. A relaying session only expires when
+ * both directions have been quiet for their idle timeouts.
+ */
 int server_timeout(struct server *srv) 
 {
-	int i;
+	struct connection *conn, *peer;
+	int i, reply;
+
+	if(srv->now == srv->last_tick)
+		return 0;
+	srv->last_tick = srv->now;
+	capture_tick();
+	account_tick(srv->now);
+
 	for(i=5;i < srv->open_max; i++)
 	{
-		if(!srv->connections[i].open)
+		conn = &srv->connections[i];
+		/* relay threads keep the deadlines of their own sessions */
+		if(!conn->open || conn->srv != srv)
 			continue;
+		peer = connection_peer(conn);
 
-		if(time(NULL) - srv->connections[i].recv_time >= timeout) {
-			if(srv->connections[i].type == TARGET) {
-				if(srv->connections[srv->connections[i].dst_fd].open) {
-					send_reply(&srv->connections[srv->connections[i].dst_fd], REPLY_EXPIRED);
-					connection_close(&srv->connections[srv->connections[i].dst_fd]);
-				}
+		if(conn->type == TARGET) {
+			if(peer)
+				continue;
+			reply = -1;
+		} else if(conn->state == S5_CONNECT) {
+			tcpstat_tick(conn);
+			if(conn->offload && offload_tick(conn) < 0)
+				reply = -1;
+			else if(!server_idle(srv, conn))
+				continue;
+			else
+				reply = -1;
+		} else if(srv->now < conn->deadline)
+			continue;
+		else if(conn->state == S5_PENDING) {
+			reply = REPLY_HSTNRCH;
+			if(peer) {
+				topk_add(TOPK_FAILURES, &peer->dest, 1);
+				dest_failure(&peer->dest, reply, srv->now);
 			}
-			DEBUG("CONNECTION TIMEOUT");
-			connection_close(&srv->connections[i]);
+		} else if(conn->state == S5_RESOLVE) {
+			dns_expired(conn);
+			reply = REPLY_HSTNRCH;
+		} else if(conn->state == S5_REQST || conn->state == S5_HTTP)
+			reply = REPLY_EXPIRED;
+		else if(conn->state == S5_QUEUED)
+			reply = REPLY_FAILURE;
+		else {
+			/* a TLS client that never finishes its handshake is a failure too */
+			if(conn->state == S5_TLS)
+				tls_expired(conn);
+			reply = -1;
 		}
+
+		PROBE3(timeout, conn->id, i, conn->state);
+		DEBUG("CONNECTION TIMEOUT");
+		if(reply >= 0)
+			send_reply(conn, reply);
+		if(peer && peer->open)
+			connection_close(peer);
+		connection_close(conn);
 	}
 	return 0;
 }
 
+/* a relaying session expires when both directions have been quiet too long */
+int server_idle(struct server *srv, struct connection *conn)
+{
+	struct connection *peer = connection_peer(conn);
+
+	/* one direction is done, the other must keep moving */
+	if(conn->eof || (peer && peer->eof))
+		return srv->now - conn->recv_time >= half_close_timeout &&
+			(!peer || srv->now - peer->recv_time >= half_close_timeout);
+	return srv->now - conn->recv_time >= idle_up_timeout &&
+		(!peer || srv->now - peer->recv_time >= idle_down_timeout);
+}
+
+/* stop accepting, sessions in flight finish and server_start() returns */
+void server_drain(struct server *srv)
+{
+	int *fds[] = { &srv->fd, &srv->tfd, &srv->sfd };
+	size_t i;
+
+	if(srv->draining)
+		return;
+	for(i=0;i < sizeof fds / sizeof fds[0]; i++) {
+		if(*fds[i] < 0)
+			continue;
+		epoll_ctl(srv->epollfd, EPOLL_CTL_DEL, *fds[i], NULL);
+		close(*fds[i]);
+		*fds[i] = -1;
+	}
+	srv->draining = 1;
+}
+
 void server_destroy(struct server **srv)
 {
-	close((*srv)->fd);
+	if((*srv)->fd >= 0)
+		close((*srv)->fd);
+	if((*srv)->tfd >= 0)
+		close((*srv)->tfd);
+	if((*srv)->sfd >= 0)
+		close((*srv)->sfd);
 	close((*srv)->epollfd); // ignore return values
 	free((*srv)->connections);
 	(*srv)->connections = NULL;
@@ -25,22 +25,49 @@
 #include <netinet/in.h>
 #include "connection.h"
 
+struct rthread;
+
 struct server {
 	int fd;
+	int tfd;		/* transparent listener, -1 none */
+	int sfd;		/* TLS listener, -1 none */
+	int afd;		/* admin socket, -1 none */
+	int rfd;		/* relay threads hand sessions back here, -1 none */
+	int dfd;		/* resolver threads post answers here, -1 none */
+	unsigned char draining;	/* listeners closed, exit when the last session goes */
 	int epollfd;
 	in_addr_t ip;
 	in_port_t port;
 	int open_count;
 	int open_max;
+	unsigned long session_seq;
+	time_t now;		/* wall clock of the current loop iteration */
+	time_t last_tick;	/* last deadline scan */
+	int stall_head;		/* connections waiting for relay buffers */
+	int stall_tail;
+	unsigned long stalls;
+	int ready_head;		/* connections that used up their turn */
+	int ready_tail;
+	unsigned long relay_yields;
+	unsigned long relay_reads;
+	unsigned long relay_writes;
+	unsigned long relay_bytes;
+	unsigned long zc_sends;
+	unsigned long zc_copied;
 	struct connection *connections;
+	struct rthread *rthread;	/* the relay thread running this server, NULL on the control thread */
 };
 
 struct server* server_create(size_t );
 int server_init(struct server *, char *,unsigned short );
 int server_socket_bind(struct server *);
 int server_listen(struct server *);
+int server_listen_port(struct server *, unsigned short port, int transparent);
 int server_start(struct server *);
+void server_drain(struct server *);
 int server_timeout(struct server *);
+void server_dispatch(struct connection *, unsigned int events);
+int server_idle(struct server *, struct connection *client);
 void server_destroy(struct server **);
 
 #endif
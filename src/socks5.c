@@ -29,8 +29,24 @@
 #include "server.h"
 #include "connection.h"
 #include "socks5.h"
+#include "relay.h"
+#include "admission.h"
+#include "capture.h"
+#include "topk.h"
+#include "dest.h"
+#include "egress.h"
+#include "offload.h"
+#include "account.h"
+#include "http.h"
+#include "tls.h"
+#include "busypoll.h"
+#include "mptcp.h"
+#include "rthread.h"
+#include "dns.h"
+#include "probes.h"
 
 extern int debug;
+extern int connect_timeout;
 
 int socks5_auth_check(struct connection *conn) 
 {
@@ -48,17 +64,19 @@ int socks5_auth_check(struct connection *conn)
 	if(len < 0)
 		return -1;
 	
-	conn->recv_time = time(NULL);
+	conn->recv_time = conn->srv->now;
 	
 	ulen = (int) buf[1];
 	strncpy(uname,(char *) &buf[2], ulen);
+	uname[ulen] = 0;
 	plen = (int) buf[2+ulen];
 	strncpy(pwd,(char *) &buf[2+ulen+1], plen);
+	pwd[plen] = 0;
 
 	DEBUG("Client auth: %s:%s\n", uname, pwd);
 	
 	data[0]=SOCKS5_VERSION;
-	if(!strcmp(uname, SOCKS5_UNAME) && !strcmp(pwd, SOCKS5_PWD)) 
+	if(account_login(conn, uname, pwd) == 0)
 		data[1]=0;
 	else
 		data[1]=255;
@@ -69,45 +87,67 @@ int socks5_auth_check(struct connection *conn)
 
 	if(data[1]) 
 		connection_close(conn);
-	else
-		conn->state = S5_REQST;
+	else {
+		conn->authed = 1;
+		connection_set_state(conn, S5_REQST);
+	}
 	return 0;
 }
 
+/* SOCKS reply for a failed target connect */
+static int connect_reply(int err)
+{
+	switch(err) {
+		case ECONNRESET:
+		case ECONNREFUSED:
+			return REPLY_REFUSED;
+		case EHOSTDOWN:
+		case EHOSTUNREACH:
+			return REPLY_HSTNRCH;
+		case ENETDOWN:
+		case ENETRESET:
+		case ENETUNREACH:
+			return REPLY_NETNRCH;
+		default:
+			return REPLY_FAILURE;
+	}
+}
+
 void handle_client(struct connection *conn, unsigned int flags)
 {
-	int val=0;
+	struct connection *client;
+	int val=0, reply;
 	socklen_t len = 0;
 	if(!conn->open) {
 		DEBUG("Oops! not open");
         return; 
 	}
-    if(flags&EPOLLERR || flags&EPOLLRDHUP || flags&EPOLLHUP) {
+	if(flags & EPOLLERR && conn->zc_seq && relay_zc_complete(conn) == 0)
+		flags &= ~EPOLLERR;
+	if(conn->offload >= OFFLOAD_ON) {
+		offload_hangup(conn, flags);
+		return;
+	}
+	/* a relaying leg that hung up is read to its FIN, which the relay passes on */
+	client = conn->type == CLIENT ? conn : connection_peer(conn);
+	if(!(flags & EPOLLERR) && flags & (EPOLLRDHUP|EPOLLHUP) && client &&
+		client->state == S5_CONNECT)
+		flags |= EPOLLIN;
+	else if(flags&EPOLLERR || flags&EPOLLRDHUP || flags&EPOLLHUP) {
         DEBUG("handle_client: epoll event reporeted an error\n");
-		if(conn->type == TARGET) {
+		if(conn->type == TARGET && conn->dst_fd >= 0 &&
+			conn->srv->connections[conn->dst_fd].state == S5_PENDING) {
+			len = sizeof val;
 			getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &val, &len);
-			switch(val) {
-				case ECONNRESET:
-				case ECONNREFUSED: 
-					send_reply(&conn->srv->connections[conn->dst_fd] , REPLY_REFUSED);
-					break;
-				case EHOSTDOWN:
-				case EHOSTUNREACH:
-					send_reply(&conn->srv->connections[conn->dst_fd] , REPLY_HSTNRCH);
-					break;
-				case ENETDOWN:
-				case ENETRESET:
-				case ENETUNREACH:
-					send_reply(&conn->srv->connections[conn->dst_fd] , REPLY_NETNRCH);
-					break;
-				default: 
-					send_reply(&conn->srv->connections[conn->dst_fd] , REPLY_FAILURE);
-					break;
-			}
+			reply = connect_reply(val);
+			send_reply(&conn->srv->connections[conn->dst_fd], reply);
+			PROBE2(connect_done, conn->id, val);
+			topk_add(TOPK_FAILURES, &conn->dest, 1);
+			dest_failure(&conn->dest, reply, conn->srv->now);
 			DEBUG("Failed to connect to target");
 		}
-		if(conn->srv->connections[conn->dst_fd].open)
-			connection_close(&conn->srv->connections[conn->dst_fd]);
+		if(connection_peer(conn) && connection_peer(conn)->open)
+			connection_close(connection_peer(conn));
         connection_close(conn);
         return;
     }
@@ -127,32 +167,54 @@ void handle_client(struct connection *conn, unsigned int flags)
 					DEBUG("process_request failed");
 				break;
 			case S5_CONNECT:
-				if(proxy_data(conn) < 0)
+				if(flags & EPOLLOUT && relay_drain(conn) < 0) {
+					DEBUG("relay_drain failed");
+				} else if(flags & EPOLLIN && proxy_data(conn) < 0) {
 					DEBUG("proxy_data failed");
+				}
+				break;
+			case S5_HTTP:
+				if(http_request(conn) < 0)
+					DEBUG("http_request failed");
+				break;
+			case S5_TLS:
+				if(tls_handshake(conn) < 0)
+					DEBUG("tls_handshake failed");
 				break;
 			case S5_UDPASS:
 				break;
 			default: break;
 		}
+	} else if(conn->dst_fd < 0) {
+		DEBUG("Oops! target without a client");
+		connection_close(conn);
 	} else {
-		if(flags & EPOLLOUT) {
+		if(conn->srv->connections[conn->dst_fd].state == S5_CONNECT) {
+			if(flags & EPOLLOUT && relay_drain(conn) < 0) {
+				DEBUG("relay_drain failed");
+			} else if(flags & EPOLLIN && proxy_data(conn) < 0) {
+				DEBUG("proxy_data failed");
+			}
+		} else if(flags & EPOLLOUT) {
 			if(errno == EINPROGRESS) {
 				errno = 0;
 				DEBUG("In Progress");
 			} else {
 				DEBUG("Target connection success");
+				PROBE2(connect_done, conn->id, 0);
+				dest_success(&conn->dest);
+				capture_connected(&conn->srv->connections[conn->dst_fd]);
 				send_reply(&conn->srv->connections[conn->dst_fd], REPLY_SUCCESS);	
-				conn->srv->connections[conn->dst_fd].state = S5_CONNECT;
-				struct epoll_event ev;
-				ev.events = EPOLLIN|EPOLLRDHUP;
-				ev.data.fd = conn->fd;
-				if(epoll_ctl(conn->srv->epollfd, EPOLL_CTL_MOD, conn->fd, &ev) < 0)
-					DEBUG("epoll_ctl failed");
+				connection_set_state(&conn->srv->connections[conn->dst_fd], S5_CONNECT);
+				if(rthread_handoff(&conn->srv->connections[conn->dst_fd]) == 0) {
+					DEBUG("session handed to a relay thread");
+					return;
+				}
+				relay_watch(conn);
+				relay_watch(&conn->srv->connections[conn->dst_fd]);
+				if(offload_start(&conn->srv->connections[conn->dst_fd]) == 0)
+					DEBUG("session offloaded to the kernel");
 			}
-
-		} else if (flags & EPOLLIN) {
-			if(proxy_data(conn) < 0)
-				DEBUG("proxy_data failed");
 		}
 
 	}
@@ -172,11 +234,15 @@ int recv_initial_msg(struct connection *conn)
 	if(len < 0) 
 		return -1;
 	
-	conn->recv_time = time(NULL);
+	conn->recv_time = conn->srv->now;
+
+	/* anything but a SOCKS5 greeting is taken for an HTTP request */
+	if(len > 0 && msg.version != SOCKS5_VERSION)
+		return http_start(conn, &msg, len);
 
 	DEBUG("SOCKS version: %d", msg.version);
 	
-	conn->recv_time = time(NULL);
+	conn->recv_time = conn->srv->now;
 	for( i=0;i < msg.nmethods; i++)
 		if(msg.methods[i]==METHOD_PASSWD) 
 			use_auth = 1;
@@ -186,35 +252,47 @@ int recv_initial_msg(struct connection *conn)
 	msg1.version = SOCKS5_VERSION;
 	if(use_auth)
 		msg1.method = METHOD_PASSWD;
+	else if(admission_near(conn->srv))
+		msg1.method = METHOD_NOACCPT;
 	else
 		msg1.method = METHOD_NOAUTH;
 	
 	len = send(conn->fd, (char *)&msg1, sizeof msg1, MSG_DONTWAIT);
 	if(len < 0) 
 		return -1;
+	capture_auth(conn, msg1.method);
+
+	if(msg1.method == METHOD_NOACCPT) {
+		/* near the limit only clients that can authenticate get in */
+		DEBUG("Rejecting unauthenticated client under load");
+		admission_reject_greeting();
+		connection_close(conn);
+		return 0;
+	}
 	
 	DEBUG("Sent data Length: %d\n", len);
 	if(use_auth)
-		conn->state = S5_AUTH;
+		connection_set_state(conn, S5_AUTH);
 	else
-		conn->state = S5_REQST;
+		connection_set_state(conn, S5_REQST);
 	return 0;
 }
 
+#define REPLY_ERR(code) { \
+			send_reply(conn, code); \
+            connection_close(conn); \
+            return 0; \
+	}
+
 int process_request(struct connection *conn) 
 {
-	struct epoll_event ev;
-	struct sockaddr_in target_addr;
-	struct sockaddr_in6 target_addr6;
 	struct socks5_request_msg msg;
 	int len;
 	int addr_type = AF_INET;
 	in_addr_t dst_addr = INADDR_ANY;
 	in_port_t dst_port = 0;
 	struct in6_addr dst_addr6 = in6addr_any;
-	struct hostent *dnsinfo = NULL;
 	char hostname[256]={0};
-	int fd;
 
 	DEBUG("Processing request...");
 
@@ -224,19 +302,21 @@ int process_request(struct connection *conn)
 	
 	if(len < 0)
 		return -1;
-#define REPLY_ERR(code) { \
-			send_reply(conn, REPLY_ADDRERR); \
-            connection_close(conn); \
-            return 0; \
-	}
-	conn->recv_time = time(NULL);
+	conn->recv_time = conn->srv->now;
 
 	DEBUG("REQUEST: ver: %d, CMD: %d, ATYP: %d", msg.version,
 		msg.command, msg.addr_type);
+	capture_request(conn, msg.addr_type);
+
+	if(admission_request(conn) != REPLY_SUCCESS)
+		REPLY_ERR(REPLY_FAILURE);
 
 	if(msg.command != CMD_CONNECT) 
 		REPLY_ERR(REPLY_CMDNSPR);
 
+	if(account_request(conn) != REPLY_SUCCESS)
+		REPLY_ERR(REPLY_NALLOWD);
+
 	switch(msg.addr_type) {
 		case ATYP_IPV4:
 			addr_type = AF_INET;
@@ -247,16 +327,11 @@ int process_request(struct connection *conn)
 			len = (unsigned int) msg.buffer[0];
 			if(len < 256) {
 				strncpy(hostname, &msg.buffer[1], len);
-				dnsinfo = gethostbyname(hostname);
-				if(dnsinfo!=NULL && dnsinfo->h_length > 0) {
-					DEBUG("hostent: name: %s, type: %d, length: %d, ip_addr = %s\n",
-                dnsinfo->h_name, dnsinfo->h_addrtype, dnsinfo->h_length, inet_ntoa(*(struct in_addr *) dnsinfo->h_addr));
-					addr_type = dnsinfo->h_addrtype;
-					dst_addr = ((struct in_addr *) dnsinfo->h_addr)->s_addr;
-				} else 
-					REPLY_ERR(REPLY_HSTNRCH);
-				
 				dst_port = *((in_port_t *) &msg.buffer[len+1]);
+				/* connect_target() follows once the resolver threads answer */
+				if(dns_lookup(conn, hostname, dst_port) < 0)
+					REPLY_ERR(REPLY_FAILURE);
+				return 0;
 			}
 			break;
 		case ATYP_IPV6: 
@@ -270,16 +345,24 @@ int process_request(struct connection *conn)
 	}
 
 	DEBUG("Request processed! addr type: %d", addr_type);
+	return connect_target(conn, addr_type, dst_addr, &dst_addr6, dst_port);
+}
 
-	if(conn->srv->open_count >= conn->srv->open_max)
-		REPLY_ERR(REPLY_FAILURE);
-
-	// try to connect to dst
-	fd = socket(addr_type, SOCK_STREAM|SOCK_NONBLOCK, 0);
+/**
+ * Second half of a request, shared by SOCKS and HTTP CONNECT: breaker,
+ * egress and the non-blocking connect. Failures are answered with
+ * send_reply() and close the client.
+ */
+int connect_target(struct connection *conn, int addr_type, in_addr_t dst_addr,
+	const struct in6_addr *dst_addr6, in_port_t dst_port)
+{
+	struct sockaddr_in target_addr;
+	struct sockaddr_in6 target_addr6;
+	struct dest_key dest;
+	struct connection *target;
+	char hostname[INET6_ADDRSTRLEN];
+	int reply, attempt, ret, fd;
 
-	if(fd < 0) 
-		REPLY_ERR(REPLY_FAILURE);
-	
 	memset(&target_addr, 0, sizeof target_addr);
 	memset(&target_addr6 , 0, sizeof target_addr6);
 
@@ -287,72 +370,101 @@ int process_request(struct connection *conn)
 		target_addr.sin_family = AF_INET;
 		target_addr.sin_addr.s_addr = dst_addr;
 		target_addr.sin_port = dst_port;
-		
-		DEBUG("Connecting to ipv4 address: %s:%d", inet_ntoa(target_addr.sin_addr), ntohs(dst_port));
-		
-		len = connect(fd, (struct sockaddr *) &target_addr, sizeof target_addr);
+		dest_key_set(&dest, (struct sockaddr *) &target_addr);
 	} else {
-		memset(hostname, 0, sizeof hostname);
-		inet_ntop(AF_INET6, &dst_addr6, hostname, sizeof hostname);
-		
 		target_addr6.sin6_family = AF_INET6;
-		target_addr6.sin6_addr = dst_addr6;
+		target_addr6.sin6_addr = *dst_addr6;
 		target_addr6.sin6_port = dst_port;
-	
-		DEBUG("Connecting to ipv6 address: %s:%d", hostname, ntohs(dst_port));
+		dest_key_set(&dest, (struct sockaddr *) &target_addr6);
+	}
+
+	/* known dead destinations are answered without a connect */
+	if((reply = dest_admit(&dest, conn->srv->now)) != REPLY_SUCCESS)
+		REPLY_ERR(reply);
+
+	/* over the cap of the destination, wait for one of its sessions to end */
+	if(!conn->capped) {
+		switch(dest_acquire(conn, &dest)) {
+			case -1:
+				REPLY_ERR(REPLY_FAILURE);
+			case 1:
+				DEBUG("Queued for a connect slot");
+				conn->deadline = conn->srv->now + connect_timeout;
+				connection_set_state(conn, S5_QUEUED);
+				return connection_watch(conn, EPOLLRDHUP);
+		}
+	}
+
+	// try to connect to dst
+	for(attempt = 0;; attempt++) {
+		fd = mptcp_socket(addr_type);
+
+		if(fd < 0) 
+			REPLY_ERR(REPLY_FAILURE);
+		busypoll_socket(fd);
+
+		target = &conn->srv->connections[fd];
+		target->dest = dest;
+		if(egress_bind(target, conn, attempt) < 0) {
+			close(fd);
+			REPLY_ERR(REPLY_FAILURE);
+		}
+
+		if(addr_type==AF_INET) {
+			DEBUG("Connecting to ipv4 address: %s:%d", inet_ntoa(target_addr.sin_addr), ntohs(dst_port));
+			
+			PROBE2(connect_start, conn->id, fd);
+			ret = connect(fd, (struct sockaddr *) &target_addr, sizeof target_addr);
+		} else {
+			inet_ntop(AF_INET6, dst_addr6, hostname, sizeof hostname);
+		
+			DEBUG("Connecting to ipv6 address: %s:%d", hostname, ntohs(dst_port));
 
-		len = connect(fd, (struct sockaddr *) &target_addr6, sizeof target_addr6);
+			PROBE2(connect_start, conn->id, fd);
+			ret = connect(fd, (struct sockaddr *) &target_addr6, sizeof target_addr6);
+		}
+		/* out of ports on this source address, try the next one */
+		if(ret == 0 || errno != EADDRNOTAVAIL || attempt + 1 >= egress_count(addr_type))
+			break;
+		DEBUG("Egress address exhausted");
+		egress_release(target, 1);
+		close(fd);
 	}
-	if(errno != EINPROGRESS) {
+	topk_add(TOPK_SESSIONS, &dest, 1);
+	if(ret < 0 && errno != EINPROGRESS) {
 		DEBUG("Connection failed");
-		REPLY_ERR(REPLY_FAILURE);
+		topk_add(TOPK_FAILURES, &dest, 1);
+		reply = connect_reply(errno);
+		dest_failure(&dest, reply, conn->srv->now);
+		egress_release(target, errno == EADDRNOTAVAIL);
+		close(fd);
+		REPLY_ERR(reply);
 	}
 
-	connection_open(&conn->srv->connections[fd], TARGET);
-	
+	connection_open(target, TARGET);
+	target->id = conn->id;
+	conn->deadline = conn->srv->now + connect_timeout;
 
 	conn->dst_fd = fd;
 	conn->srv->connections[fd].dst_fd = conn->fd;
 
-	ev.events = EPOLLOUT;
-	ev.data.fd = fd;
-
-	if(epoll_ctl(conn->srv->epollfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+	if(connection_watch(&conn->srv->connections[fd], EPOLLOUT) < 0)
 		return -1;
 	
-	conn->state = -1;
-#undef REPLY_ERR
+	connection_set_state(conn, S5_PENDING);
 	return 0;
 }
+#undef REPLY_ERR
 
-int proxy_data(struct connection *conn)
+/* a queued request whose slot came free */
+int connect_queued(struct connection *conn)
 {
-	unsigned char buffer[4096];
-	int len = sizeof buffer;
-	if(conn->type != TARGET && conn->state != S5_CONNECT) {
-		DEBUG("Oops! proxy_data got invalid client");
-		connection_close(conn);
-		return 0;
-	}
-	while(len==sizeof buffer) {
-		//memset(buffer, 0, sizeof buffer);
-		len = recv(conn->fd, buffer, sizeof buffer, MSG_DONTWAIT);
-		if(len < 0) {
-			DEBUG("proxy_data failed while recv()");
-			connection_close(conn);
-			return -1;
-		}
+	struct in6_addr addr6;
+	in_addr_t addr;
 
-		conn->recv_time = time(NULL);
-
-		len = send(conn->dst_fd, buffer, len, MSG_DONTWAIT);
-		if(len < 0) {
-            DEBUG("proxy_data failed while send()");
-            connection_close(conn);
-            return -1;
-        }
-	}
-	return 0;
+	memcpy(&addr, conn->dest.addr, sizeof addr);
+	memcpy(&addr6, conn->dest.addr, sizeof addr6);
+	return connect_target(conn, conn->dest.family, addr, &addr6, conn->dest.port);
 }
 
 int send_reply(struct connection *conn, int reply)
@@ -366,6 +478,12 @@ int send_reply(struct connection *conn, int reply)
     msg.bind_addr = conn->srv->ip;
     msg.bind_port = conn->srv->port;
 	msg.reply = reply;
+	capture_reply(conn, reply);
+	/* a transparent client has nobody to read a reply, it sees the close */
+	if(conn->transparent)
+		return 0;
+	if(conn->http)
+		return http_reply(conn, reply);
 
 	len = send(conn->fd, &msg, sizeof msg, MSG_DONTWAIT);
 
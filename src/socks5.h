@@ -30,14 +30,46 @@
 #define SOCKS5_PWD		"PASS"
 
 
+/**
+ * The session states, from S5_PENDING (-1): X(enum name, stats label).
+ * The enum, the names in the admin listing and the flight decoder and
+ * the handler kinds of the loop telemetry all come from this list, so
+ * a new state is added here only.
+ */
+#define SOCKS5_STATES \
+	X(PENDING, pending)	/* request sent on, waiting for the target connect */ \
+	X(IDENT, ident) \
+	X(AUTH, auth) \
+	X(REQST, request) \
+	X(REPLY, reply) \
+	X(CONNECT, connect) \
+	X(UDPASS, udp) \
+	X(HTTP, http)		/* reading an HTTP CONNECT header */ \
+	X(QUEUED, queued)	/* waiting for a --dest-cap slot */ \
+	X(TLS, tls)		/* TLS handshake on the --tls-port listener */ \
+	X(RESOLVE, resolve)	/* the target name is with the resolver threads */
+
 enum socks5_state {
-	S5_IDENT,
-	S5_AUTH,
-	S5_REQST,
-	S5_REPLY,
-	S5_CONNECT,
-	S5_UDPASS
-};	
+	S5_BASE = -2,		/* so the list starts at -1 */
+#define X(name, label) S5_##name,
+	SOCKS5_STATES
+#undef X
+	S5_END
+};
+
+/* how many there are, for tables indexed by state + 1 */
+#define S5_STATES	(S5_END - S5_BASE - 1)
+
+static inline const char *socks5_state_name(int state)
+{
+	static const char *names[S5_STATES] = {
+#define X(name, label) #name,
+		SOCKS5_STATES
+#undef X
+	};
+
+	return state >= S5_PENDING && state < S5_END ? names[state + 1] : "?";
+}
 
 enum socks5_auth_method {
 	METHOD_NOAUTH = 0, //NO AUTHENTICATION REQUIRED
@@ -126,7 +158,8 @@ int socks5_auth_check(struct connection *);
 void handle_client(struct connection *, unsigned int);
 int recv_initial_msg(struct connection *);
 int process_request(struct connection *);
+int connect_target(struct connection *, int, in_addr_t, const struct in6_addr *, in_port_t);
+int connect_queued(struct connection *);
 int send_reply(struct connection *, int);
-int proxy_data(struct connection *);
 
 #endif 
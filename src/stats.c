@@ -0,0 +1,166 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/resource.h>
+
+#include "util.h"
+#include "server.h"
+#include "pool.h"
+#include "admission.h"
+#include "topk.h"
+#include "dest.h"
+#include "egress.h"
+#include "offload.h"
+#include "tcpstat.h"
+#include "account.h"
+#include "tls.h"
+#include "busypoll.h"
+#include "mptcp.h"
+#include "loopstat.h"
+#include "rthread.h"
+#include "dns.h"
+#include "stats.h"
+
+extern int debug;
+extern time_t uptime;
+extern char *stats_file;
+
+void stats_dump(struct server *srv, FILE *fp)
+{
+	struct pool_stats ps;
+	struct admission_stats as;
+	struct dest_stats ds;
+	struct offload_stats os;
+	struct tls_stats ts;
+	struct busypoll_stats bs;
+	struct mptcp_stats ms;
+	struct dns_stats ns;
+	struct rusage ru;
+	struct server rs = *srv;
+
+	rthread_totals(&rs);
+	pool_get_stats(&ps);
+	admission_get_stats(&as);
+	dest_get_stats(&ds);
+	offload_get_stats(&os);
+	tls_get_stats(&ts);
+	busypoll_get_stats(&bs);
+	mptcp_get_stats(&ms);
+	dns_get_stats(&ns);
+	getrusage(RUSAGE_SELF, &ru);
+
+	fprintf(fp, "pid %d\n", getpid());
+	fprintf(fp, "uptime %ld\n", time(NULL) - uptime);
+	fprintf(fp, "sessions_total %lu\n", srv->session_seq);
+	fprintf(fp, "cpu_user_us %ld\n", ru.ru_utime.tv_sec * 1000000L + ru.ru_utime.tv_usec);
+	fprintf(fp, "cpu_system_us %ld\n", ru.ru_stime.tv_sec * 1000000L + ru.ru_stime.tv_usec);
+	fprintf(fp, "open_connections %d\n", srv->open_count - 5);
+	fprintf(fp, "open_max %d\n", srv->open_max);
+	fprintf(fp, "accept_paused %d\n", as.paused);
+	fprintf(fp, "accept_pauses %lu\n", as.pauses);
+	fprintf(fp, "admission_ip_rejects %lu\n", as.ip_rejects);
+	fprintf(fp, "admission_greeting_rejects %lu\n", as.greeting_rejects);
+	fprintf(fp, "admission_request_rejects %lu\n", as.request_rejects);
+	fprintf(fp, "breaker_tracked %lu\n", ds.tracked);
+	fprintf(fp, "breaker_open %lu\n", ds.open);
+	fprintf(fp, "breaker_trips %lu\n", ds.trips);
+	fprintf(fp, "breaker_fast_fails %lu\n", ds.fast_fails);
+	fprintf(fp, "breaker_probes %lu\n", ds.probes);
+	fprintf(fp, "dest_queue_waiting %lu\n", ds.waiting);
+	fprintf(fp, "dest_queue_waits %lu\n", ds.waits);
+	fprintf(fp, "dest_queue_full %lu\n", ds.queue_full);
+	fprintf(fp, "dest_table_full %lu\n", ds.table_full);
+	fprintf(fp, "dest_evictions %lu\n", ds.evictions);
+	fprintf(fp, "dest_queue_expired %lu\n", ds.expired);
+	fprintf(fp, "dest_queue_wait_us %lu\n", ds.wait_us);
+	fprintf(fp, "dest_queue_wait_max_us %lu\n", ds.wait_max_us);
+	fprintf(fp, "dns_lookups %lu\n", ns.lookups);
+	fprintf(fp, "dns_failures %lu\n", ns.failures);
+	fprintf(fp, "dns_timeouts %lu\n", ns.timeouts);
+	fprintf(fp, "dns_queue_full %lu\n", ns.queue_full);
+	fprintf(fp, "pool_budget_bytes %zu\n", ps.budget);
+	fprintf(fp, "pool_mapped_bytes %zu\n", ps.mapped);
+	fprintf(fp, "pool_peak_bytes %zu\n", ps.peak);
+	fprintf(fp, "pool_slabs %lu\n", ps.slabs);
+	fprintf(fp, "pool_huge_slabs %lu\n", ps.huge_slabs);
+	fprintf(fp, "pool_huge_fallbacks %lu\n", ps.huge_fallbacks);
+	fprintf(fp, "pool_buffers_in_use %lu\n", ps.in_use);
+	fprintf(fp, "pool_buffers_free %lu\n", ps.free);
+	fprintf(fp, "pool_allocs %lu\n", ps.allocs);
+	fprintf(fp, "pool_alloc_failures %lu\n", ps.failures);
+	fprintf(fp, "relay_stalls %lu\n", rs.stalls);
+	fprintf(fp, "relay_yields %lu\n", rs.relay_yields);
+	fprintf(fp, "relay_reads %lu\n", rs.relay_reads);
+	fprintf(fp, "relay_writes %lu\n", rs.relay_writes);
+	fprintf(fp, "relay_bytes %lu\n", rs.relay_bytes);
+	fprintf(fp, "relay_syscalls_per_mb %.1f\n", rs.relay_bytes ? 
+		(rs.relay_reads + rs.relay_writes) * 1048576.0 / rs.relay_bytes : 0.0);
+	fprintf(fp, "relay_zerocopy_sends %lu\n", rs.zc_sends);
+	fprintf(fp, "relay_zerocopy_copied %lu\n", rs.zc_copied);
+	rthread_dump(fp);
+	fprintf(fp, "offload_sessions %lu\n", os.sessions);
+	fprintf(fp, "offload_active %lu\n", os.active);
+	fprintf(fp, "offload_paused %lu\n", os.paused);
+	fprintf(fp, "offload_failures %lu\n", os.failures);
+	fprintf(fp, "offload_bytes %lu\n", os.bytes);
+	fprintf(fp, "tls_handshakes %lu\n", ts.handshakes);
+	fprintf(fp, "tls_failures %lu\n", ts.failures);
+	fprintf(fp, "tls_ktls_failures %lu\n", ts.ktls_failures);
+	fprintf(fp, "busypoll_epoll %d\n", bs.epoll);
+	fprintf(fp, "busypoll_spin_us %d\n", bs.spin_us);
+	fprintf(fp, "busypoll_socket_failures %lu\n", bs.socket_failures);
+	fprintf(fp, "busypoll_spin_hits %lu\n", bs.hits);
+	fprintf(fp, "busypoll_spin_misses %lu\n", bs.misses);
+	fprintf(fp, "busypoll_spin_total_us %lu\n", bs.spin_us_total);
+	fprintf(fp, "busypoll_spin_wasted_us %lu\n", bs.wasted_us);
+	busypoll_dump(fp);
+	fprintf(fp, "mptcp_enabled %d\n", ms.enabled);
+	fprintf(fp, "mptcp_sockets %lu\n", ms.sockets);
+	fprintf(fp, "mptcp_client_legs %lu\n", ms.legs[TCPSTAT_CLIENT]);
+	fprintf(fp, "mptcp_client_fallbacks %lu\n", ms.fallbacks[TCPSTAT_CLIENT]);
+	fprintf(fp, "mptcp_client_extra_subflows %lu\n", ms.subflows[TCPSTAT_CLIENT]);
+	fprintf(fp, "mptcp_target_legs %lu\n", ms.legs[TCPSTAT_TARGET]);
+	fprintf(fp, "mptcp_target_fallbacks %lu\n", ms.fallbacks[TCPSTAT_TARGET]);
+	fprintf(fp, "mptcp_target_extra_subflows %lu\n", ms.subflows[TCPSTAT_TARGET]);
+	loopstat_dump(fp);
+	egress_dump(fp);
+	topk_dump(fp);
+	tcpstat_dump(fp);
+	account_dump(fp);
+	fflush(fp);
+}
+
+int stats_write(struct server *srv)
+{
+	FILE *fp = stderr;
+
+	if(stats_file && (fp = fopen(stats_file, "a")) == NULL) {
+		DEBUG("could not open %s", stats_file);
+		return -1;
+	}
+	stats_dump(srv, fp);
+	if(fp != stderr)
+		fclose(fp);
+	return 0;
+}
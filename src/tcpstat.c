@@ -0,0 +1,173 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+
+#include "util.h"
+#include "server.h"
+#include "connection.h"
+#include "socks5.h"
+#include "capture.h"
+#include "tcpstat.h"
+#include "mptcp.h"
+
+extern int debug;
+
+enum tcpstat_metric {
+	TCPSTAT_RTT,
+	TCPSTAT_RATE,
+	TCPSTAT_SNDQ,
+	TCPSTAT_RETRANS,
+	TCPSTAT_METRICS
+};
+
+static const char *metric_names[TCPSTAT_METRICS] = {
+	"tcp_rtt_us", "tcp_rate_bytes_per_sec", "tcp_unsent_bytes", "tcp_retrans" };
+static const char *leg_names[TCPSTAT_LEGS] = { "client", "target" };
+
+static struct {
+	int interval;
+	unsigned long hist[TCPSTAT_LEGS][TCPSTAT_METRICS][TCPSTAT_BUCKETS];
+} ts;
+
+int tcpstat_init(int interval)
+{
+	memset(&ts, 0, sizeof ts);
+	ts.interval = interval > 0 ? interval : 0;
+	return 0;
+}
+
+/* bucket b > 0 holds [2^(b-1), 2^b) */
+static void hist_add(int leg, int metric, uint64_t v)
+{
+	int b = 0;
+
+	while(v && b < TCPSTAT_BUCKETS - 1) {
+		v >>= 1;
+		b++;
+	}
+	/* relay threads sample the sessions they run */
+	__atomic_fetch_add(&ts.hist[leg][metric][b], 1, __ATOMIC_RELAXED);
+}
+
+static int sample(struct connection *conn, int leg)
+{
+	struct tcp_info ti;
+	socklen_t len = sizeof ti;
+	struct tcp_sample *s = &conn->tcp;
+
+	memset(&ti, 0, sizeof ti);
+	if(getsockopt(conn->fd, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0)
+		return -1;
+	s->samples++;
+	s->rtt_us = ti.tcpi_rtt;
+	if(s->rtt_us > s->rtt_max_us)
+		s->rtt_max_us = s->rtt_us;
+	s->retrans = ti.tcpi_total_retrans;
+	s->rate = ti.tcpi_delivery_rate;
+	if(ti.tcpi_notsent_bytes > s->sndq_max)
+		s->sndq_max = ti.tcpi_notsent_bytes;
+
+	mptcp_sample(conn->fd, s);
+
+	hist_add(leg, TCPSTAT_RTT, s->rtt_us);
+	hist_add(leg, TCPSTAT_RATE, s->rate);
+	hist_add(leg, TCPSTAT_SNDQ, ti.tcpi_notsent_bytes);
+	return 0;
+}
+
+static void leg_tick(struct connection *conn, int leg)
+{
+	time_t now = conn->srv->now;
+
+	/* spread the first samples over the interval so ticks stay even */
+	if(!conn->tcp.next)
+		conn->tcp.next = now + 1 + conn->fd % ts.interval;
+	if(now < conn->tcp.next)
+		return;
+	conn->tcp.next = now + ts.interval;
+	sample(conn, leg);
+}
+
+void tcpstat_tick(struct connection *client)
+{
+	struct connection *target = connection_peer(client);
+
+	if(!ts.interval)
+		return;
+	leg_tick(client, TCPSTAT_CLIENT);
+	if(target && target->open)
+		leg_tick(target, TCPSTAT_TARGET);
+}
+
+static void leg_close(struct connection *conn, struct connection *client, int leg)
+{
+	struct tcp_sample *s = &conn->tcp;
+
+	if(s->closed)
+		return;
+	s->closed = 1;
+	sample(conn, leg);
+	if(!s->samples)
+		return;
+	hist_add(leg, TCPSTAT_RETRANS, s->retrans);
+	mptcp_close(leg, s);
+	capture_tcp(client, leg, s);
+	DEBUG("session %lu %s leg: rtt %uus (max %uus) retrans %u rate %luB/s unsent max %u",
+		conn->id, leg_names[leg], s->rtt_us, s->rtt_max_us, s->retrans,
+		(unsigned long) s->rate, s->sndq_max);
+}
+
+/* the legs close together, the first one to go takes both final samples */
+void tcpstat_close(struct connection *conn)
+{
+	struct connection *peer = connection_peer(conn);
+	struct connection *client = conn->type == CLIENT ? conn : peer;
+
+	if(!ts.interval || !client || client->state != S5_CONNECT)
+		return;
+	if(conn->type == CLIENT) {
+		leg_close(conn, client, TCPSTAT_CLIENT);
+		if(peer && peer->open)
+			leg_close(peer, client, TCPSTAT_TARGET);
+	} else {
+		leg_close(conn, client, TCPSTAT_TARGET);
+		if(client->open)
+			leg_close(client, client, TCPSTAT_CLIENT);
+	}
+}
+
+void tcpstat_dump(FILE *fp)
+{
+	int leg, m, b;
+
+	if(!ts.interval)
+		return;
+	for(m=0;m < TCPSTAT_METRICS; m++)
+		for(leg=0;leg < TCPSTAT_LEGS; leg++)
+			for(b=0;b < TCPSTAT_BUCKETS; b++)
+				if(ts.hist[leg][m][b])
+					fprintf(fp, "%s %s %lu %lu\n", metric_names[m], leg_names[leg],
+						b ? 1UL << (b - 1) : 0UL, ts.hist[leg][m][b]);
+}
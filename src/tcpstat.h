@@ -0,0 +1,65 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCPSTAT_H
+#define TCPSTAT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * TCP_INFO sampling of both legs of a relaying session, one getsockopt
+ * per leg every --tcp-sample seconds from the timer tick, staggered by
+ * descriptor. Samples go into log2 histograms per leg (smoothed RTT,
+ * delivery rate, unsent bytes; retransmits once per session) and the
+ * last values into the session's capture record, so a slow transfer
+ * can be pinned on the client leg, the target leg or valeria.
+ */
+
+#define DEFAULT_TCP_SAMPLE	(10)
+#define TCPSTAT_BUCKETS		(48)
+
+enum tcpstat_leg {
+	TCPSTAT_CLIENT,
+	TCPSTAT_TARGET,
+	TCPSTAT_LEGS
+};
+
+struct tcp_sample {
+	time_t next;		/* tick of the next sample, 0 before the first */
+	unsigned char closed;	/* final sample taken */
+	uint32_t samples;
+	uint32_t rtt_us;	/* smoothed RTT of the last sample */
+	uint32_t rtt_max_us;
+	uint32_t retrans;	/* segments retransmitted over the connection */
+	uint32_t sndq_max;	/* most bytes written but not yet sent */
+	uint64_t rate;		/* delivery rate of the last sample, bytes/s */
+	uint8_t mptcp;		/* enum mptcp_leg */
+	uint8_t subflows;	/* most MPTCP subflows seen */
+};
+
+struct connection;
+
+int tcpstat_init(int interval);
+void tcpstat_tick(struct connection *client);
+void tcpstat_close(struct connection *conn);
+void tcpstat_dump(FILE *);
+
+#endif
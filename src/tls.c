@@ -0,0 +1,345 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+
+#include "util.h"
+#include "server.h"
+#include "connection.h"
+#include "socks5.h"
+#include "tls.h"
+
+extern int debug;
+
+#ifndef NO_TLS
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <linux/tls.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS		(282)
+#endif
+
+#define TLS_SECRET_MAX	(48)	/* SHA-384 */
+
+/* what the handshake of one session leaves for the kernel */
+struct tls_session {
+	SSL *ssl;
+	unsigned char have;	/* bit 0 client secret, bit 1 server secret */
+	size_t secret_len;
+	unsigned char secret[2][TLS_SECRET_MAX];
+};
+
+static struct {
+	SSL_CTX *ctx;
+	struct tls_stats stats;
+} tls;
+
+/**
+ * OpenSSL has no call that returns the traffic secrets, the key log
+ * callback is the supported way to see them.
+ */
+static void tls_keylog(const SSL *ssl, const char *line)
+{
+	struct tls_session *t = (struct tls_session *) SSL_get_app_data(ssl);
+	const char *hex;
+	unsigned int byte;
+	size_t i, len;
+	int dir;
+
+	if(!strncmp(line, "CLIENT_TRAFFIC_SECRET_0 ", 24))
+		dir = 0;
+	else if(!strncmp(line, "SERVER_TRAFFIC_SECRET_0 ", 24))
+		dir = 1;
+	else
+		return;
+	/* label, client random, secret */
+	if((hex = strchr(line + 24, ' ')) == NULL)
+		return;
+	hex++;
+	len = strlen(hex) / 2;
+	if(len > TLS_SECRET_MAX)
+		return;
+	for(i=0;i < len; i++) {
+		if(sscanf(hex + 2 * i, "%2x", &byte) != 1)
+			return;
+		t->secret[dir][i] = byte;
+	}
+	t->secret_len = len;
+	t->have |= 1 << dir;
+}
+
+/* HKDF-Expand-Label of RFC 8446 with an empty context */
+static int expand_label(const EVP_MD *md, const unsigned char *secret, size_t secret_len,
+	const char *label, unsigned char *out, size_t len)
+{
+	unsigned char info[32];
+	size_t n = 0, label_len = strlen(label);
+	EVP_PKEY_CTX *pctx;
+	int ret = -1;
+
+	info[n++] = len >> 8;
+	info[n++] = len;
+	info[n++] = 6 + label_len;
+	memcpy(info + n, "tls13 ", 6);
+	n += 6;
+	memcpy(info + n, label, label_len);
+	n += label_len;
+	info[n++] = 0;
+
+	if((pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL)) == NULL)
+		return -1;
+	if(EVP_PKEY_derive_init(pctx) > 0 &&
+		EVP_PKEY_CTX_set_hkdf_mode(pctx, EVP_PKEY_HKDEF_MODE_EXPAND_ONLY) > 0 &&
+		EVP_PKEY_CTX_set_hkdf_md(pctx, md) > 0 &&
+		EVP_PKEY_CTX_set1_hkdf_key(pctx, secret, secret_len) > 0 &&
+		EVP_PKEY_CTX_add1_hkdf_info(pctx, info, n) > 0 &&
+		EVP_PKEY_derive(pctx, out, &len) > 0)
+		ret = 0;
+	EVP_PKEY_CTX_free(pctx);
+	return ret;
+}
+
+/* keys of one direction, record sequence 0 */
+static int ktls_install(int fd, int dir, const SSL_CIPHER *cipher,
+	const unsigned char *secret, size_t secret_len)
+{
+	union {
+		struct tls12_crypto_info_aes_gcm_128 gcm128;
+		struct tls12_crypto_info_aes_gcm_256 gcm256;
+		struct tls12_crypto_info_chacha20_poly1305 chacha;
+	} ci;
+	const EVP_MD *md = SSL_CIPHER_get_handshake_digest(cipher);
+	unsigned char key[32], iv[12];
+	size_t key_len, len;
+	int ret;
+
+	memset(&ci, 0, sizeof ci);
+	switch(SSL_CIPHER_get_protocol_id(cipher)) {
+		case 0x1301:	/* TLS_AES_128_GCM_SHA256 */
+			ci.gcm128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+			key_len = 16;
+			len = sizeof ci.gcm128;
+			break;
+		case 0x1302:	/* TLS_AES_256_GCM_SHA384 */
+			ci.gcm256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+			key_len = 32;
+			len = sizeof ci.gcm256;
+			break;
+		case 0x1303:	/* TLS_CHACHA20_POLY1305_SHA256 */
+			ci.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+			key_len = 32;
+			len = sizeof ci.chacha;
+			break;
+		default:
+			return -1;
+	}
+	ci.gcm128.info.version = TLS_1_3_VERSION;
+	if(!md || expand_label(md, secret, secret_len, "key", key, key_len) < 0 ||
+		expand_label(md, secret, secret_len, "iv", iv, sizeof iv) < 0)
+		return -1;
+
+	/* the GCM layouts split the 12 byte nonce into a 4 byte salt and an iv */
+	if(key_len == 16) {
+		memcpy(ci.gcm128.key, key, 16);
+		memcpy(ci.gcm128.salt, iv, 4);
+		memcpy(ci.gcm128.iv, iv + 4, 8);
+	} else if(ci.gcm128.info.cipher_type == TLS_CIPHER_AES_GCM_256) {
+		memcpy(ci.gcm256.key, key, 32);
+		memcpy(ci.gcm256.salt, iv, 4);
+		memcpy(ci.gcm256.iv, iv + 4, 8);
+	} else {
+		memcpy(ci.chacha.key, key, 32);
+		memcpy(ci.chacha.iv, iv, 12);
+	}
+	ret = setsockopt(fd, SOL_TLS, dir, &ci, len);
+	OPENSSL_cleanse(key, sizeof key);
+	OPENSSL_cleanse(&ci, sizeof ci);
+	return ret;
+}
+
+int tls_init(const char *cert, const char *key)
+{
+	int fd, ret;
+
+	/* the ULP is looked up before the socket state is checked */
+	if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+	ret = setsockopt(fd, IPPROTO_TCP, TCP_ULP, "tls", 3);
+	close(fd);
+	if(ret < 0 && errno == ENOENT) {
+		fprintf(stderr, "kernel TLS is not available (CONFIG_TLS, modprobe tls)\n");
+		return -1;
+	}
+	errno = 0;
+
+	if((tls.ctx = SSL_CTX_new(TLS_server_method())) == NULL)
+		return -1;
+	SSL_CTX_set_min_proto_version(tls.ctx, TLS1_3_VERSION);
+	SSL_CTX_set_num_tickets(tls.ctx, 0);
+	SSL_CTX_set_keylog_callback(tls.ctx, tls_keylog);
+	if(SSL_CTX_use_certificate_chain_file(tls.ctx, cert) != 1 ||
+		SSL_CTX_use_PrivateKey_file(tls.ctx, key, SSL_FILETYPE_PEM) != 1 ||
+		SSL_CTX_check_private_key(tls.ctx) != 1) {
+		ERR_print_errors_fp(stderr);
+		return -1;
+	}
+	return 0;
+}
+
+int tls_start(struct connection *conn)
+{
+	struct tls_session *t;
+
+	if((t = (struct tls_session *) calloc(1, sizeof *t)) == NULL ||
+		(t->ssl = SSL_new(tls.ctx)) == NULL) {
+		free(t);
+		connection_close(conn);
+		return -1;
+	}
+	SSL_set_fd(t->ssl, conn->fd);
+	SSL_set_app_data(t->ssl, t);
+	conn->tls = t;
+	connection_set_state(conn, S5_TLS);
+	if(connection_watch(conn, EPOLLIN|EPOLLRDHUP) < 0) {
+		connection_close(conn);
+		return -1;
+	}
+	return 0;
+}
+
+int tls_handshake(struct connection *conn)
+{
+	struct tls_session *t = conn->tls;
+	const SSL_CIPHER *cipher;
+	int ret;
+
+	ERR_clear_error();
+	if((ret = SSL_accept(t->ssl)) <= 0) {
+		switch(SSL_get_error(t->ssl, ret)) {
+			case SSL_ERROR_WANT_READ:
+				return connection_watch(conn, EPOLLIN|EPOLLRDHUP);
+			case SSL_ERROR_WANT_WRITE:
+				return connection_watch(conn, EPOLLOUT|EPOLLRDHUP);
+			default:
+				DEBUG("TLS handshake failed");
+				tls.stats.failures++;
+				ERR_clear_error();
+				connection_close(conn);
+				return 0;
+		}
+	}
+	conn->recv_time = conn->srv->now;
+
+	/* the kernel takes over at record 0 both ways, OpenSSL must not have gone further */
+	cipher = SSL_get_current_cipher(t->ssl);
+	if(t->have != 3 || SSL_has_pending(t->ssl) || !cipher ||
+		setsockopt(conn->fd, IPPROTO_TCP, TCP_ULP, "tls", 3) < 0 ||
+		ktls_install(conn->fd, TLS_TX, cipher, t->secret[1], t->secret_len) < 0 ||
+		ktls_install(conn->fd, TLS_RX, cipher, t->secret[0], t->secret_len) < 0) {
+		DEBUG("kernel TLS setup failed");
+		tls.stats.ktls_failures++;
+		connection_close(conn);
+		return 0;
+	}
+	tls.stats.handshakes++;
+	tls_release(conn);
+	connection_set_state(conn, S5_IDENT);
+	return connection_watch(conn, EPOLLIN|EPOLLRDHUP);
+}
+
+void tls_release(struct connection *conn)
+{
+	struct tls_session *t = conn->tls;
+
+	if(!t)
+		return;
+	conn->tls = NULL;
+	/* no SSL_shutdown(): the kernel owns the connection now, or it is closing */
+	SSL_free(t->ssl);
+	OPENSSL_cleanse(t, sizeof *t);
+	free(t);
+}
+
+void tls_destroy(void)
+{
+	SSL_CTX_free(tls.ctx);
+	tls.ctx = NULL;
+}
+
+#else
+
+static struct {
+	struct tls_stats stats;
+} tls;
+
+int tls_init(const char *cert, const char *key)
+{
+	(void) cert;
+	(void) key;
+	fprintf(stderr, "built without TLS support (make TLS=0)\n");
+	return -1;
+}
+
+int tls_start(struct connection *conn)
+{
+	connection_close(conn);
+	return -1;
+}
+
+int tls_handshake(struct connection *conn)
+{
+	connection_close(conn);
+	return -1;
+}
+
+void tls_release(struct connection *conn)
+{
+	(void) conn;
+}
+
+void tls_destroy(void)
+{
+}
+
+#endif
+
+/* server_timeout(): the session hit its handshake deadline still in S5_TLS */
+void tls_expired(struct connection *conn)
+{
+	DEBUG("session %lu: TLS handshake timed out", conn->id);
+	tls.stats.failures++;
+}
+
+void tls_get_stats(struct tls_stats *stats)
+{
+	*stats = tls.stats;
+}
@@ -0,0 +1,57 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifndef TLS_H
+#define TLS_H
+
+#include "server.h"
+#include "connection.h"
+
+/**
+ * SOCKS5 over TLS. Sessions accepted on --tls-port do a TLS 1.3
+ * handshake with OpenSSL, then the traffic keys are handed to the
+ * kernel (TCP_ULP "tls", TLS_TX and TLS_RX) and the SSL object is
+ * dropped. From there on the socket reads and writes plaintext like any
+ * other: the SOCKS handshake, the relay and zerocopy need no change.
+ *
+ * The kernel starts both directions at record 0, so no session tickets
+ * are sent and nothing past the client Finished may have been read.
+ * A KeyUpdate from the client cannot be followed and ends the session.
+ * Without kernel TLS (CONFIG_TLS) tls_init() fails.
+ *
+ * Experimental: the kernel TLS path has not run on a CONFIG_TLS kernel.
+ */
+
+struct tls_stats {
+	unsigned long handshakes;	/* handed to the kernel */
+	unsigned long failures;		/* handshake failed or timed out */
+	unsigned long ktls_failures;	/* handshake done, the kernel refused the keys */
+};
+
+int tls_init(const char *cert, const char *key);
+int tls_start(struct connection *);
+int tls_handshake(struct connection *);
+void tls_release(struct connection *);
+void tls_expired(struct connection *);
+void tls_get_stats(struct tls_stats *);
+void tls_destroy(void);
+
+#endif
@@ -0,0 +1,222 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "topk.h"
+
+extern int debug;
+
+struct topk_slot {
+	struct dest_key key;
+	unsigned long count;
+	unsigned long error;	/* count inherited from the evicted key */
+	unsigned int pos;	/* index in heap */
+};
+
+struct sketch {
+	struct topk_slot *slots;
+	unsigned int *heap;	/* min-heap of slot indexes by count */
+	int *index;		/* open addressing, slot index or -1 */
+	unsigned int mask;
+	unsigned int used;
+};
+
+static const char *names[TOPK_METRICS] = {
+	"top_sessions",
+	"top_bytes",
+	"top_failures"
+};
+
+static struct {
+	unsigned int k;
+	struct sketch sk[TOPK_METRICS];
+} topk;
+
+static unsigned int index_find(struct sketch *sk, const struct dest_key *key)
+{
+	unsigned int i = dest_key_hash(key) & sk->mask;
+
+	while(sk->index[i] >= 0 && !dest_key_equal(&sk->slots[sk->index[i]].key, key))
+		i = (i + 1) & sk->mask;
+	return i;
+}
+
+/* backward shift deletion, same as the admission ip table */
+static void index_remove(struct sketch *sk, unsigned int i)
+{
+	unsigned int j = i, h;
+
+	for(;;) {
+		sk->index[i] = -1;
+		do {
+			j = (j + 1) & sk->mask;
+			if(sk->index[j] < 0)
+				return;
+			h = dest_key_hash(&sk->slots[sk->index[j]].key) & sk->mask;
+		} while(i <= j ? (i < h && h <= j) : (i < h || h <= j));
+		sk->index[i] = sk->index[j];
+		i = j;
+	}
+}
+
+static void heap_swap(struct sketch *sk, unsigned int a, unsigned int b)
+{
+	unsigned int t = sk->heap[a];
+
+	sk->heap[a] = sk->heap[b];
+	sk->heap[b] = t;
+	sk->slots[sk->heap[a]].pos = a;
+	sk->slots[sk->heap[b]].pos = b;
+}
+
+#define HEAP_COUNT(sk, i)	((sk)->slots[(sk)->heap[i]].count)
+
+static void heap_up(struct sketch *sk, unsigned int i)
+{
+	while(i && HEAP_COUNT(sk, (i - 1) / 2) > HEAP_COUNT(sk, i)) {
+		heap_swap(sk, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void heap_down(struct sketch *sk, unsigned int i)
+{
+	unsigned int c;
+
+	while((c = 2 * i + 1) < sk->used) {
+		if(c + 1 < sk->used && HEAP_COUNT(sk, c + 1) < HEAP_COUNT(sk, c))
+			c++;
+		if(HEAP_COUNT(sk, i) <= HEAP_COUNT(sk, c))
+			break;
+		heap_swap(sk, i, c);
+		i = c;
+	}
+}
+
+int topk_init(int k)
+{
+	unsigned int size = 2, m, i;
+	struct sketch *sk;
+
+	topk_destroy();
+	if(k <= 0)
+		return 0;
+	while(size < (unsigned int) k * 2)
+		size <<= 1;
+	for(m=0;m < TOPK_METRICS; m++) {
+		sk = &topk.sk[m];
+		sk->slots = (struct topk_slot *) calloc(k, sizeof(struct topk_slot));
+		sk->heap = (unsigned int *) calloc(k, sizeof(unsigned int));
+		sk->index = (int *) malloc(size * sizeof(int));
+		if(!sk->slots || !sk->heap || !sk->index) {
+			topk_destroy();
+			return -1;
+		}
+		for(i=0;i < size; i++)
+			sk->index[i] = -1;
+		sk->mask = size - 1;
+	}
+	topk.k = k;
+	return 0;
+}
+
+void topk_add(int metric, const struct dest_key *key, unsigned long n)
+{
+	struct sketch *sk = &topk.sk[metric];
+	struct topk_slot *slot;
+	unsigned int i, s;
+
+	if(!topk.k)
+		return;
+	i = index_find(sk, key);
+	if(sk->index[i] >= 0) {
+		slot = &sk->slots[sk->index[i]];
+		slot->count += n;
+		heap_down(sk, slot->pos);
+		return;
+	}
+
+	if(sk->used < topk.k) {
+		s = sk->used++;
+		slot = &sk->slots[s];
+		slot->pos = s;
+		sk->heap[s] = s;
+		slot->count = slot->error = 0;
+	} else {
+		/* replace the smallest counter, its count becomes our error */
+		s = sk->heap[0];
+		slot = &sk->slots[s];
+		index_remove(sk, index_find(sk, &slot->key));
+		slot->error = slot->count;
+		i = index_find(sk, key);
+	}
+	slot->key = *key;
+	slot->count += n;
+	sk->index[i] = s;
+	heap_up(sk, slot->pos);
+	heap_down(sk, slot->pos);
+}
+
+static int cmp_slot(const void *a, const void *b)
+{
+	const struct topk_slot *x = *(const struct topk_slot **) a;
+	const struct topk_slot *y = *(const struct topk_slot **) b;
+
+	return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+/* "top_<metric> <dest> <count> <error>", heaviest first */
+void topk_dump(FILE *fp)
+{
+	struct topk_slot **order;
+	struct sketch *sk;
+	char dest[DEST_STRLEN];
+	unsigned int m, i;
+
+	if(!topk.k || (order = (struct topk_slot **) malloc(topk.k * sizeof *order)) == NULL)
+		return;
+	for(m=0;m < TOPK_METRICS; m++) {
+		sk = &topk.sk[m];
+		for(i=0;i < sk->used; i++)
+			order[i] = &sk->slots[i];
+		qsort(order, sk->used, sizeof *order, cmp_slot);
+		for(i=0;i < sk->used; i++)
+			fprintf(fp, "%s %s %lu %lu\n", names[m],
+				dest_key_str(&order[i]->key, dest, sizeof dest),
+				order[i]->count, order[i]->error);
+	}
+	free(order);
+}
+
+void topk_destroy(void)
+{
+	unsigned int m;
+
+	for(m=0;m < TOPK_METRICS; m++) {
+		free(topk.sk[m].slots);
+		free(topk.sk[m].heap);
+		free(topk.sk[m].index);
+	}
+	memset(&topk, 0, sizeof topk);
+}
@@ -0,0 +1,51 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+
+#ifndef TOPK_H
+#define TOPK_H
+
+#include <stdio.h>
+#include "util.h"
+
+/**
+ * Heaviest destinations by sessions, relayed bytes and connect failures.
+ * Each metric is a space-saving sketch of k counters: a destination that
+ * is not tracked takes over the smallest counter and inherits its count
+ * as the error bound. Memory is fixed at init and an update is a hash
+ * probe plus a sift in a heap of k, so it stays on all the time.
+ */
+
+#define DEFAULT_TOPK	(16)
+
+enum topk_metric {
+	TOPK_SESSIONS,
+	TOPK_BYTES,
+	TOPK_FAILURES,
+	TOPK_METRICS
+};
+
+int topk_init(int k);
+void topk_add(int metric, const struct dest_key *, unsigned long n);
+void topk_dump(FILE *);
+void topk_destroy(void);
+
+#endif
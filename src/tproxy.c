@@ -0,0 +1,89 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <linux/netfilter_ipv4.h>
+#include <errno.h>
+
+#include "util.h"
+#include "server.h"
+#include "connection.h"
+#include "socks5.h"
+#include "admission.h"
+#include "capture.h"
+#include "tproxy.h"
+
+extern int debug;
+
+static in_port_t tproxy_port;
+
+int tproxy_listen(struct server *srv, unsigned short port)
+{
+	tproxy_port = htons(port);
+	srv->tfd = server_listen_port(srv, port, 1);
+	return srv->tfd < 0 ? -1 : 0;
+}
+
+int tproxy_start(struct connection *conn)
+{
+	struct sockaddr_in dst;
+	socklen_t len = sizeof dst;
+
+	conn->transparent = 1;
+	capture_auth(conn, METHOD_NOAUTH);
+
+	/**
+	 * REDIRECT rewrote the destination and conntrack remembers the
+	 * original one. Under TPROXY nothing was rewritten and the local
+	 * address of the socket is the target.
+	 */
+	if(getsockopt(conn->fd, SOL_IP, SO_ORIGINAL_DST, &dst, &len) < 0) {
+		len = sizeof dst;
+		if(getsockname(conn->fd, (struct sockaddr *) &dst, &len) < 0) {
+			connection_close(conn);
+			return -1;
+		}
+	}
+	/* dialled directly, the target would be this listener again */
+	if(dst.sin_family != AF_INET || dst.sin_port == tproxy_port) {
+		DEBUG("transparent connection that was not redirected");
+		connection_close(conn);
+		return 0;
+	}
+	capture_request(conn, ATYP_IPV4);
+
+	if(admission_request(conn) != REPLY_SUCCESS) {
+		send_reply(conn, REPLY_FAILURE);
+		connection_close(conn);
+		return 0;
+	}
+
+	/* the client talks first, its bytes wait in the socket until the target is up */
+	if(connection_watch(conn, EPOLLRDHUP) < 0) {
+		connection_close(conn);
+		return -1;
+	}
+	return connect_target(conn, AF_INET, dst.sin_addr.s_addr, NULL, dst.sin_port);
+}
@@ -0,0 +1,38 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifndef TPROXY_H
+#define TPROXY_H
+
+#include "server.h"
+#include "connection.h"
+
+/**
+ * Transparent listener. Connections that iptables REDIRECT or TPROXY
+ * sent to it skip the SOCKS handshake: the target is the destination
+ * the client originally dialled, and the session goes straight to the
+ * connect and then the relay.
+ */
+
+int tproxy_listen(struct server *, unsigned short port);
+int tproxy_start(struct connection *);
+
+#endif
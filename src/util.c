@@ -29,6 +29,10 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "util.h"
 
 
 int socket_connect(char *ip, unsigned short port)
@@ -75,3 +79,50 @@ recv_again:
 	return n;
 }
 
+uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void dest_key_set(struct dest_key *key, const struct sockaddr *sa)
+{
+	memset(key, 0, sizeof *key);
+	key->family = sa->sa_family;
+	if(sa->sa_family == AF_INET6) {
+		key->port = ((struct sockaddr_in6 *) sa)->sin6_port;
+		memcpy(key->addr, &((struct sockaddr_in6 *) sa)->sin6_addr, 16);
+	} else {
+		key->port = ((struct sockaddr_in *) sa)->sin_port;
+		memcpy(key->addr, &((struct sockaddr_in *) sa)->sin_addr, 4);
+	}
+}
+
+/* FNV-1a over the whole key, it is small and fixed size */
+unsigned int dest_key_hash(const struct dest_key *key)
+{
+	const unsigned char *p = (const unsigned char *) key;
+	unsigned int h = 2166136261U;
+	size_t i;
+
+	for(i=0;i < sizeof *key; i++)
+		h = (h ^ p[i]) * 16777619U;
+	return h;
+}
+
+int dest_key_equal(const struct dest_key *a, const struct dest_key *b)
+{
+	return memcmp(a, b, sizeof *a) == 0;
+}
+
+char *dest_key_str(const struct dest_key *key, char *buf, size_t len)
+{
+	char addr[INET6_ADDRSTRLEN];
+
+	if(!inet_ntop(key->family, key->addr, addr, sizeof addr))
+		strcpy(addr, "?");
+	snprintf(buf, len, key->family == AF_INET6 ? "[%s]:%d" : "%s:%d",
+		addr, ntohs(key->port));
+	return buf;
+}
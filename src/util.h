@@ -31,9 +31,10 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <errno.h>
+#include <stdint.h>
 
 #define SYNC_LOCK(ptr) __sync_lock_test_and_set((ptr),1)
-#define SYNC_UNLOCK(ptr) __sync_lock_test_and_set((ptr),0)
+#define SYNC_UNLOCK(ptr) __sync_lock_release((ptr))
 #define SYNC_IS_LOCKED(ptr) ATOMIC_GET((ptr))
 
 #define ATOMIC_ADD(ptr,i) __sync_fetch_and_add((ptr),i)
@@ -42,8 +43,12 @@
 #define ATOMIC_DEC(ptr) ATOMIC_SUB((ptr),1)
 #define ATOMIC_GET(ptr) ATOMIC_ADD((ptr),0)
 
+/* set while a thread runs a session admin "trace <addr>" picked */
+extern __thread int tracing;
+
+/* admin "trace all|off" flips debug while relay threads log */
 #define DEBUG(msg, ...)	{\
-	if(debug) { \
+	if(__atomic_load_n(&debug, __ATOMIC_RELAXED) || tracing) { \
 		if(errno) { \
 			fprintf(stderr, "[ERROR] func:%s in %s:%d --> "msg" (%s)\n", __func__, __FILE__, __LINE__, ##__VA_ARGS__, strerror(errno)); \
 			errno=0;\
@@ -52,8 +57,22 @@
 			fprintf(stderr, msg, ##__VA_ARGS__); \
 		fputc('\n', stderr); }}
 
+/* a target address as the tables keyed by destination see it */
+struct dest_key {
+	uint16_t family;
+	in_port_t port;
+	unsigned char addr[16];
+};
+
+#define DEST_STRLEN	(INET6_ADDRSTRLEN + 8)
+
 int socket_connect(char *ip, unsigned short port);
 int send_buf(int fd, char *buf, size_t len);
 int recv_buf(int fd, char *buf, size_t len);
+uint64_t monotonic_ns(void);
+void dest_key_set(struct dest_key *, const struct sockaddr *);
+unsigned int dest_key_hash(const struct dest_key *);
+int dest_key_equal(const struct dest_key *, const struct dest_key *);
+char *dest_key_str(const struct dest_key *, char *, size_t);
 
 #endif
@@ -0,0 +1,27 @@
+#!/bin/sh
+#
+# bench.sh - run relaybench against a fresh valeria and print the relay
+# counters next to the client side numbers, so builds can be compared
+# on syscalls per MB as well as throughput and round trip time.
+#
+# usage: tools/bench.sh [valeria binary] [extra valeria options...]
+
+BIN=${1:-./valeria}
+[ $# -gt 0 ] && shift
+PORT=${BENCH_PORT:-11080}
+STATS=$(mktemp)
+
+$BIN -d -p $PORT --stats-file $STATS "$@" 2>/dev/null &
+PID=$!
+sleep 0.5
+
+# relay counters cover the bulk transfer only
+./tools/relaybench -p $PORT -m ${BENCH_MB:-512} -n 0
+kill -USR1 $PID
+sleep 1.2
+grep '^relay_' $STATS
+
+./tools/relaybench -p $PORT -m 0 -n ${BENCH_PINGS:-10000}
+kill -INT $PID
+wait $PID 2>/dev/null
+rm -f $STATS
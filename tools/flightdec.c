@@ -0,0 +1,169 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * flightdec - rebuild per-session timelines from a flight recorder dump
+ * (kill -USR2 <pid> writes /tmp/valeria.flight.<pid>). Sessions are
+ * printed in id order, each event with its offset from the session's
+ * first event in nanoseconds.
+ *
+ *	./tools/flightdec -m 50000 /tmp/valeria.flight.1234
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "../src/flight.h"
+#include "../src/socks5.h"
+
+static const char *type_names[FLIGHT_TYPES] = {
+	"none",
+#define X(name) #name,
+	FLIGHT_EVENTS
+#undef X
+};
+
+static struct flight_header hdr;
+static struct flight_event *ev;
+
+static uint64_t to_ns(uint64_t tsc)
+{
+	long double scale = 1.0;
+
+	if(hdr.tsc1 > hdr.tsc0)
+		scale = (long double) (hdr.ns1 - hdr.ns0) / (hdr.tsc1 - hdr.tsc0);
+	return hdr.ns0 + (int64_t) ((long double) ((int64_t) (tsc - hdr.tsc0)) * scale);
+}
+
+/* by session, then in recording order */
+static int cmp_event(const void *x, const void *y)
+{
+	const struct flight_event *a = *(const struct flight_event **) x;
+	const struct flight_event *b = *(const struct flight_event **) y;
+
+	if(a->id != b->id)
+		return a->id < b->id ? -1 : 1;
+	/* a session's events can sit in the rings of two threads */
+	if(a->tsc != b->tsc)
+		return a->tsc < b->tsc ? -1 : 1;
+	return a < b ? -1 : a > b;
+}
+
+static void print_event(const struct flight_event *e, uint64_t t0)
+{
+	printf("  %+12lld  %-14s", (long long) (to_ns(e->tsc) - t0),
+		e->type < FLIGHT_TYPES ? type_names[e->type] : "?");
+	switch(e->type) {
+		case FLIGHT_state:
+			printf("%s -> %s", socks5_state_name(e->a), socks5_state_name(e->b));
+			break;
+		case FLIGHT_dns_done:
+			printf("%s", e->a ? "resolved" : "failed");
+			break;
+		case FLIGHT_connect_done:
+			printf("%s", e->a ? strerror(e->a) : "connected");
+			break;
+		case FLIGHT_relay_read:
+		case FLIGHT_relay_write:
+			printf("fd %d len %d", e->a, e->b);
+			break;
+		case FLIGHT_timeout:
+			printf("fd %d in %s", e->a, socks5_state_name(e->b));
+			break;
+		case FLIGHT_accept:
+		case FLIGHT_connect_start:
+		case FLIGHT_close:
+			printf("fd %d", e->a);
+			break;
+	}
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct flight_event **order;
+	unsigned long long only = 0;
+	long long min_ns = 0;
+	int opt, has_only = 0;
+	uint64_t i, j, t0, t1;
+	char when[64];
+	time_t sec;
+	FILE *fp;
+
+	while((opt = getopt(argc, argv, "s:m:h")) != -1) {
+		switch(opt) {
+			case 's':
+				only = strtoull(optarg, NULL, 10);
+				has_only = 1;
+				break;
+			case 'm':
+				min_ns = atoll(optarg) * 1000;
+				break;
+			default:
+				fprintf(stderr, "Usage: flightdec [-s session id] "
+					"[-m min session span in us] dump\n");
+				exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+	if(optind >= argc || (fp = fopen(argv[optind], "rb")) == NULL) {
+		fprintf(stderr, "flightdec: no dump to read\n");
+		return EXIT_FAILURE;
+	}
+	if(fread(&hdr, sizeof hdr, 1, fp) != 1 || memcmp(hdr.magic, FLIGHT_MAGIC, 8)) {
+		fprintf(stderr, "flightdec: %s is not a flight recorder dump\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+	ev = (struct flight_event *) malloc(hdr.count * sizeof *ev + 1);
+	order = (struct flight_event **) malloc(hdr.count * sizeof *order + 1);
+	if(!ev || !order || fread(ev, sizeof *ev, hdr.count, fp) != hdr.count) {
+		fprintf(stderr, "flightdec: short dump\n");
+		return EXIT_FAILURE;
+	}
+	fclose(fp);
+
+	printf("# pid %u, %llu events, %llu overwritten\n", hdr.pid,
+		(unsigned long long) hdr.count, (unsigned long long) hdr.lost);
+	for(i=0;i < hdr.count; i++)
+		order[i] = &ev[i];
+	qsort(order, hdr.count, sizeof *order, cmp_event);
+
+	for(i=0;i < hdr.count; i = j) {
+		for(j=i+1;j < hdr.count && order[j]->id == order[i]->id; j++)
+			;
+		if(has_only && order[i]->id != only)
+			continue;
+		t0 = to_ns(order[i]->tsc);
+		t1 = to_ns(order[j-1]->tsc);
+		if((long long) (t1 - t0) < min_ns)
+			continue;
+		sec = t0 / 1000000000;
+		strftime(when, sizeof when, "%Y-%m-%d %H:%M:%S", localtime(&sec));
+		printf("session %llu  %s.%09llu  span %llu ns\n", (unsigned long long) order[i]->id,
+			when, (unsigned long long) (t0 % 1000000000), (unsigned long long) (t1 - t0));
+		for(; i < j; i++)
+			print_event(order[i], t0);
+	}
+	free(order);
+	free(ev);
+	return 0;
+}
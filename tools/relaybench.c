@@ -0,0 +1,283 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * relaybench - push a bulk transfer and a small request/response flow
+ * through a running valeria and report throughput and round trip times.
+ * The target is a listener inside this process.
+ *
+ * With -c the pings run while the bulk transfer is going, which shows
+ * what a bulk flow does to the latency of small ones.
+ *
+ *	./tools/relaybench -p 1080 -m 512 -n 10000
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+static char proxy_addr[64] = "127.0.0.1";
+static unsigned short proxy_port = 1080;
+static long bulk_mb = 256;
+static int pings = 10000;
+static int ping_size = 64;
+static int concurrent;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char *msg)
+{
+	perror(msg);
+	exit(EXIT_FAILURE);
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	size_t got = 0;
+	ssize_t n;
+
+	while(got < len) {
+		n = read(fd, (char *) buf + got, len - got);
+		if(n <= 0)
+			return -1;
+		got += n;
+	}
+	return 0;
+}
+
+static int listen_local(unsigned short *port)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof addr;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof addr) < 0 ||
+		listen(fd, 16) < 0 || getsockname(fd, (struct sockaddr *) &addr, &len) < 0)
+		die("listen");
+	*port = addr.sin_port;
+	return fd;
+}
+
+/* SOCKS5 CONNECT to 127.0.0.1:port through the proxy */
+static int socks_connect(unsigned short port)
+{
+	struct sockaddr_in addr;
+	unsigned char msg[10];
+	int fd = socket(AF_INET, SOCK_STREAM, 0), one = 1;
+
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr(proxy_addr);
+	addr.sin_port = htons(proxy_port);
+	if(fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof addr) < 0)
+		die("connect to proxy");
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+	if(write(fd, "\x05\x01\x00", 3) != 3 || read_full(fd, msg, 2) < 0 || msg[1] != 0)
+		die("greeting");
+	msg[0] = 5; msg[1] = 1; msg[2] = 0; msg[3] = 1;
+	*(in_addr_t *) &msg[4] = htonl(INADDR_LOOPBACK);
+	*(in_port_t *) &msg[8] = port;
+	if(write(fd, msg, 10) != 10 || read_full(fd, msg, 10) < 0 || msg[1] != 0)
+		die("request");
+	return fd;
+}
+
+static void *sink(void *arg)
+{
+	int fd = *(int *) arg;
+	char buf[65536];
+	long total = 0;
+	ssize_t n;
+
+	while(total < bulk_mb << 20 && (n = read(fd, buf, sizeof buf)) > 0)
+		total += n;
+	if(write(fd, "k", 1) != 1)
+		perror("sink ack");
+	return (void *) total;
+}
+
+static void *echo(void *arg)
+{
+	int fd = *(int *) arg, one = 1;
+	char buf[65536];
+	ssize_t n;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+	while((n = read(fd, buf, sizeof buf)) > 0)
+		if(write(fd, buf, n) != n)
+			break;
+	return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return x < y ? -1 : x > y;
+}
+
+struct bulk_arg {
+	int lfd;
+	unsigned short port;
+};
+
+static void bench_bulk(int lfd, unsigned short port)
+{
+	static char buf[1 << 20];
+	pthread_t th;
+	void *ret;
+	double t0, t1;
+	long i;
+	int cfd, tfd;
+	char ack;
+
+	cfd = socks_connect(port);
+	if((tfd = accept(lfd, NULL, NULL)) < 0)
+		die("accept");
+	pthread_create(&th, NULL, sink, &tfd);
+
+	memset(buf, 'x', sizeof buf);
+	t0 = now();
+	for(i=0;i < bulk_mb; i++)
+		if(write(cfd, buf, sizeof buf) != sizeof buf)
+			die("bulk write");
+	if(read(cfd, &ack, 1) != 1)
+		perror("bulk ack");
+	t1 = now();
+	pthread_join(th, &ret);
+
+	printf("bulk_bytes %ld\n", (long) ret);
+	printf("bulk_seconds %.3f\n", t1 - t0);
+	printf("bulk_mb_per_sec %.1f\n", bulk_mb / (t1 - t0));
+	close(cfd);
+	close(tfd);
+}
+
+static void *bulk_thread(void *arg)
+{
+	struct bulk_arg *a = (struct bulk_arg *) arg;
+
+	bench_bulk(a->lfd, a->port);
+	return NULL;
+}
+
+static void bench_ping(int lfd, unsigned short port)
+{
+	char buf[65536];
+	double *rtt, t0;
+	pthread_t th;
+	int cfd, tfd, i;
+
+	cfd = socks_connect(port);
+	if((tfd = accept(lfd, NULL, NULL)) < 0)
+		die("accept");
+	pthread_create(&th, NULL, echo, &tfd);
+
+	rtt = (double *) calloc(pings, sizeof(double));
+	memset(buf, 'p', sizeof buf);
+	for(i=0;i < pings; i++) {
+		t0 = now();
+		if(write(cfd, buf, ping_size) != ping_size || read_full(cfd, buf, ping_size) < 0)
+			die("ping");
+		rtt[i] = (now() - t0) * 1e6;
+	}
+	close(cfd);
+	pthread_join(th, NULL);
+	close(tfd);
+
+	qsort(rtt, pings, sizeof(double), cmp_double);
+	printf("ping_count %d\n", pings);
+	printf("ping_p50_us %.1f\n", rtt[pings / 2]);
+	printf("ping_p99_us %.1f\n", rtt[pings * 99 / 100]);
+	printf("ping_p999_us %.1f\n", rtt[pings * 999 / 1000]);
+	printf("ping_max_us %.1f\n", rtt[pings - 1]);
+	free(rtt);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned short port;
+	int opt, lfd;
+
+	struct bulk_arg bulk;
+	pthread_t th;
+
+	while((opt = getopt(argc, argv, "a:p:m:n:s:ch")) != -1) {
+		switch(opt) {
+			case 'a':
+				snprintf(proxy_addr, sizeof proxy_addr, "%s", optarg);
+				break;
+			case 'p':
+				proxy_port = (unsigned short) atoi(optarg);
+				break;
+			case 'm':
+				bulk_mb = atol(optarg);
+				break;
+			case 'n':
+				pings = atoi(optarg);
+				break;
+			case 's':
+				ping_size = atoi(optarg);
+				if(ping_size < 1 || ping_size > 65536)
+					ping_size = 64;
+				break;
+			case 'c':
+				concurrent = 1;
+				break;
+			default:
+				fprintf(stderr, "Usage: relaybench [-a proxy addr] [-p proxy port] "
+					"[-m bulk MB] [-n pings] [-s ping size] [-c]\n");
+				exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+
+	if(concurrent && bulk_mb > 0) {
+		/* the bulk flow gets its own listener so the accepts don't mix */
+		bulk.lfd = listen_local(&bulk.port);
+		pthread_create(&th, NULL, bulk_thread, &bulk);
+		usleep(100000);
+	}
+	lfd = listen_local(&port);
+	if(!concurrent && bulk_mb > 0)
+		bench_bulk(lfd, port);
+	if(pings > 0)
+		bench_ping(lfd, port);
+	if(concurrent && bulk_mb > 0) {
+		pthread_join(th, NULL);
+		close(bulk.lfd);
+	}
+	close(lfd);
+	return 0;
+}
@@ -0,0 +1,723 @@
+/**
+ * valeria - A socks5 server that runs on linux/Win32
+ *
+ * Copyright (C) 2024 lskibu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * replay - play a --capture file back against a running valeria.
+ * Every successful session of the capture is opened at its original
+ * offset (divided by the speed factor), does the same handshake and
+ * moves the same bursts in both directions at the same pace. Targets
+ * are a sink listener inside this process, so nothing leaves the host:
+ * names are requested as "localhost", addresses as 127.0.0.1 / ::1.
+ *
+ *	./tools/replay -p 1080 -s 2 capture.bin
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "../src/capture.h"
+
+#define CHUNK		(65536)
+#define TAG_LEN		(8)
+
+/* epoll data: kind in the top byte, session index or fd below */
+#define EV_LISTEN	(0ULL << 56)
+#define EV_UNPAIRED	(1ULL << 56)
+#define EV_CLIENT	(2ULL << 56)
+#define EV_SINK		(3ULL << 56)
+#define EV_KIND		(0xffULL << 56)
+
+enum {
+	R_WAIT,
+	R_CONNECT,
+	R_GREETING,
+	R_AUTH,
+	R_REPLY,
+	R_RELAY,
+	R_DONE,
+	R_FAILED
+};
+
+struct session {
+	struct capture_record rec;
+	struct capture_burst *bursts;
+	int state;
+	int cfd;		/* our client through the proxy */
+	int sfd;		/* the proxy's connection to our sink */
+	unsigned char in[16];
+	int inlen;
+	uint32_t next;		/* next burst to send */
+	double begin;		/* connect started */
+	double relay_at;	/* reply received */
+	double next_at;		/* when burst next is due */
+	double end_at;		/* recorded close time */
+	size_t up_pending;	/* queued on cfd */
+	size_t down_pending;	/* queued on sfd */
+	uint64_t up_expect, down_expect;
+	uint64_t up_got, down_got;
+	unsigned int cevents, sevents;
+};
+
+struct timer {
+	double at;
+	int id;
+};
+
+static char proxy_addr[64] = "127.0.0.1";
+static unsigned short proxy_port = 1080;
+static char username[256] = "USER", password[256] = "PASS";
+static double speed = 1.0;
+static double limit = 0;
+
+static struct session *sessions;
+static int nsessions;
+static struct timer *heap;
+static int nheap, heap_size;
+static int epfd, lfd4, lfd6;
+static unsigned short sink_port;
+static unsigned char *tags;	/* partial tags of unpaired sink fds, by fd */
+static int *tag_len;
+static char zero[CHUNK];
+static int done, failed, skipped, active;
+static double *setup;
+static int nsetup;
+static double t0;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char *msg)
+{
+	perror(msg);
+	exit(EXIT_FAILURE);
+}
+
+static void timer_add(double at, int id)
+{
+	int i = nheap++, p;
+
+	if(nheap > heap_size) {
+		heap_size = heap_size ? heap_size * 2 : 1024;
+		if((heap = (struct timer *) realloc(heap, heap_size * sizeof *heap)) == NULL)
+			die("realloc");
+	}
+	for(; i && heap[p = (i - 1) / 2].at > at; i = p)
+		heap[i] = heap[p];
+	heap[i].at = at;
+	heap[i].id = id;
+}
+
+static struct timer timer_pop(void)
+{
+	struct timer top = heap[0], last = heap[--nheap];
+	int i = 0, c;
+
+	while((c = 2 * i + 1) < nheap) {
+		if(c + 1 < nheap && heap[c + 1].at < heap[c].at)
+			c++;
+		if(last.at <= heap[c].at)
+			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = last;
+	return top;
+}
+
+static void watch(int fd, unsigned int *cur, unsigned int events, uint64_t data)
+{
+	struct epoll_event ev;
+
+	if(*cur == events)
+		return;
+	ev.events = events;
+	ev.data.u64 = data;
+	if(epoll_ctl(epfd, *cur ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) < 0)
+		die("epoll_ctl");
+	*cur = events;
+}
+
+static void session_close(struct session *s, int state)
+{
+	if(s->cfd >= 0)
+		close(s->cfd);
+	if(s->sfd >= 0)
+		close(s->sfd);
+	s->cfd = s->sfd = -1;
+	s->state = state;
+	active--;
+	if(state == R_DONE)
+		done++;
+	else
+		failed++;
+}
+
+static void session_check(struct session *s)
+{
+	if(s->state != R_RELAY || s->next < s->rec.nbursts || s->up_pending ||
+		s->down_pending || s->up_got < s->up_expect ||
+		s->down_got < s->down_expect || now() < s->end_at)
+		return;
+	session_close(s, R_DONE);
+}
+
+/* queue bytes of zeroes on fd and push out what the socket takes now */
+static int push(int fd, size_t *pending)
+{
+	ssize_t n;
+
+	while(*pending) {
+		n = send(fd, zero, *pending < CHUNK ? *pending : CHUNK, MSG_DONTWAIT|MSG_NOSIGNAL);
+		if(n < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		*pending -= n;
+	}
+	return 0;
+}
+
+static void session_watch(struct session *s)
+{
+	int id = s - sessions;
+
+	if(s->cfd >= 0)
+		watch(s->cfd, &s->cevents, EPOLLIN | (s->up_pending ? EPOLLOUT : 0),
+			EV_CLIENT | id);
+	if(s->sfd >= 0)
+		watch(s->sfd, &s->sevents, EPOLLIN | (s->down_pending ? EPOLLOUT : 0),
+			EV_SINK | id);
+}
+
+static void session_start(struct session *s)
+{
+	struct sockaddr_in addr;
+	int one = 1;
+
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr(proxy_addr);
+	addr.sin_port = htons(proxy_port);
+
+	active++;
+	s->begin = now();
+	s->cfd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK, 0);
+	if(s->cfd < 0) {
+		session_close(s, R_FAILED);
+		return;
+	}
+	setsockopt(s->cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+	if(connect(s->cfd, (struct sockaddr *) &addr, sizeof addr) < 0 && errno != EINPROGRESS) {
+		session_close(s, R_FAILED);
+		return;
+	}
+	s->state = R_CONNECT;
+	watch(s->cfd, &s->cevents, EPOLLOUT, EV_CLIENT | (s - sessions));
+}
+
+static int send_all(int fd, const void *buf, size_t len)
+{
+	return send(fd, buf, len, MSG_NOSIGNAL) == (ssize_t) len ? 0 : -1;
+}
+
+static int send_request(struct session *s)
+{
+	unsigned char msg[32];
+	size_t len = 4;
+
+	msg[0] = 5; msg[1] = 1; msg[2] = 0; msg[3] = s->rec.atyp;
+	switch(s->rec.atyp) {
+		case 3:
+			msg[len++] = 9;
+			memcpy(msg + len, "localhost", 9);
+			len += 9;
+			break;
+		case 4:
+			memcpy(msg + len, &in6addr_loopback, 16);
+			len += 16;
+			break;
+		default:
+			msg[3] = 1;
+			*(in_addr_t *) &msg[len] = htonl(INADDR_LOOPBACK);
+			len += 4;
+	}
+	memcpy(msg + len, &sink_port, 2);
+	len += 2;
+	s->inlen = 0;
+	s->state = R_REPLY;
+	return send_all(s->cfd, msg, len);
+}
+
+static void handshake(struct session *s)
+{
+	unsigned char msg[520];
+	size_t ul, pl;
+	int err = 0, need;
+	socklen_t len = sizeof err;
+	ssize_t n;
+	uint64_t tag;
+
+	if(s->state == R_CONNECT) {
+		if(getsockopt(s->cfd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+			session_close(s, R_FAILED);
+			return;
+		}
+		msg[0] = 5; msg[1] = 1; msg[2] = s->rec.auth == 2 ? 2 : 0;
+		if(send_all(s->cfd, msg, 3) < 0) {
+			session_close(s, R_FAILED);
+			return;
+		}
+		s->state = R_GREETING;
+		s->inlen = 0;
+		watch(s->cfd, &s->cevents, EPOLLIN, EV_CLIENT | (s - sessions));
+		return;
+	}
+
+	need = s->state == R_REPLY ? 10 : 2;
+	n = recv(s->cfd, s->in + s->inlen, need - s->inlen, MSG_DONTWAIT);
+	if(n <= 0) {
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		session_close(s, R_FAILED);
+		return;
+	}
+	if((s->inlen += n) < need)
+		return;
+
+	switch(s->state) {
+		case R_GREETING:
+			if(s->in[1] == 2) {
+				ul = strlen(username);
+				pl = strlen(password);
+				msg[0] = 1;
+				msg[1] = ul;
+				memcpy(msg + 2, username, ul);
+				msg[2 + ul] = pl;
+				memcpy(msg + 3 + ul, password, pl);
+				s->state = R_AUTH;
+				s->inlen = 0;
+				err = send_all(s->cfd, msg, 3 + ul + pl);
+			} else if(s->in[1] == 0)
+				err = send_request(s);
+			else
+				err = -1;
+			break;
+		case R_AUTH:
+			err = s->in[1] ? -1 : send_request(s);
+			break;
+		case R_REPLY:
+			if(s->in[1]) {
+				err = -1;
+				break;
+			}
+			s->relay_at = now();
+			setup[nsetup++] = (s->relay_at - s->begin) * 1e6;
+			s->end_at = s->relay_at + (s->rec.duration_us - s->rec.request_us -
+				s->rec.connect_us) / 1e6 / speed;
+			/* the sink learns which session an accepted connection belongs to */
+			tag = s - sessions;
+			err = send_all(s->cfd, &tag, TAG_LEN);
+			s->state = R_RELAY;
+			if(s->rec.nbursts) {
+				s->next_at = s->relay_at + s->bursts[0].delta_us / 1e6 / speed;
+				timer_add(s->next_at, s - sessions);
+			}
+			timer_add(s->end_at, s - sessions);
+			break;
+	}
+	if(err < 0)
+		session_close(s, R_FAILED);
+}
+
+/* send every burst that is due, then wait for the next one */
+static void session_run(struct session *s)
+{
+	struct capture_burst *b;
+	double t = now();
+
+	while(s->next < s->rec.nbursts && s->next_at <= t) {
+		b = &s->bursts[s->next];
+		if(b->bytes & CAPTURE_DOWN) {
+			if(s->sfd < 0) {
+				/* the proxy has not reached the sink yet */
+				timer_add(t + 0.001, s - sessions);
+				return;
+			}
+			s->down_pending += b->bytes & ~CAPTURE_DOWN;
+		} else
+			s->up_pending += b->bytes;
+		if(++s->next < s->rec.nbursts)
+			s->next_at += s->bursts[s->next].delta_us / 1e6 / speed;
+	}
+	if(s->next < s->rec.nbursts)
+		timer_add(s->next_at, s - sessions);
+
+	if(push(s->cfd, &s->up_pending) < 0 ||
+		(s->sfd >= 0 && push(s->sfd, &s->down_pending) < 0)) {
+		session_close(s, R_FAILED);
+		return;
+	}
+	session_watch(s);
+	session_check(s);
+}
+
+static int drain(int fd, uint64_t *got)
+{
+	static char buf[CHUNK];
+	ssize_t n;
+
+	while((n = recv(fd, buf, sizeof buf, MSG_DONTWAIT)) > 0)
+		*got += n;
+	if(n == 0)
+		return -1;
+	return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+}
+
+static void on_client(struct session *s, unsigned int events)
+{
+	if(s->state < R_RELAY) {
+		if(events & (EPOLLERR|EPOLLHUP) && s->state != R_CONNECT)
+			session_close(s, R_FAILED);
+		else
+			handshake(s);
+		return;
+	}
+	if(s->state != R_RELAY)
+		return;
+	if(events & EPOLLIN && drain(s->cfd, &s->down_got) < 0) {
+		session_close(s, R_FAILED);
+		return;
+	}
+	if(events & EPOLLOUT && push(s->cfd, &s->up_pending) < 0) {
+		session_close(s, R_FAILED);
+		return;
+	}
+	session_watch(s);
+	session_check(s);
+}
+
+static void on_sink(struct session *s, unsigned int events)
+{
+	if(s->state != R_RELAY)
+		return;
+	if(events & EPOLLIN && drain(s->sfd, &s->up_got) < 0) {
+		session_close(s, R_FAILED);
+		return;
+	}
+	if(events & EPOLLOUT && push(s->sfd, &s->down_pending) < 0) {
+		session_close(s, R_FAILED);
+		return;
+	}
+	session_watch(s);
+	session_check(s);
+}
+
+static void on_unpaired(int fd)
+{
+	struct epoll_event ev;
+	struct session *s;
+	uint64_t tag;
+	ssize_t n;
+
+	n = recv(fd, tags + fd * TAG_LEN + tag_len[fd], TAG_LEN - tag_len[fd], MSG_DONTWAIT);
+	if(n <= 0) {
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		goto drop;
+	}
+	if((tag_len[fd] += n) < TAG_LEN)
+		return;
+	memcpy(&tag, tags + fd * TAG_LEN, TAG_LEN);
+	if(tag >= (uint64_t) nsessions || sessions[tag].state != R_RELAY ||
+		sessions[tag].sfd >= 0)
+		goto drop;
+	s = &sessions[tag];
+	ev.events = EPOLLIN;
+	ev.data.u64 = EV_SINK | tag;
+	if(epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+		die("epoll_ctl");
+	s->sfd = fd;
+	s->sevents = EPOLLIN;
+	session_run(s);
+	return;
+drop:
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+	close(fd);
+}
+
+static void on_accept(int lfd)
+{
+	struct epoll_event ev;
+	int fd, one = 1;
+
+	while((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+		tag_len[fd] = 0;
+		ev.events = EPOLLIN;
+		ev.data.u64 = EV_UNPAIRED | fd;
+		if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+			die("epoll_ctl");
+	}
+}
+
+static int sink_listen(int family)
+{
+	struct sockaddr_in6 addr6;
+	struct sockaddr_in addr;
+	struct epoll_event ev;
+	socklen_t len = sizeof addr;
+	int fd = socket(family, SOCK_STREAM|SOCK_NONBLOCK, 0), one = 1;
+
+	if(fd < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+	if(family == AF_INET) {
+		memset(&addr, 0, sizeof addr);
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr.sin_port = sink_port;
+		if(bind(fd, (struct sockaddr *) &addr, sizeof addr) < 0 ||
+			getsockname(fd, (struct sockaddr *) &addr, &len) < 0)
+			die("sink bind");
+		sink_port = addr.sin_port;
+	} else {
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof one);
+		memset(&addr6, 0, sizeof addr6);
+		addr6.sin6_family = AF_INET6;
+		addr6.sin6_addr = in6addr_loopback;
+		addr6.sin6_port = sink_port;
+		if(bind(fd, (struct sockaddr *) &addr6, sizeof addr6) < 0) {
+			/* no ipv6 here, those sessions will fail */
+			close(fd);
+			return -1;
+		}
+	}
+	if(listen(fd, 4096) < 0)
+		die("listen");
+	ev.events = EPOLLIN;
+	ev.data.u64 = EV_LISTEN | fd;
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		die("epoll_ctl");
+	return fd;
+}
+
+static void load(const char *path)
+{
+	struct capture_record rec;
+	struct session *s;
+	char magic[8];
+	int size = 0;
+	size_t bsize;
+	FILE *fp;
+	uint32_t i;
+
+	if((fp = fopen(path, "r")) == NULL)
+		die(path);
+	if(fread(magic, 8, 1, fp) != 1 || memcmp(magic, CAPTURE_MAGIC, 8)) {
+		fprintf(stderr, "%s: not a valeria capture\n", path);
+		exit(EXIT_FAILURE);
+	}
+	while(fread(&rec, sizeof rec, 1, fp) == 1) {
+		bsize = rec.nbursts * sizeof(struct capture_burst);
+		if(rec.len != sizeof rec + bsize) {
+			fprintf(stderr, "%s: corrupt record\n", path);
+			break;
+		}
+		/* sessions that never got a target are not worth replaying */
+		if(rec.reply != 0) {
+			fseek(fp, bsize, SEEK_CUR);
+			skipped++;
+			continue;
+		}
+		if(nsessions == size) {
+			size = size ? size * 2 : 1024;
+			sessions = (struct session *) realloc(sessions, size * sizeof *sessions);
+			if(!sessions)
+				die("realloc");
+		}
+		s = &sessions[nsessions];
+		memset(s, 0, sizeof *s);
+		s->rec = rec;
+		s->cfd = s->sfd = -1;
+		if((s->bursts = (struct capture_burst *) malloc(bsize + 1)) == NULL)
+			die("malloc");
+		if(bsize && fread(s->bursts, bsize, 1, fp) != 1)
+			break;
+		for(i=0;i < rec.nbursts; i++)
+			if(s->bursts[i].bytes & CAPTURE_DOWN)
+				s->down_expect += s->bursts[i].bytes & ~CAPTURE_DOWN;
+			else
+				s->up_expect += s->bursts[i].bytes;
+		nsessions++;
+	}
+	fclose(fp);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+	struct epoll_event events[256];
+	struct rlimit rlim;
+	struct timer t;
+	struct session *s;
+	double span = 0, wait;
+	int opt, i, n, fd, started = 0;
+	uint64_t kind, up = 0, down = 0;
+	char *sep;
+
+	while((opt = getopt(argc, argv, "a:p:s:u:t:h")) != -1) {
+		switch(opt) {
+			case 'a':
+				snprintf(proxy_addr, sizeof proxy_addr, "%s", optarg);
+				break;
+			case 'p':
+				proxy_port = (unsigned short) atoi(optarg);
+				break;
+			case 's':
+				speed = atof(optarg);
+				if(speed <= 0)
+					speed = 1.0;
+				break;
+			case 'u':
+				if((sep = strchr(optarg, ':')) == NULL) {
+					fprintf(stderr, "-u wants user:pass\n");
+					exit(EXIT_FAILURE);
+				}
+				*sep = 0;
+				snprintf(username, sizeof username, "%s", optarg);
+				snprintf(password, sizeof password, "%s", sep + 1);
+				break;
+			case 't':
+				limit = atof(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: replay [-a proxy addr] [-p proxy port] [-s speed] "
+					"[-u user:pass] [-t seconds limit] capture\n");
+				exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+	if(optind >= argc) {
+		fprintf(stderr, "replay: no capture file\n");
+		exit(EXIT_FAILURE);
+	}
+	load(argv[optind]);
+	if(!nsessions) {
+		fprintf(stderr, "replay: nothing to replay (%d skipped)\n", skipped);
+		exit(EXIT_FAILURE);
+	}
+
+	if(getrlimit(RLIMIT_NOFILE, &rlim) == 0) {
+		rlim.rlim_cur = rlim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rlim);
+	}
+	n = sysconf(_SC_OPEN_MAX);
+	tags = (unsigned char *) calloc(n, TAG_LEN);
+	tag_len = (int *) calloc(n, sizeof(int));
+	setup = (double *) calloc(nsessions, sizeof(double));
+	if(!tags || !tag_len || !setup)
+		die("calloc");
+
+	if((epfd = epoll_create1(0)) < 0)
+		die("epoll_create1");
+	lfd4 = sink_listen(AF_INET);
+	lfd6 = sink_listen(AF_INET6);
+
+	t0 = now();
+	for(i=0;i < nsessions; i++) {
+		timer_add(t0 + sessions[i].rec.start_us / 1e6 / speed, i);
+		if(sessions[i].rec.start_us + sessions[i].rec.duration_us > span)
+			span = sessions[i].rec.start_us + sessions[i].rec.duration_us;
+	}
+	span /= 1e6;
+
+	while(started < nsessions || active) {
+		if(limit > 0 && now() - t0 > limit)
+			break;
+		while(nheap && heap[0].at <= now()) {
+			t = timer_pop();
+			s = &sessions[t.id];
+			if(s->state == R_WAIT) {
+				started++;
+				session_start(s);
+			} else if(s->state == R_RELAY)
+				session_run(s);
+		}
+		wait = nheap ? (heap[0].at - now()) * 1000 : 1000;
+		n = epoll_wait(epfd, events, sizeof events / sizeof events[0],
+			wait < 0 ? 0 : (int) wait + 1);
+		if(n < 0 && errno != EINTR)
+			die("epoll_wait");
+		for(i=0;i < n; i++) {
+			kind = events[i].data.u64 & EV_KIND;
+			fd = (int) (events[i].data.u64 & ~EV_KIND);
+			if(kind == EV_LISTEN)
+				on_accept(fd);
+			else if(kind == EV_UNPAIRED)
+				on_unpaired(fd);
+			else if(kind == EV_CLIENT)
+				on_client(&sessions[fd], events[i].events);
+			else
+				on_sink(&sessions[fd], events[i].events);
+		}
+	}
+
+	for(i=0;i < nsessions; i++) {
+		up += sessions[i].up_got;
+		down += sessions[i].down_got;
+	}
+	qsort(setup, nsetup, sizeof(double), cmp_double);
+	printf("sessions %d\n", nsessions);
+	printf("sessions_done %d\n", done);
+	printf("sessions_failed %d\n", failed);
+	printf("sessions_unfinished %d\n", nsessions - done - failed);
+	printf("sessions_skipped %d\n", skipped);
+	printf("bytes_up %lu\n", (unsigned long) up);
+	printf("bytes_down %lu\n", (unsigned long) down);
+	if(nsetup) {
+		printf("setup_p50_us %.1f\n", setup[nsetup / 2]);
+		printf("setup_p99_us %.1f\n", setup[nsetup * 99 / 100]);
+	}
+	printf("trace_seconds %.3f\n", span / speed);
+	printf("replay_seconds %.3f\n", now() - t0);
+	if(lfd6 >= 0)
+		close(lfd6);
+	close(lfd4);
+	return failed ? EXIT_FAILURE : 0;
+}